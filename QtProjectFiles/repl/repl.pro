@@ -1,24 +1,39 @@
 TEMPLATE = app
 CONFIG += console
 CONFIG -= qt
+CONFIG += c++11
 
-LIBS += -lreadline -ltcmalloc
+LIBS += -lreadline -ltcmalloc -pthread
 
 SOURCES += \
     ../../repl/main.cpp
 
 HEADERS += \
     ../../include/Value.h \
+    ../../include/Item.h \
     ../../include/Types.h \
+    ../../include/Map.h \
     ../../include/Type.h \
     ../../include/Stdlib.h \
     ../../include/Stack.h \
     ../../include/Runnable.h \
     ../../include/PebbleScript.h \
     ../../include/Parser.h \
+    ../../include/Optimizer.h \
+    ../../include/ContinuationStack.h \
+    ../../include/Program.h \
+    ../../include/VMPool.h \
+    ../../include/Parallel.h \
+    ../../include/Batch.h \
+    ../../include/Task.h \
+    ../../include/Channel.h \
     ../../include/Operation.h \
     ../../include/NumericUtils.h \
+    ../../include/Arithmetic.h \
+    ../../include/ArrayKernels.h \
     ../../include/Fallible.h \
     ../../include/Environment.h \
+    ../../include/SymbolTable.h \
+    ../../include/StringTable.h \
     ../../include/FreeStore.h
 
@@ -0,0 +1,145 @@
+#ifndef ARITHMETIC_H
+#define ARITHMETIC_H
+
+#include <climits>
+
+#include "Item.h"
+#include "NumericUtils.h"
+
+namespace PS { namespace Util {
+  /**
+   * @brief arithmetic and comparisons on numeric stack items.
+   * Two integers give an exact integer result and are compared exactly.
+   * If one operand is a double, or the integer result would overflow, the
+   * operation is done on doubles (comparing with an epsilon as before).
+   * Integers that fit in an item are handled first, without the FPU.
+   */
+  class Arithmetic {
+  public:
+    static inline Item add(Item a, Item b) {
+      // 48 bit integers can't overflow
+      if (a.isSmallInteger() && b.isSmallInteger()) {
+        return Item::integer(a.asSmallInteger() + b.asSmallInteger());
+      }
+
+      return addSlow(a, b);
+    }
+
+    static inline Item sub(Item a, Item b) {
+      if (a.isSmallInteger() && b.isSmallInteger()) {
+        return Item::integer(a.asSmallInteger() - b.asSmallInteger());
+      }
+
+      return subSlow(a, b);
+    }
+
+    static Item mul(Item a, Item b);
+    static Item div(Item a, Item b);
+
+    /* a greater b? */
+    static inline bool greater(Item a, Item b) {
+      if (a.isSmallInteger() && b.isSmallInteger()) {
+        return a.asSmallInteger() > b.asSmallInteger();
+      }
+
+      return greaterSlow(a, b);
+    }
+
+    /* a smaller b? */
+    static inline bool smaller(Item a, Item b) {
+      if (a.isSmallInteger() && b.isSmallInteger()) {
+        return a.asSmallInteger() < b.asSmallInteger();
+      }
+
+      return smallerSlow(a, b);
+    }
+
+    /* a equal b? */
+    static inline bool equal(Item a, Item b) {
+      if (a.isSmallInteger() && b.isSmallInteger()) {
+        return a.asSmallInteger() == b.asSmallInteger();
+      }
+
+      return equalSlow(a, b);
+    }
+
+  private:
+    /**
+     * The slow paths are kept apart so the fast paths stay small enough
+     * to be inlined into the interpreter loop.
+     */
+    static Item addSlow(Item a, Item b);
+    static Item subSlow(Item a, Item b);
+    static bool greaterSlow(Item a, Item b);
+    static bool smallerSlow(Item a, Item b);
+    static bool equalSlow(Item a, Item b);
+  };
+
+  PS_NOINLINE inline Item Arithmetic::addSlow(Item a, Item b) {
+    long long r;
+    if (a.isInteger() && b.isInteger() && !NumericUtils::addOverflows(a.asInteger(), b.asInteger(), &r)) {
+      return Item::integer(r);
+    }
+
+    return Item(a.asDouble() + b.asDouble());
+  }
+
+  PS_NOINLINE inline Item Arithmetic::subSlow(Item a, Item b) {
+    long long r;
+    if (a.isInteger() && b.isInteger() && !NumericUtils::subOverflows(a.asInteger(), b.asInteger(), &r)) {
+      return Item::integer(r);
+    }
+
+    return Item(a.asDouble() - b.asDouble());
+  }
+
+  PS_NOINLINE inline Item Arithmetic::mul(Item a, Item b) {
+    long long r;
+    if (a.isInteger() && b.isInteger() && !NumericUtils::mulOverflows(a.asInteger(), b.asInteger(), &r)) {
+      return Item::integer(r);
+    }
+
+    return Item(a.asDouble() * b.asDouble());
+  }
+
+  /**
+   * @brief integers that divide evenly give an integer, 1 2 / is still 0.5
+   */
+  PS_NOINLINE inline Item Arithmetic::div(Item a, Item b) {
+    if (a.isInteger() && b.isInteger()) {
+      long long x = a.asInteger();
+      long long y = b.asInteger();
+      if (y != 0 && !(x == LLONG_MIN && y == -1) && x % y == 0) {
+        return Item::integer(x / y);
+      }
+    }
+
+    return Item(a.asDouble() / b.asDouble());
+  }
+
+  PS_NOINLINE inline bool Arithmetic::greaterSlow(Item a, Item b) {
+    if (a.isInteger() && b.isInteger()) {
+      return a.asInteger() > b.asInteger();
+    }
+
+    return NumericUtils::greaterWithEpsilon(a.asDouble(), b.asDouble());
+  }
+
+  PS_NOINLINE inline bool Arithmetic::smallerSlow(Item a, Item b) {
+    if (a.isInteger() && b.isInteger()) {
+      return a.asInteger() < b.asInteger();
+    }
+
+    return NumericUtils::smallerWithEpsilon(a.asDouble(), b.asDouble());
+  }
+
+  PS_NOINLINE inline bool Arithmetic::equalSlow(Item a, Item b) {
+    if (a.isInteger() && b.isInteger()) {
+      return a.asInteger() == b.asInteger();
+    }
+
+    return NumericUtils::equalWithEpsilon(a.asDouble(), b.asDouble());
+  }
+} }
+
+#endif // ARITHMETIC_H
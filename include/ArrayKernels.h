@@ -0,0 +1,391 @@
+#ifndef ARRAYKERNELS_H
+#define ARRAYKERNELS_H
+
+#include <cstddef>
+#include <algorithm>
+
+// SSE2 is part of x86-64
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace PS { namespace Util {
+  /**
+   * @brief bulk operations on contiguous doubles (see Array).
+   * On x86 the kernels are vectorized. The AVX2 versions are chosen at
+   * runtime if the CPU supports them, SSE2 is used otherwise. Elsewhere
+   * plain loops are used.
+   *
+   * Reductions use several accumulators, so a sum may differ from the
+   * strictly left to right sum in the last bits. min and max need at least
+   * one element, their result for arrays that contain NaNs is unspecified.
+   */
+  class ArrayKernels {
+  public:
+    static double sum(const double *p, size_t n);
+    static double min(const double *p, size_t n);
+    static double max(const double *p, size_t n);
+    static double dot(const double *a, const double *b, size_t n);
+
+    /**
+     * @brief elementwise a = a + b, a = a * b and a = a * k
+     */
+    static void add(double *a, const double *b, size_t n);
+    static void mul(double *a, const double *b, size_t n);
+    static void scale(double *a, double k, size_t n);
+
+    static void sort(double *p, size_t n);
+
+  private:
+#ifdef PS_X86_KERNELS
+    static bool hasAVX2();
+
+    static double sumSSE2(const double *p, size_t n);
+    static double minSSE2(const double *p, size_t n);
+    static double maxSSE2(const double *p, size_t n);
+    static double dotSSE2(const double *a, const double *b, size_t n);
+    static void addSSE2(double *a, const double *b, size_t n);
+    static void mulSSE2(double *a, const double *b, size_t n);
+    static void scaleSSE2(double *a, double k, size_t n);
+
+    static double sumAVX2(const double *p, size_t n);
+    static double minAVX2(const double *p, size_t n);
+    static double maxAVX2(const double *p, size_t n);
+    static double dotAVX2(const double *a, const double *b, size_t n);
+    static void addAVX2(double *a, const double *b, size_t n);
+    static void mulAVX2(double *a, const double *b, size_t n);
+    static void scaleAVX2(double *a, double k, size_t n);
+#endif
+  };
+
+#ifdef PS_X86_KERNELS
+
+// Kernels compiled for AVX2, they only run if the CPU has it
+#define PS_AVX2 __attribute__((target("avx2")))
+
+  inline bool ArrayKernels::hasAVX2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+  }
+
+  inline double ArrayKernels::sum(const double *p, size_t n) {
+    return hasAVX2() ? sumAVX2(p, n) : sumSSE2(p, n);
+  }
+
+  inline double ArrayKernels::min(const double *p, size_t n) {
+    return hasAVX2() ? minAVX2(p, n) : minSSE2(p, n);
+  }
+
+  inline double ArrayKernels::max(const double *p, size_t n) {
+    return hasAVX2() ? maxAVX2(p, n) : maxSSE2(p, n);
+  }
+
+  inline double ArrayKernels::dot(const double *a, const double *b, size_t n) {
+    return hasAVX2() ? dotAVX2(a, b, n) : dotSSE2(a, b, n);
+  }
+
+  inline void ArrayKernels::add(double *a, const double *b, size_t n) {
+    if (hasAVX2()) {
+      addAVX2(a, b, n);
+    } else {
+      addSSE2(a, b, n);
+    }
+  }
+
+  inline void ArrayKernels::mul(double *a, const double *b, size_t n) {
+    if (hasAVX2()) {
+      mulAVX2(a, b, n);
+    } else {
+      mulSSE2(a, b, n);
+    }
+  }
+
+  inline void ArrayKernels::scale(double *a, double k, size_t n) {
+    if (hasAVX2()) {
+      scaleAVX2(a, k, n);
+    } else {
+      scaleSSE2(a, k, n);
+    }
+  }
+
+  /**
+   * SSE2, two doubles per register. Reductions keep two registers apart.
+   */
+
+  inline double ArrayKernels::sumSSE2(const double *p, size_t n) {
+    __m128d s0 = _mm_setzero_pd();
+    __m128d s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      s0 = _mm_add_pd(s0, _mm_loadu_pd(p + i));
+      s1 = _mm_add_pd(s1, _mm_loadu_pd(p + i + 2));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+    double result = lanes[0] + lanes[1];
+    for (; i < n; i++) {
+      result += p[i];
+    }
+    return result;
+  }
+
+  inline double ArrayKernels::minSSE2(const double *p, size_t n) {
+    double result = p[0];
+    size_t i = 0;
+    if (n >= 2) {
+      __m128d m = _mm_loadu_pd(p);
+      for (i = 2; i + 2 <= n; i += 2) {
+        m = _mm_min_pd(m, _mm_loadu_pd(p + i));
+      }
+
+      double lanes[2];
+      _mm_storeu_pd(lanes, m);
+      result = std::min(lanes[0], lanes[1]);
+    }
+
+    for (; i < n; i++) {
+      result = std::min(result, p[i]);
+    }
+    return result;
+  }
+
+  inline double ArrayKernels::maxSSE2(const double *p, size_t n) {
+    double result = p[0];
+    size_t i = 0;
+    if (n >= 2) {
+      __m128d m = _mm_loadu_pd(p);
+      for (i = 2; i + 2 <= n; i += 2) {
+        m = _mm_max_pd(m, _mm_loadu_pd(p + i));
+      }
+
+      double lanes[2];
+      _mm_storeu_pd(lanes, m);
+      result = std::max(lanes[0], lanes[1]);
+    }
+
+    for (; i < n; i++) {
+      result = std::max(result, p[i]);
+    }
+    return result;
+  }
+
+  inline double ArrayKernels::dotSSE2(const double *a, const double *b, size_t n) {
+    __m128d s0 = _mm_setzero_pd();
+    __m128d s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+      s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+    double result = lanes[0] + lanes[1];
+    for (; i < n; i++) {
+      result += a[i] * b[i];
+    }
+    return result;
+  }
+
+  inline void ArrayKernels::addSSE2(double *a, const double *b, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+      _mm_storeu_pd(a + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+      a[i] += b[i];
+    }
+  }
+
+  inline void ArrayKernels::mulSSE2(double *a, const double *b, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+      _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+      a[i] *= b[i];
+    }
+  }
+
+  inline void ArrayKernels::scaleSSE2(double *a, double k, size_t n) {
+    __m128d factor = _mm_set1_pd(k);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+      _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+    }
+    for (; i < n; i++) {
+      a[i] *= k;
+    }
+  }
+
+  /**
+   * AVX2, four doubles per register. Reductions keep two registers apart.
+   */
+
+  PS_AVX2 inline double ArrayKernels::sumAVX2(const double *p, size_t n) {
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      s0 = _mm256_add_pd(s0, _mm256_loadu_pd(p + i));
+      s1 = _mm256_add_pd(s1, _mm256_loadu_pd(p + i + 4));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+    double result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) {
+      result += p[i];
+    }
+    return result;
+  }
+
+  PS_AVX2 inline double ArrayKernels::minAVX2(const double *p, size_t n) {
+    double result = p[0];
+    size_t i = 0;
+    if (n >= 4) {
+      __m256d m = _mm256_loadu_pd(p);
+      for (i = 4; i + 4 <= n; i += 4) {
+        m = _mm256_min_pd(m, _mm256_loadu_pd(p + i));
+      }
+
+      double lanes[4];
+      _mm256_storeu_pd(lanes, m);
+      result = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    }
+
+    for (; i < n; i++) {
+      result = std::min(result, p[i]);
+    }
+    return result;
+  }
+
+  PS_AVX2 inline double ArrayKernels::maxAVX2(const double *p, size_t n) {
+    double result = p[0];
+    size_t i = 0;
+    if (n >= 4) {
+      __m256d m = _mm256_loadu_pd(p);
+      for (i = 4; i + 4 <= n; i += 4) {
+        m = _mm256_max_pd(m, _mm256_loadu_pd(p + i));
+      }
+
+      double lanes[4];
+      _mm256_storeu_pd(lanes, m);
+      result = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+
+    for (; i < n; i++) {
+      result = std::max(result, p[i]);
+    }
+    return result;
+  }
+
+  PS_AVX2 inline double ArrayKernels::dotAVX2(const double *a, const double *b, size_t n) {
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+      s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+    double result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) {
+      result += a[i] * b[i];
+    }
+    return result;
+  }
+
+  PS_AVX2 inline void ArrayKernels::addAVX2(double *a, const double *b, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+      a[i] += b[i];
+    }
+  }
+
+  PS_AVX2 inline void ArrayKernels::mulAVX2(double *a, const double *b, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+      a[i] *= b[i];
+    }
+  }
+
+  PS_AVX2 inline void ArrayKernels::scaleAVX2(double *a, double k, size_t n) {
+    __m256d factor = _mm256_set1_pd(k);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+    }
+    for (; i < n; i++) {
+      a[i] *= k;
+    }
+  }
+
+#undef PS_AVX2
+
+#else
+
+  inline double ArrayKernels::sum(const double *p, size_t n) {
+    double result = 0;
+    for (size_t i = 0; i < n; i++) {
+      result += p[i];
+    }
+    return result;
+  }
+
+  inline double ArrayKernels::min(const double *p, size_t n) {
+    return *std::min_element(p, p + n);
+  }
+
+  inline double ArrayKernels::max(const double *p, size_t n) {
+    return *std::max_element(p, p + n);
+  }
+
+  inline double ArrayKernels::dot(const double *a, const double *b, size_t n) {
+    double result = 0;
+    for (size_t i = 0; i < n; i++) {
+      result += a[i] * b[i];
+    }
+    return result;
+  }
+
+  inline void ArrayKernels::add(double *a, const double *b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      a[i] += b[i];
+    }
+  }
+
+  inline void ArrayKernels::mul(double *a, const double *b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      a[i] *= b[i];
+    }
+  }
+
+  inline void ArrayKernels::scale(double *a, double k, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      a[i] *= k;
+    }
+  }
+
+#endif
+
+  /**
+   * @brief sort ascending. Sorting is not vectorized, it is bound by
+   * comparisons and moves rather than arithmetic.
+   */
+  inline void ArrayKernels::sort(double *p, size_t n) {
+    std::sort(p, p + n);
+  }
+} }
+
+#endif // ARRAYKERNELS_H
@@ -0,0 +1,787 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "PebbleScript.h"
+#include "Arithmetic.h"
+#include "NumericUtils.h"
+
+namespace PS {
+  /**
+   * @brief Runs a numeric block over many rows of inputs at once.
+   *
+   * Every row is one input stack of 'width' numbers, the block has to leave
+   * exactly one value for it. Instead of running the interpreter once per
+   * row, the block is translated into operations on columns: every slot of
+   * the stack is a column that holds the value of that slot for a tile of
+   * rows, so + - * / and the comparisons are loops over the rows that the
+   * compiler vectorizes. dup, swap and drop only rename columns.
+   *
+   * An if (or ifelse) whose condition differs between rows runs both
+   * branches for all rows and picks the result per row with the condition
+   * as a mask. Calls to words are inlined, repeat and times with a literal
+   * count are unrolled.
+   *
+   * Blocks that can't be translated (strings, native functions, while,
+   * branches that leave different stacks, ...) are run by the VM, one row
+   * after the other. Both ways give the same results: comparisons use the
+   * same epsilon, integer literals are folded exactly. Booleans are
+   * returned as 1 and 0.
+   */
+  class Batch {
+  public:
+    Batch(VM *vm, Block *block, unsigned int width);
+    ~Batch();
+
+    /**
+     * @brief false if the rows are run one at a time by the VM
+     */
+    bool isVectorized() const;
+
+    /**
+     * @param inputs rows * width numbers, row after row
+     * @param results one number for every row
+     */
+    bool run(const double *inputs, size_t rows, double *results);
+    const std::string &getError() const;
+
+  private:
+    Batch(const Batch &);
+    Batch &operator=(const Batch &);
+
+    enum Kind { NumberSlot, BooleanSlot, BlockSlot };
+
+    /**
+     * @brief a slot of the stack while translating. It's value is either
+     * a column, a constant (column < 0) or a block literal.
+     */
+    struct Slot {
+      Kind kind;
+      int column;
+      Item constant;
+      Block *block;
+    };
+
+    enum Op { Add, Sub, Mul, Div, Equal, Greater, Smaller, Select };
+
+    /**
+     * @brief target = a op b, Select is target = mask ? a : b
+     */
+    struct Instruction {
+      Op op;
+      int target;
+      int a;
+      int b;
+      int mask;
+    };
+
+    bool compile(Block *block, unsigned int depth);
+    bool compileOperation(Block *block, const Operation &op, unsigned int depth);
+    bool compileCall(unsigned int symbol, unsigned int depth);
+    bool compileBranch(Block *onIf, Block *onElse, unsigned int depth);
+    bool compileLoop(bool withIndex, unsigned int depth);
+    bool binary(Op op);
+    bool fold(Op op, Item a, Item b);
+
+    void pushConstant(Item constant);
+    void pushColumn(Kind kind, int column);
+    bool dup();
+    bool swap();
+    int columnOf(const Slot &slot);
+    int emit(Op op, int a, int b, int mask);
+    void assignColumns(int output);
+
+    void runTile(const double *inputs, size_t rows, double *results);
+    static void apply(Op op, double *PS_RESTRICT t, const double *PS_RESTRICT a,
+                      const double *PS_RESTRICT b, const double *PS_RESTRICT mask);
+    bool runRows(const double *inputs, size_t rows, double *results);
+
+    static bool sameSlot(const Slot &a, const Slot &b);
+
+    // Rows per tile, so that the columns stay in the cache
+    static const size_t TILE = 256;
+
+    // Calls nested deeper than this (recursion) are not inlined
+    static const unsigned int MAX_DEPTH = 32;
+
+    // repeat and times with more iterations are not unrolled
+    static const long MAX_UNROLL = 64;
+
+    static constexpr double EPSILON = Util::NumericUtils::DOUBLE_EPSILON;
+
+    // Translated blocks with more operations are run by the VM
+    static const size_t MAX_INSTRUCTIONS = 4096;
+
+    VM *vm;
+    Block *block;
+    unsigned int width;
+    bool vectorized;
+
+    std::vector<Slot> stack;
+    std::vector<Instruction> program;
+    int columns;
+
+    // The column of every input (-1 if unused) and of the result
+    std::vector<int> inputColumns;
+    int output;
+
+    // Columns that hold the same constant in every row
+    std::map<uint64_t, int> constantColumns;
+    std::vector<std::pair<int, double> > constants;
+
+    std::vector<double> storage;
+    std::string error;
+  };
+
+  /**
+   * @param block the block to run, the batch keeps a reference
+   * @param width the number of inputs of every row
+   */
+  inline Batch::Batch(VM *vm, Block *block, unsigned int width)
+    : vm(vm), block(static_cast<Block *>(block->retain())), width(width), vectorized(false), columns(0), output(-1) {
+    for (unsigned int i = 0; i < width; i++) {
+      pushColumn(NumberSlot, columns++);
+    }
+
+    if (compile(block, 0) && stack.size() == 1 && stack.back().kind != BlockSlot) {
+      assignColumns(columnOf(stack.back()));
+      vectorized = true;
+    }
+
+    stack.clear();
+  }
+
+  inline Batch::~Batch() {
+    block->release();
+  }
+
+  inline bool Batch::isVectorized() const {
+    return this->vectorized;
+  }
+
+  inline const std::string &Batch::getError() const {
+    return this->error;
+  }
+
+  inline bool Batch::run(const double *inputs, size_t rows, double *results) {
+    if (!vectorized) {
+      return runRows(inputs, rows, results);
+    }
+
+    storage.resize((size_t) columns * TILE);
+    for (size_t i = 0; i < constants.size(); i++) {
+      std::fill(&storage[constants[i].first * TILE], &storage[constants[i].first * TILE] + TILE, constants[i].second);
+    }
+
+    for (size_t row = 0; row < rows; row += TILE) {
+      size_t count = rows - row < TILE ? rows - row : TILE;
+      runTile(inputs + row * width, count, results + row);
+    }
+
+    return true;
+  }
+
+  inline bool Batch::compile(Block *block, unsigned int depth) {
+    if (depth > MAX_DEPTH) {
+      return false;
+    }
+
+    const std::vector<Operation> &ops = block->value;
+    for (size_t i = 0; i < ops.size(); i++) {
+      if (!compileOperation(block, ops[i], depth) || program.size() > MAX_INSTRUCTIONS) {
+        return false;
+      }
+
+      // The inlined copy follows the guard, the call was translated already
+      if (ops[i].opcode == Inline_OC) {
+        i += block->callSites[ops[i].operand.site].length;
+      }
+    }
+
+    return true;
+  }
+
+  inline bool Batch::compileOperation(Block *block, const Operation &op, unsigned int depth) {
+    switch (op.opcode) {
+    case Push_OC:
+      {
+        Type *constant = block->constants[op.operand.constant];
+        if (constant->type != Block_T) {
+          return false;
+        }
+
+        Slot slot;
+        slot.kind = BlockSlot;
+        slot.column = -1;
+        slot.block = static_cast<Block *>(constant);
+        stack.push_back(slot);
+        return true;
+      }
+    case PushNumber_OC:
+      pushConstant(Item(op.operand.number));
+      return true;
+    case PushInteger_OC:
+      if (!Item::fitsInline(op.operand.integer)) {
+        return false;
+      }
+      pushConstant(Item::integer(op.operand.integer));
+      return true;
+    case PushBoolean_OC:
+      pushConstant(Item(op.operand.boolean));
+      return true;
+    case Call_OC:
+    case Inline_OC:
+      return compileCall(block->callSites[op.operand.site].symbol, depth);
+    case Plus_OC:
+      return binary(Add);
+    case Minus_OC:
+      return binary(Sub);
+    case Mul_OC:
+      return binary(Mul);
+    case Div_OC:
+      return binary(Div);
+    case Equals_OC:
+      return binary(Equal);
+    case Gt_OC:
+      return binary(Greater);
+    case Lt_OC:
+      return binary(Smaller);
+    case Dup_OC:
+      return dup();
+    case Swap_OC:
+      return swap();
+    case Drop_OC:
+      if (stack.empty()) {
+        return false;
+      }
+      stack.pop_back();
+      return true;
+    case If_OC:
+      {
+        if (stack.size() < 2 || stack.back().kind != BlockSlot) {
+          return false;
+        }
+
+        Block *onIf = stack.back().block;
+        stack.pop_back();
+        return compileBranch(onIf, 0, depth);
+      }
+    case IfElse_OC:
+      {
+        if (stack.size() < 3 || stack.back().kind != BlockSlot || stack[stack.size() - 2].kind != BlockSlot) {
+          return false;
+        }
+
+        Block *onElse = stack.back().block;
+        stack.pop_back();
+        Block *onIf = stack.back().block;
+        stack.pop_back();
+        return compileBranch(onIf, onElse, depth);
+      }
+    case Repeat_OC:
+      return compileLoop(false, depth);
+    case Times_OC:
+      return compileLoop(true, depth);
+    case While_OC:
+      return false;
+    default:
+      break;
+    }
+
+    // Superinstructions are split up again
+    Item literal = Item::fromBits(op.operand.literal);
+    if (literal.isObject()) {
+      return false;
+    }
+
+    switch (op.opcode) {
+    case PushAdd_OC:
+      pushConstant(literal);
+      return binary(Add);
+    case PushSub_OC:
+      pushConstant(literal);
+      return binary(Sub);
+    case PushSubDup_OC:
+      pushConstant(literal);
+      return binary(Sub) && dup();
+    case DupPush_OC:
+      if (!dup()) {
+        return false;
+      }
+      pushConstant(literal);
+      return true;
+    case SwapPlus_OC:
+      return swap() && binary(Add);
+    case PushMul_OC:
+      pushConstant(literal);
+      return binary(Mul);
+    case PushDiv_OC:
+      pushConstant(literal);
+      return binary(Div);
+    case PushGt_OC:
+      pushConstant(literal);
+      return binary(Greater);
+    case PushLt_OC:
+      pushConstant(literal);
+      return binary(Smaller);
+    case DupPushGt_OC:
+      if (!dup()) {
+        return false;
+      }
+      pushConstant(literal);
+      return binary(Greater);
+    case DupPushLt_OC:
+      if (!dup()) {
+        return false;
+      }
+      pushConstant(literal);
+      return binary(Smaller);
+    default:
+      return false;
+    }
+  }
+
+  /**
+   * @brief words defined as blocks are inlined, native functions can't
+   * be translated.
+   */
+  inline bool Batch::compileCall(unsigned int symbol, unsigned int depth) {
+    Environment *env = vm->getEnvironment();
+    if (vm->hasNative(symbol) || !env->hasDefinition(symbol)) {
+      return false;
+    }
+
+    return compile(env->getDefinition(symbol), depth + 1);
+  }
+
+  /**
+   * @brief both branches are translated, starting from the same stack.
+   * Where the stacks they leave differ, the condition selects per row.
+   */
+  inline bool Batch::compileBranch(Block *onIf, Block *onElse, unsigned int depth) {
+    Slot condition = stack.back();
+    stack.pop_back();
+
+    if (condition.kind != BooleanSlot) {
+      return false;
+    }
+
+    if (condition.column < 0) {
+      Block *taken = condition.constant.asBoolean() ? onIf : onElse;
+      return !taken || compile(taken, depth + 1);
+    }
+
+    std::vector<Slot> before = stack;
+    if (!compile(onIf, depth + 1)) {
+      return false;
+    }
+
+    std::vector<Slot> taken;
+    taken.swap(stack);
+    stack = before;
+
+    if (onElse && !compile(onElse, depth + 1)) {
+      return false;
+    }
+
+    if (taken.size() != stack.size()) {
+      return false;
+    }
+
+    for (size_t i = 0; i < stack.size(); i++) {
+      if (sameSlot(taken[i], stack[i])) {
+        continue;
+      }
+
+      if (taken[i].kind != stack[i].kind || taken[i].kind == BlockSlot) {
+        return false;
+      }
+
+      Kind kind = taken[i].kind;
+      int column = emit(Select, columnOf(taken[i]), columnOf(stack[i]), condition.column);
+
+      stack[i].kind = kind;
+      stack[i].column = column;
+    }
+
+    return true;
+  }
+
+  /**
+   * @brief n { body } repeat and n { body } times with a literal n
+   */
+  inline bool Batch::compileLoop(bool withIndex, unsigned int depth) {
+    if (stack.size() < 2 || stack.back().kind != BlockSlot) {
+      return false;
+    }
+
+    Block *body = stack.back().block;
+    stack.pop_back();
+
+    Slot count = stack.back();
+    stack.pop_back();
+
+    if (count.kind != NumberSlot || count.column >= 0) {
+      return false;
+    }
+
+    // Like the VM
+    long n = (long) count.constant.asDouble();
+    if (n > MAX_UNROLL) {
+      return false;
+    }
+
+    for (long i = 0; i < n; i++) {
+      if (withIndex) {
+        pushConstant(Item::integer(i));
+      }
+
+      if (!compile(body, depth + 1)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * @brief the types are checked like the VM does. Mismatches are left to
+   * the VM, which raises the error.
+   */
+  inline bool Batch::binary(Op op) {
+    if (stack.size() < 2) {
+      return false;
+    }
+
+    Slot b = stack.back();
+    stack.pop_back();
+    Slot a = stack.back();
+    stack.pop_back();
+
+    if (op == Equal) {
+      if (a.kind != b.kind || a.kind == BlockSlot) {
+        return false;
+      }
+    } else if (a.kind != NumberSlot || b.kind != NumberSlot) {
+      return false;
+    }
+
+    if (a.column < 0 && b.column < 0) {
+      return fold(op, a.constant, b.constant);
+    }
+
+    int column = emit(op, columnOf(a), columnOf(b), -1);
+    pushColumn(op == Equal || op == Greater || op == Smaller ? BooleanSlot : NumberSlot, column);
+    return true;
+  }
+
+  /**
+   * @brief constants are combined right away, with the arithmetic of the VM
+   */
+  inline bool Batch::fold(Op op, Item a, Item b) {
+    Item result;
+    switch (op) {
+    case Add:
+      result = Util::Arithmetic::add(a, b);
+      break;
+    case Sub:
+      result = Util::Arithmetic::sub(a, b);
+      break;
+    case Mul:
+      result = Util::Arithmetic::mul(a, b);
+      break;
+    case Div:
+      result = Util::Arithmetic::div(a, b);
+      break;
+    case Equal:
+      result = Item(a.isBoolean() ? a == b : Util::Arithmetic::equal(a, b));
+      break;
+    case Greater:
+      result = Item(Util::Arithmetic::greater(a, b));
+      break;
+    case Smaller:
+      result = Item(Util::Arithmetic::smaller(a, b));
+      break;
+    default:
+      return false;
+    }
+
+    // Integers too big for an item are left to the VM
+    if (result.isObject()) {
+      result.asObject()->release();
+      return false;
+    }
+
+    pushConstant(result);
+    return true;
+  }
+
+  inline void Batch::pushConstant(Item constant) {
+    Slot slot;
+    slot.kind = constant.isBoolean() ? BooleanSlot : NumberSlot;
+    slot.column = -1;
+    slot.constant = constant;
+    slot.block = 0;
+    stack.push_back(slot);
+  }
+
+  inline void Batch::pushColumn(Kind kind, int column) {
+    Slot slot;
+    slot.kind = kind;
+    slot.column = column;
+    slot.block = 0;
+    stack.push_back(slot);
+  }
+
+  inline bool Batch::dup() {
+    if (stack.empty()) {
+      return false;
+    }
+
+    stack.push_back(stack.back());
+    return true;
+  }
+
+  inline bool Batch::swap() {
+    if (stack.size() < 2) {
+      return false;
+    }
+
+    std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+    return true;
+  }
+
+  /**
+   * @brief the column of a slot. Constants get a column of their own,
+   * booleans are stored as 1 and 0.
+   */
+  inline int Batch::columnOf(const Slot &slot) {
+    if (slot.column >= 0) {
+      return slot.column;
+    }
+
+    double value = slot.constant.isBoolean() ? (slot.constant.asBoolean() ? 1.0 : 0.0) : slot.constant.asDouble();
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(double));
+
+    std::map<uint64_t, int>::iterator iter = constantColumns.find(bits);
+    if (iter != constantColumns.end()) {
+      return iter->second;
+    }
+
+    constantColumns[bits] = columns;
+    constants.push_back(std::make_pair(columns, value));
+    return columns++;
+  }
+
+  inline int Batch::emit(Op op, int a, int b, int mask) {
+    Instruction in;
+    in.op = op;
+    in.target = columns++;
+    in.a = a;
+    in.b = b;
+    in.mask = mask;
+    program.push_back(in);
+    return in.target;
+  }
+
+  /**
+   * @brief while translating, every operation writes a new column. Here
+   * the columns are renumbered, so that a column is reused once it's value
+   * is not needed anymore. This keeps the columns of a tile in the cache.
+   */
+  inline void Batch::assignColumns(int result) {
+    const int CONSTANT = -2;
+
+    // The last instruction that reads a column, constants are kept
+    std::vector<int> lastUse(columns, -1);
+    for (size_t i = 0; i < constants.size(); i++) {
+      lastUse[constants[i].first] = CONSTANT;
+    }
+
+    for (size_t i = 0; i < program.size(); i++) {
+      int used[] = { program[i].a, program[i].b, program[i].mask };
+      for (int k = 0; k < 3; k++) {
+        if (used[k] >= 0 && lastUse[used[k]] != CONSTANT) {
+          lastUse[used[k]] = (int) i;
+        }
+      }
+    }
+
+    if (lastUse[result] != CONSTANT) {
+      lastUse[result] = (int) program.size();
+    }
+
+    std::vector<int> renamed(columns, -1);
+    std::vector<int> unused;
+    int count = 0;
+
+    for (size_t i = 0; i < constants.size(); i++) {
+      renamed[constants[i].first] = count;
+      constants[i].first = count++;
+    }
+
+    inputColumns.resize(width);
+    for (unsigned int i = 0; i < width; i++) {
+      inputColumns[i] = lastUse[i] >= 0 ? (renamed[i] = count++) : -1;
+    }
+
+    for (size_t i = 0; i < program.size(); i++) {
+      Instruction &in = program[i];
+      int used[] = { in.a, in.b, in.mask };
+
+      in.a = renamed[in.a];
+      in.b = renamed[in.b];
+      in.mask = in.mask >= 0 ? renamed[in.mask] : -1;
+
+      int target = in.target;
+      if (unused.empty()) {
+        in.target = renamed[target] = count++;
+      } else {
+        in.target = renamed[target] = unused.back();
+        unused.pop_back();
+      }
+
+      // Freed after the target is chosen, so the target never overlaps an operand
+      for (int k = 0; k < 3; k++) {
+        if (used[k] >= 0 && lastUse[used[k]] == (int) i) {
+          lastUse[used[k]] = -1;
+          unused.push_back(renamed[used[k]]);
+        }
+      }
+
+      // Never read (the other branch was selected)
+      if (lastUse[target] < 0) {
+        unused.push_back(in.target);
+      }
+    }
+
+    output = renamed[result];
+    columns = count;
+  }
+
+  inline void Batch::runTile(const double *inputs, size_t rows, double *results) {
+    double *data = &storage[0];
+
+    for (unsigned int i = 0; i < width; i++) {
+      if (inputColumns[i] >= 0) {
+        double *column = data + inputColumns[i] * TILE;
+        for (size_t r = 0; r < rows; r++) {
+          column[r] = inputs[r * width + i];
+        }
+      }
+    }
+
+    // The whole tile is computed, the rows after the last one are ignored
+    for (size_t i = 0; i < program.size(); i++) {
+      const Instruction &in = program[i];
+      apply(in.op, data + in.target * TILE, data + in.a * TILE, data + in.b * TILE,
+            in.mask >= 0 ? data + in.mask * TILE : 0);
+    }
+
+    memcpy(results, data + output * TILE, rows * sizeof(double));
+  }
+
+  /**
+   * @brief one instruction for a whole tile. The loops have a fixed length
+   * and the columns don't overlap, so the compiler vectorizes them. The
+   * comparisons are the ones of NumericUtils, written without branches:
+   * a > b with an epsilon is the same as a - b > epsilon.
+   */
+  inline void Batch::apply(Op op, double *PS_RESTRICT t, const double *PS_RESTRICT a,
+                           const double *PS_RESTRICT b, const double *PS_RESTRICT mask) {
+    switch (op) {
+    case Add:
+      for (size_t r = 0; r < TILE; r++) t[r] = a[r] + b[r];
+      break;
+    case Sub:
+      for (size_t r = 0; r < TILE; r++) t[r] = a[r] - b[r];
+      break;
+    case Mul:
+      for (size_t r = 0; r < TILE; r++) t[r] = a[r] * b[r];
+      break;
+    case Div:
+      for (size_t r = 0; r < TILE; r++) t[r] = a[r] / b[r];
+      break;
+    case Equal:
+      for (size_t r = 0; r < TILE; r++) t[r] = std::fabs(a[r] - b[r]) < EPSILON;
+      break;
+    case Greater:
+      for (size_t r = 0; r < TILE; r++) t[r] = a[r] - b[r] > EPSILON;
+      break;
+    case Smaller:
+      for (size_t r = 0; r < TILE; r++) t[r] = b[r] - a[r] > EPSILON;
+      break;
+    case Select:
+      for (size_t r = 0; r < TILE; r++) {
+        double x = a[r];
+        double y = b[r];
+        t[r] = mask[r] != 0.0 ? x : y;
+      }
+      break;
+    }
+  }
+
+  /**
+   * @brief the fallback: the VM runs the block for one row after the other
+   */
+  inline bool Batch::runRows(const double *inputs, size_t rows, double *results) {
+    Environment *env = vm->getEnvironment();
+
+    // The rows run on a stack of their own, so a block that takes more than
+    // it's row can't reach the items of the caller
+    Stack callerStack;
+    env->exchange(callerStack);
+
+    // Errors raised before don't belong to the batch
+    bool failedBefore = vm->runtimeErrorOccured;
+    vm->runtimeErrorOccured = false;
+
+    for (size_t row = 0; row < rows && error.empty(); row++) {
+      for (unsigned int i = 0; i < width; i++) {
+        env->push(inputs[row * width + i]);
+      }
+
+      if (!vm->run(block)) {
+        error = vm->getError();
+      } else if (env->size() != 1 || !(env->peekIs(Number_T) || env->peekIs(Boolean_T))) {
+        error = "A batch block must leave exactly one number";
+      } else if (env->peekIs(Boolean_T)) {
+        results[row] = env->pop<bool>() ? 1.0 : 0.0;
+      } else {
+        results[row] = env->pop<double>();
+      }
+    }
+
+    // Back to the stack of the caller, the values a failed row left go with callerStack
+    env->exchange(callerStack);
+
+    if (!error.empty()) {
+      return false;
+    }
+
+    vm->runtimeErrorOccured = failedBefore;
+    return true;
+  }
+
+  inline bool Batch::sameSlot(const Slot &a, const Slot &b) {
+    if (a.kind != b.kind || a.column != b.column) {
+      return false;
+    }
+
+    if (a.kind == BlockSlot) {
+      return a.block == b.block;
+    }
+
+    return a.column >= 0 || a.constant == b.constant;
+  }
+}
+
+#endif // BATCH_H
@@ -0,0 +1,546 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PebbleScript.h"
+
+namespace PS {
+  /**
+   * @brief A bounded queue of values between threads (and so between VMs).
+   *
+   * Values are moved: the channel takes the pointer on send and the receiver
+   * owns it after receive, nothing is copied. Only numbers, strings and
+   * booleans should be sent, blocks belong to the VM that created them.
+   *
+   * trySend and tryReceive never block (the queues are lock-free). send and
+   * receive wait without spinning when the channel is full or empty.
+   */
+  class Channel {
+  public:
+    Channel();
+    virtual ~Channel() { }
+
+    /**
+     * @brief channels are shared by the table and the threads that use
+     * them, the last one deletes the channel (see Channels::close).
+     */
+    Channel *retain();
+    void release();
+
+    bool trySend(Type *value);
+    Type *tryReceive();
+    void send(Type *value);
+    Type *receive();
+
+    virtual unsigned int capacity() const = 0;
+
+    // The largest capacity of a channel
+    static const unsigned int MAX_CAPACITY = 1 << 20;
+
+    /**
+     * @brief if the calling thread may send to or receive from the channel.
+     * Scripts can't be trusted to keep to the threads a channel is made
+     * for, so chan-send and chan-recv ask first.
+     */
+    virtual bool canSend() { return true; }
+    virtual bool canReceive() { return true; }
+
+  protected:
+    // The queue itself, without waking up anyone
+    virtual bool push(Type *value) = 0;
+    virtual Type *pop() = 0;
+
+    // Capacities are a power of two (at least 2)
+    static unsigned int roundUp(unsigned int capacity);
+
+  private:
+    Channel(const Channel &);
+    Channel &operator=(const Channel &);
+
+    void wake();
+
+    // Threads waiting in send or receive
+    std::mutex parkLock;
+    std::condition_variable changed;
+    std::atomic<unsigned int> waiters;
+
+    std::atomic<unsigned int> references;
+  };
+
+  /**
+   * @brief A channel with one sending and one receiving thread. The first
+   * thread that sends (or receives) becomes the only one that may, see
+   * canSend and canReceive.
+   */
+  class SPSCChannel : public Channel {
+  public:
+    SPSCChannel(unsigned int capacity);
+    ~SPSCChannel();
+
+    unsigned int capacity() const;
+    bool canSend();
+    bool canReceive();
+
+  protected:
+    bool push(Type *value);
+    Type *pop();
+
+  private:
+    static bool claim(std::atomic<std::thread::id> &owner);
+
+    Type **slots;
+    unsigned long mask;
+    std::atomic<std::thread::id> sender;
+    std::atomic<std::thread::id> receiver;
+
+    // The next slot to read and to write, on their own cache lines
+    char padding0[64];
+    std::atomic<unsigned long> head;
+    char padding1[64 - sizeof(std::atomic<unsigned long>)];
+    std::atomic<unsigned long> tail;
+    char padding2[64 - sizeof(std::atomic<unsigned long>)];
+  };
+
+  /**
+   * @brief A channel for any number of sending and receiving threads.
+   * Every cell has a sequence number that tells if it is free for the
+   * producer or full for the consumer of a position (D. Vyukov's bounded
+   * MPMC queue).
+   */
+  class MPMCChannel : public Channel {
+  public:
+    MPMCChannel(unsigned int capacity);
+    ~MPMCChannel();
+
+    unsigned int capacity() const;
+
+  protected:
+    bool push(Type *value);
+    Type *pop();
+
+  private:
+    struct Cell {
+      std::atomic<unsigned long> sequence;
+      Type *value;
+    };
+
+    Cell *cells;
+    unsigned long mask;
+
+    char padding0[64];
+    std::atomic<unsigned long> head;
+    char padding1[64 - sizeof(std::atomic<unsigned long>)];
+    std::atomic<unsigned long> tail;
+    char padding2[64 - sizeof(std::atomic<unsigned long>)];
+  };
+
+  /**
+   * @brief The channels that scripts can use, by id (see chan-new, chan-send,
+   * chan-recv and chan-close). There is one table for the whole process,
+   * like the SymbolTable.
+   *
+   * The slot of a closed channel is reused. An id is the slot plus the
+   * number of times the slot was reused times MAX_CHANNELS, so the id of a
+   * closed channel never names a later channel of the same slot.
+   *
+   * A script that receives from an empty channel suspends it's VM (the
+   * status is Pending) and the VM remembers the id (see VM::await). The
+   * host continues it with resume once there is a value.
+   */
+  class Channels {
+  public:
+    static Channels &global();
+
+    ~Channels();
+
+    long long open(Channel *channel);
+    Channel *get(long long id);
+    bool close(long long id);
+
+    Environment *resume(VM &vm);
+
+    // Channels open at the same time
+    static const unsigned int MAX_CHANNELS = 1024;
+
+  private:
+    Channels();
+
+    Channel *channels[MAX_CHANNELS];
+    long long reused[MAX_CHANNELS];
+    // Slots of closed channels, reused first
+    std::vector<unsigned int> closed;
+    unsigned int count;
+
+    // Guards the table
+    std::mutex lock;
+  };
+
+  inline Channel::Channel() : waiters(0), references(1) { }
+
+  inline Channel *Channel::retain() {
+    references.fetch_add(1, std::memory_order_relaxed);
+    return this;
+  }
+
+  inline void Channel::release() {
+    if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  /**
+   * @brief capacities above MAX_CAPACITY become MAX_CAPACITY
+   */
+  inline unsigned int Channel::roundUp(unsigned int capacity) {
+    unsigned int size = 2;
+    while (size < capacity && size < MAX_CAPACITY) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  /**
+   * @return false if the channel is full. The value then still belongs
+   * to the caller.
+   */
+  inline bool Channel::trySend(Type *value) {
+    if (!push(value)) {
+      return false;
+    }
+
+    wake();
+    return true;
+  }
+
+  /**
+   * @return the oldest value or 0 if the channel is empty
+   */
+  inline Type *Channel::tryReceive() {
+    Type *value = pop();
+    if (value) {
+      wake();
+    }
+
+    return value;
+  }
+
+  /**
+   * @brief send a value, waits while the channel is full.
+   */
+  inline void Channel::send(Type *value) {
+    if (trySend(value)) {
+      return;
+    }
+
+    {
+      std::unique_lock<std::mutex> guard(parkLock);
+      waiters++;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (!push(value)) {
+        changed.wait(guard);
+      }
+      waiters--;
+    }
+
+    wake();
+  }
+
+  /**
+   * @brief receive a value, waits while the channel is empty.
+   */
+  inline Type *Channel::receive() {
+    Type *value = tryReceive();
+    if (value) {
+      return value;
+    }
+
+    {
+      std::unique_lock<std::mutex> guard(parkLock);
+      waiters++;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (!(value = pop())) {
+        changed.wait(guard);
+      }
+      waiters--;
+    }
+
+    wake();
+    return value;
+  }
+
+  /**
+   * @brief wake up waiting threads after a push or pop. A waiting thread
+   * counts itself before it checks the queue, so either it sees the change
+   * or we see it waiting. Notifying under the lock makes sure it already
+   * sleeps.
+   */
+  inline void Channel::wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> guard(parkLock);
+      changed.notify_all();
+    }
+  }
+
+  inline SPSCChannel::SPSCChannel(unsigned int capacity) : sender(std::thread::id()), receiver(std::thread::id()), head(0), tail(0) {
+    unsigned int size = roundUp(capacity);
+    slots = new Type *[size];
+    mask = size - 1;
+  }
+
+  inline SPSCChannel::~SPSCChannel() {
+    Type *value;
+    while ((value = pop())) {
+      value->release();
+    }
+
+    delete [] slots;
+  }
+
+  inline unsigned int SPSCChannel::capacity() const {
+    return mask + 1;
+  }
+
+  inline bool SPSCChannel::canSend() {
+    return claim(sender);
+  }
+
+  inline bool SPSCChannel::canReceive() {
+    return claim(receiver);
+  }
+
+  /**
+   * @brief make the calling thread the owner if there is none yet.
+   * @return true if the calling thread is the owner
+   */
+  inline bool SPSCChannel::claim(std::atomic<std::thread::id> &owner) {
+    std::thread::id self = std::this_thread::get_id();
+    std::thread::id current;
+    return owner.compare_exchange_strong(current, self) || current == self;
+  }
+
+  inline bool SPSCChannel::push(Type *value) {
+    unsigned long t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) {
+      return false;
+    }
+
+    slots[t & mask] = value;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  inline Type *SPSCChannel::pop() {
+    unsigned long h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return 0;
+    }
+
+    Type *value = slots[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return value;
+  }
+
+  inline MPMCChannel::MPMCChannel(unsigned int capacity) : head(0), tail(0) {
+    unsigned int size = roundUp(capacity);
+    cells = new Cell[size];
+    mask = size - 1;
+
+    for (unsigned int i = 0; i < size; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  inline MPMCChannel::~MPMCChannel() {
+    Type *value;
+    while ((value = pop())) {
+      value->release();
+    }
+
+    delete [] cells;
+  }
+
+  inline unsigned int MPMCChannel::capacity() const {
+    return mask + 1;
+  }
+
+  inline bool MPMCChannel::push(Type *value) {
+    Cell *cell;
+    unsigned long pos = tail.load(std::memory_order_relaxed);
+
+    while (true) {
+      cell = &cells[pos & mask];
+      unsigned long sequence = cell->sequence.load(std::memory_order_acquire);
+      long diff = (long) sequence - (long) pos;
+
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // The cell still holds the value of the previous round: full
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->value = value;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  inline Type *MPMCChannel::pop() {
+    Cell *cell;
+    unsigned long pos = head.load(std::memory_order_relaxed);
+
+    while (true) {
+      cell = &cells[pos & mask];
+      unsigned long sequence = cell->sequence.load(std::memory_order_acquire);
+      long diff = (long) sequence - (long) (pos + 1);
+
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // Not written yet: empty
+        return 0;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+
+    Type *value = cell->value;
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return value;
+  }
+
+  inline Channels &Channels::global() {
+    static Channels table;
+    return table;
+  }
+
+  inline Channels::Channels() : count(0) {
+    for (unsigned int i = 0; i < MAX_CHANNELS; i++) {
+      channels[i] = 0;
+      reused[i] = 0;
+    }
+  }
+
+  inline Channels::~Channels() {
+    for (unsigned int i = 0; i < count; i++) {
+      if (channels[i]) {
+        channels[i]->release();
+      }
+    }
+  }
+
+  /**
+   * @brief add a channel, the table takes over the reference of the caller.
+   * @return the id of the channel or -1 if MAX_CHANNELS channels are open
+   * (the channel is released then)
+   */
+  inline long long Channels::open(Channel *channel) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    unsigned int slot;
+    if (!closed.empty()) {
+      slot = closed.back();
+      closed.pop_back();
+    } else if (count < MAX_CHANNELS) {
+      slot = count++;
+    } else {
+      channel->release();
+      return -1;
+    }
+
+    channels[slot] = channel;
+    return reused[slot] * MAX_CHANNELS + slot;
+  }
+
+  /**
+   * @return the channel with a reference for the caller, or 0 if there is
+   * no open channel with this id
+   */
+  inline Channel *Channels::get(long long id) {
+    if (id < 0) {
+      return 0;
+    }
+
+    unsigned int slot = (unsigned int) (id % MAX_CHANNELS);
+    std::lock_guard<std::mutex> guard(lock);
+    if (!channels[slot] || reused[slot] != id / MAX_CHANNELS) {
+      return 0;
+    }
+
+    return channels[slot]->retain();
+  }
+
+  /**
+   * @brief remove a channel from the table. Threads that still use it keep
+   * it alive, values left in it are released with it.
+   * @return false if there is no open channel with this id
+   */
+  inline bool Channels::close(long long id) {
+    Channel *channel = get(id);
+    if (!channel) {
+      return false;
+    }
+
+    unsigned int slot = (unsigned int) (id % MAX_CHANNELS);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (channels[slot] != channel) {
+        // Closed by another thread meanwhile
+        channel->release();
+        return false;
+      }
+
+      channels[slot] = 0;
+      reused[slot]++;
+      closed.push_back(slot);
+    }
+
+    // The reference of the table and our own
+    channel->release();
+    channel->release();
+    return true;
+  }
+
+  /**
+   * @brief continue a VM that was suspended by chan-recv once the channel
+   * has a value, the value is pushed first. Never waits: if the channel is
+   * still empty, the VM stays suspended (Pending) and the result is 0, so
+   * the host can do other work and try again. If the channel was closed,
+   * the evaluation continues with an error. Other suspended VMs are just
+   * resumed.
+   */
+  inline Environment *Channels::resume(VM &vm) {
+    if (vm.getAwaited() >= 0) {
+      Channel *channel = get(vm.getAwaited());
+      if (!channel) {
+        // Like chan-recv on a closed channel, the script continues without a value
+        vm.getEnvironment()->raise("The channel was closed");
+        return vm.resume();
+      }
+
+      Type *value = channel->tryReceive();
+      channel->release();
+      if (!value) {
+        return 0;
+      }
+
+      vm.getEnvironment()->push(value);
+    }
+
+    return vm.resume();
+  }
+}
+
+#endif // CHANNEL_H
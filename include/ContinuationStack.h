@@ -0,0 +1,170 @@
+#ifndef CONTINUATIONSTACK_H
+#define CONTINUATIONSTACK_H
+
+#include <cstring>
+
+#include "Types.h"
+
+namespace PS {
+  /**
+   * @brief a saved return point: the block and the index of the
+   * operation where execution continues.
+   * Loop frames have no block. They mark that the innermost loop
+   * continues when execution gets back to them.
+   * A frame holds a reference to it's block: push takes over the
+   * reference of the caller, pop hands it back.
+   */
+  struct Continuation {
+  public:
+    Block *block;
+    unsigned int pc;
+  };
+
+  /**
+   * @brief The stack of return points of the VM.
+   * Frames are stored in one contiguous array that is reserved up front
+   * and grows by doubling. The stack never grows beyond its limit, push
+   * fails instead, which lets the VM report runaway recursion as an error.
+   */
+  class ContinuationStack {
+  public:
+    ContinuationStack(unsigned int reserve, unsigned int limit);
+    ~ContinuationStack();
+
+    bool push(Block *block, unsigned int pc);
+    Continuation &top();
+    void pop();
+    void truncate(unsigned int size);
+    unsigned int size() const;
+
+    Continuation *begin();
+    Continuation *end();
+
+    void setLimit(unsigned int limit);
+    unsigned int getLimit() const;
+
+    /**
+     * @brief the largest number of frames that was reached since the
+     * last reset. Useful to size the limit.
+     */
+    unsigned int getHighWaterMark() const;
+    void resetHighWaterMark();
+
+  private:
+    bool grow();
+
+    Continuation *frames;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int limit;
+
+    // The smaller of capacity and limit, push only checks this
+    unsigned int available;
+    unsigned int highWaterMark;
+  };
+
+  inline ContinuationStack::ContinuationStack(unsigned int reserve, unsigned int limit)
+    : frames(new Continuation[reserve]), count(0), capacity(reserve), limit(limit),
+      available(reserve < limit ? reserve : limit), highWaterMark(0) { }
+
+  inline ContinuationStack::~ContinuationStack() {
+    truncate(0);
+    delete[] frames;
+  }
+
+  /**
+   * @return false if the stack is full
+   */
+  inline bool ContinuationStack::push(Block *block, unsigned int pc) {
+    if (count >= available && !grow()) {
+      return false;
+    }
+
+    frames[count].block = block;
+    frames[count].pc = pc;
+    count++;
+
+    if (count > highWaterMark) {
+      highWaterMark = count;
+    }
+
+    return true;
+  }
+
+  inline Continuation &ContinuationStack::top() {
+    return frames[count - 1];
+  }
+
+  inline void ContinuationStack::pop() {
+    count--;
+  }
+
+  /**
+   * @brief drop all frames above 'size' (and release their blocks)
+   */
+  inline void ContinuationStack::truncate(unsigned int size) {
+    while (count > size) {
+      count--;
+      if (frames[count].block) {
+        frames[count].block->release();
+      }
+    }
+  }
+
+  inline unsigned int ContinuationStack::size() const {
+    return count;
+  }
+
+  inline Continuation *ContinuationStack::begin() {
+    return frames;
+  }
+
+  inline Continuation *ContinuationStack::end() {
+    return frames + count;
+  }
+
+  inline void ContinuationStack::setLimit(unsigned int limit) {
+    this->limit = limit;
+    this->available = capacity < limit ? capacity : limit;
+  }
+
+  inline unsigned int ContinuationStack::getLimit() const {
+    return limit;
+  }
+
+  inline unsigned int ContinuationStack::getHighWaterMark() const {
+    return highWaterMark;
+  }
+
+  inline void ContinuationStack::resetHighWaterMark() {
+    highWaterMark = count;
+  }
+
+  inline bool ContinuationStack::grow() {
+    if (count >= limit) {
+      return false;
+    }
+
+    if (count < capacity) {
+      // The limit was raised, no need to reallocate
+      available = capacity < limit ? capacity : limit;
+      return true;
+    }
+
+    unsigned int grown = capacity * 2 > limit ? limit : capacity * 2;
+    if (grown == 0) {
+      grown = 1;
+    }
+
+    Continuation *moved = new Continuation[grown];
+    std::memcpy(moved, frames, count * sizeof(Continuation));
+    delete[] frames;
+
+    frames = moved;
+    capacity = grown;
+    available = grown;
+    return true;
+  }
+}
+
+#endif // CONTINUATIONSTACK_H
@@ -11,6 +11,7 @@
 #include "Runnable.h"
 #include "Stack.h"
 #include "NumericUtils.h"
+#include "SymbolTable.h"
 
 namespace PS {  
   class Environment : public Stack {
@@ -25,27 +26,50 @@ namespace PS {
 
     Type *popRaw();
     Block *popBlock();
+    Item popItem();
+    long popCount();
 
     /**
      * push operations on the global stack
      */
     void push(double v);
+    void push(long long v);
     void push(const char *v);
     void push(bool v);
     void push(Type *v);
+    void push(Item v);
 
     /**
      * Peeking
      */
     DataType peekType();
+    double peekNumber();
+    Item peek();
+    bool peekIs(DataType a);
+    bool peekIs(DataType a, DataType b);
 
     /**
      * Defining things (functions and constants).
      */
     void def(const char *name, Block *def);
     void def(const char *name, ExternalFunction def);
-    bool hasDefinition(long hash);
-    Block *getDefinition(long hash);
+    bool hasDefinition(unsigned int symbol);
+    Block *getDefinition(unsigned int symbol);
+
+    /**
+     * @brief the dictionary can be saved and put back, to undo the words
+     * that some code defined.
+     */
+    std::vector<Block *> saveDefinitions() const;
+    void restoreDefinitions(const std::vector<Block *> &saved);
+
+    SymbolTable &getSymbols();
+
+    /**
+     * The dictionary epoch changes whenever a word is (re)defined.
+     */
+    unsigned long getEpoch() const;
+    void bumpEpoch();
 
     void raise(const char *msg);
 
@@ -53,6 +77,8 @@ namespace PS {
      * Running blocks
      */
     bool run(Block *block);
+    void suspend();
+    Runnable *getMachine();
 
     /**
      * Assertions
@@ -60,6 +86,7 @@ namespace PS {
     bool expect(DataType a);
     bool expect(DataType a, DataType b);
     bool expect(DataType a, DataType b, DataType c);
+    bool expect(DataType a, DataType b, DataType c, DataType d, DataType e);
     bool expectNotEmpty();
     bool expectAtLeast(unsigned int count);
     bool expectTwoEqual();
@@ -68,51 +95,144 @@ namespace PS {
   private:
     Fallible *errorReceiver;
     Runnable *targetMachine;
-    std::map<long, Block *> internalDefinitions;
+
+    /**
+     * @brief the dictionary of blocks, indexed by symbol.
+     */
+    std::vector<Block *> internalDefinitions;
+    unsigned long epoch;
   };
 
-  inline Environment::Environment(Fallible *f, Runnable *r) : errorReceiver(f), targetMachine(r) { }
+  inline Environment::Environment(Fallible *f, Runnable *r) : errorReceiver(f), targetMachine(r), epoch(1) { }
 
   /**
    * @brief Environment::~Environment
    * cleanup stack and dictionary.
    */
   inline Environment::~Environment() {
-    std::map<long, Block *>::iterator iter;
+    std::vector<Block *>::iterator iter;
     for (iter = internalDefinitions.begin(); iter != internalDefinitions.end(); ++iter) {
-      Type *t = iter->second;
-      delete t;
+      if (*iter) {
+        (*iter)->release();
+      }
     }
   }
 
   /**
-   * Pop operations
+   * Pop operations. popRaw and popBlock hand the reference of the stack
+   * to the caller, who has to release it.
    */
   template <typename T> inline T Environment::pop() {
-     Type *t = Stack::pop();
+     Type *t = Stack::pop().asObject();
      Value<T> *v = static_cast<Value<T> *>(t);     
      T value = v->value;
-     if (!v->blessed) {
-       delete v;
-     }
-
+     v->release();
      return value;
   }
 
+  /**
+   * @brief pop a number, integers are converted
+   */
+  template <> inline double Environment::pop<double>() {
+    Item v = Stack::pop();
+    double value = v.asDouble();
+    Stack::release(v);
+    return value;
+  }
+
+  template <> inline long long Environment::pop<long long>() {
+    Item v = Stack::pop();
+    long long value = v.asInteger();
+    Stack::release(v);
+    return value;
+  }
+
+  /**
+   * @brief pop a number as a count (of a loop, a range...). Integers don't
+   * go through the FPU, other numbers are truncated.
+   */
+  inline long Environment::popCount() {
+    if (Stack::top().isInteger()) {
+      return (long) pop<long long>();
+    }
+
+    return (long) pop<double>();
+  }
+
+  template <> inline std::string Environment::pop<std::string>() {
+    String *s = static_cast<String *>(Stack::pop().asObject());
+    std::string value = s->str();
+    s->release();
+    return value;
+  }
+
+  template <> inline bool Environment::pop<bool>() {
+    return Stack::pop().asBoolean();
+  }
+
   inline Block * Environment::popBlock() {
-    return (Block *) Stack::pop();
+    return (Block *) Stack::pop().asObject();
   }
 
-  inline Type *Environment::popRaw() {
+  /**
+   * @brief pop the top item as it is, the caller takes over it's reference
+   */
+  inline Item Environment::popItem() {
     return Stack::pop();
   }
 
+  /**
+   * @brief pop the top item as a heap value. Numbers and booleans are
+   * boxed.
+   */
+  inline Type *Environment::popRaw() {
+    Item v = Stack::pop();
+    if (v.isObject()) {
+      return v.asObject();
+    }
+
+    if (v.isNumber()) {
+      return new Number(v.asNumber());
+    }
+
+    if (v.isSmallInteger()) {
+      return new Integer(v.asSmallInteger());
+    }
+
+    return new Boolean(v.asBoolean());
+  }
+
   /**
    * Peeking
    */
-  DataType Environment::peekType() {
-    Type *v = Stack::top();
-    return v->type;
+  inline DataType Environment::peekType() {
+    return Stack::top().type();
+  }
+
+  /**
+   * @brief the value of the number (or integer) on top of the stack (unchecked).
+   */
+  inline double Environment::peekNumber() {
+    return Stack::top().asDouble();
+  }
+
+  /**
+   * @brief the top item, it stays on the stack (unchecked).
+   */
+  inline Item Environment::peek() {
+    return Stack::top();
+  }
+
+  /**
+   * @brief test the types of the topmost items without raising an error.
+   * @param a b -> First(b) Second(a)
+   */
+  inline bool Environment::peekIs(DataType a) {
+    return Stack::hasAtLeast(1) && Stack::expect(a);
+  }
+
+  inline bool Environment::peekIs(DataType a, DataType b) {
+    return Stack::hasAtLeast(2) && Stack::expect(a, b);
   }
 
   /**
@@ -120,18 +240,42 @@ namespace PS {
    */
 
   inline void Environment::push(double v) {
-    Stack::push(new Number(v));
+    Stack::push(Item(v));
+  }
+
+  inline void Environment::push(long long v) {
+    Stack::push(Item::integer(v));
   }
 
   inline void Environment::push(const char *v) {
-    Stack::push(new String(v));
+    Stack::push(Item(new String(v)));
   }
 
   inline void Environment::push(bool v) {
-    Stack::push(new Boolean(v));
+    Stack::push(Item(v));
   }
 
-  inline void Environment::push(Type *v) {    
+  /**
+   * @brief push a heap value, the stack takes over the reference of the
+   * caller. Numbers, integers and booleans are unboxed.
+   */
+  inline void Environment::push(Type *v) {
+    if (v->type == Number_T) {
+      Stack::push(Item(static_cast<Number *>(v)->value));
+    } else if (v->type == Integer_T) {
+      // Large integers get a new box
+      Stack::push(Item::integer(static_cast<Integer *>(v)->value));
+    } else if (v->type == Boolean_T) {
+      Stack::push(Item(static_cast<Boolean *>(v)->value));
+    } else {
+      Stack::push(Item(v));
+      return;
+    }
+
+    v->release();
+  }
+
+  inline void Environment::push(Item v) {
     Stack::push(v);
   }
 
@@ -139,17 +283,41 @@ namespace PS {
     return targetMachine->run(block);
   }
 
+  /**
+   * @brief called by a native function that can't produce it's result
+   * right away (e.g. it waits for I/O). The VM stops after the function
+   * returns. The host pushes the result later and resumes the VM.
+   */
+  inline void Environment::suspend() {
+    targetMachine->suspend();
+  }
+
+  /**
+   * @brief the machine that runs this environment
+   */
+  inline Runnable *Environment::getMachine() {
+    return targetMachine;
+  }
+
   /**
    * @brief def associates blocks with names in the dictionary.
    * def can be used to define funtions or constants.
    * @param name the key for the dictionary
    * @param def the block which is stored with this key in the dictionary.
+   * The dictionary takes over the reference of the caller.
    */
   inline void Environment::def(const char *name, Block *def) {
-    def->bless();
-    std::string v = std::string(name);
-    long hash = Util::NumericUtils::hash(v);
-    internalDefinitions[hash] = def;
+    unsigned int symbol = SymbolTable::global().intern(name);
+    if (symbol >= internalDefinitions.size()) {
+      internalDefinitions.resize(symbol + 1, 0);
+    }
+
+    if (internalDefinitions[symbol]) {
+      internalDefinitions[symbol]->release();
+    }
+
+    internalDefinitions[symbol] = def;
+    bumpEpoch();
   }
 
   /**
@@ -162,30 +330,73 @@ namespace PS {
     targetMachine->def(name, def);
   }
 
-  inline bool Environment::hasDefinition(long hash) {
+  inline bool Environment::hasDefinition(unsigned int symbol) {
     return
-        this->internalDefinitions.find(hash) !=
-        this->internalDefinitions.end();
+        symbol < this->internalDefinitions.size() &&
+        this->internalDefinitions[symbol] != 0;
   }
 
-  inline Block *Environment::getDefinition(long hash) {
-    return this->internalDefinitions[hash];
+  inline Block *Environment::getDefinition(unsigned int symbol) {
+    return this->internalDefinitions[symbol];
+  }
+
+  /**
+   * @brief a copy of the dictionary. The caller holds a reference to every
+   * block in it.
+   */
+  inline std::vector<Block *> Environment::saveDefinitions() const {
+    std::vector<Block *> saved = this->internalDefinitions;
+    for (unsigned int i = 0; i < saved.size(); i++) {
+      if (saved[i]) {
+        saved[i]->retain();
+      }
+    }
+
+    return saved;
+  }
+
+  /**
+   * @brief replace the dictionary with a saved one. The dictionary takes
+   * over the references of the saved blocks.
+   */
+  inline void Environment::restoreDefinitions(const std::vector<Block *> &saved) {
+    for (unsigned int i = 0; i < internalDefinitions.size(); i++) {
+      if (internalDefinitions[i]) {
+        internalDefinitions[i]->release();
+      }
+    }
+
+    internalDefinitions = saved;
+    bumpEpoch();
+  }
+
+  inline SymbolTable &Environment::getSymbols() {
+    return SymbolTable::global();
+  }
+
+  inline unsigned long Environment::getEpoch() const {
+    return this->epoch;
+  }
+
+  /**
+   * @brief invalidates all cached call sites.
+   */
+  inline void Environment::bumpEpoch() {
+    this->epoch++;
   }
 
   inline bool Environment::expect(DataType a) {
-    if (Stack::size() < 1) {
+    if (!Stack::hasAtLeast(1)) {
       return false;
     }
 
     if(!Stack::expect(a)) {
-      Type *t = Stack::top();
-
       std::ostringstream ss;
       ss << "assertion failed: ";
       ss << "expected (";
-      ss << t->toString(a);
+      ss << Type::toString(a);
       ss << ") but found: (";
-      ss << Stack::top()->toString();
+      ss << Type::toString(Stack::top().type());
       ss << ").";
 
       raise(ss.str().c_str());
@@ -196,23 +407,21 @@ namespace PS {
   }
 
   inline bool Environment::expect(DataType a, DataType b) {
-    if (Stack::size() < 2) {
+    if (!Stack::hasAtLeast(2)) {
       return false;
     }
 
     if(!Stack::expect(a, b)) {
-      Type *t = Stack::top();
-
       std::ostringstream ss;
       ss << "assertion failed: ";
       ss << "expected (";
-      ss << t->toString(b);
+      ss << Type::toString(b);
       ss << ", ";
-      ss << t->toString(a);
+      ss << Type::toString(a);
       ss << ") but found: (";
-      ss << Stack::top()->toString();
+      ss << Type::toString(Stack::top().type());
       ss << ", ";
-      ss << Stack::second()->toString();
+      ss << Type::toString(Stack::second().type());
       ss << ").";
 
       raise(ss.str().c_str());
@@ -228,22 +437,46 @@ namespace PS {
     }
 
     if(!Stack::expect(a, b, c)) {
-      Type *t = Stack::top();
-
       std::ostringstream ss;
       ss << "assertion failed: ";
       ss << "expected (";
-      ss << t->toString(c);
+      ss << Type::toString(c);
       ss << ", ";
-      ss << t->toString(b);
+      ss << Type::toString(b);
       ss << ", ";
-      ss << t->toString(a);
+      ss << Type::toString(a);
       ss << ") but found: (";
-      ss << Stack::top()->toString();
+      ss << Type::toString(Stack::top().type());
       ss << ", ";
-      ss << Stack::second()->toString();
+      ss << Type::toString(Stack::second().type());
       ss << ", ";
-      ss << Stack::third()->toString();
+      ss << Type::toString(Stack::third().type());
+      ss << ").";
+
+      raise(ss.str().c_str());
+      return false;
+    } else {
+      return true;
+    }
+  }
+
+  inline bool Environment::expect(DataType a, DataType b, DataType c, DataType d, DataType e) {
+    if (!expectAtLeast(5)) {
+      return false;
+    }
+
+    if(!Stack::expect(a, b, c, d, e)) {
+      DataType expected[] = { e, d, c, b, a };
+      std::ostringstream ss;
+      ss << "assertion failed: ";
+      ss << "expected (";
+      for (unsigned int i = 0; i < 5; i++) {
+        ss << (i ? ", " : "") << Type::toString(expected[i]);
+      }
+      ss << ") but found: (";
+      for (unsigned int i = 0; i < 5; i++) {
+        ss << (i ? ", " : "") << Type::toString(Stack::below(i).type());
+      }
       ss << ").";
 
       raise(ss.str().c_str());
@@ -254,7 +487,7 @@ namespace PS {
   }
 
   inline bool Environment::expectNotEmpty() {
-    if (Stack::size() == 0) {
+    if (Stack::empty()) {
       raise("assertion failed: stack empty");
       return false;
     } else {
@@ -263,7 +496,7 @@ namespace PS {
   }
 
   inline bool Environment::expectAtLeast(unsigned int count) {
-    if (Stack::size() < count) {
+    if (!Stack::hasAtLeast(count)) {
       raise("assertion failed: not enough items on stack");
       return false;
     } else {
@@ -276,12 +509,13 @@ namespace PS {
       return false;
     }
 
-    if (!(Stack::top()->type == Stack::second()->type)) {
+    // Integers and numbers mix
+    if (!(Stack::kind(Stack::top()) == Stack::kind(Stack::second()))) {
       std::ostringstream ss;
       ss << "Expected two equal types but found ";
-      ss << Stack::top()->toString();
+      ss << Type::toString(Stack::top().type());
       ss << " and ";
-      ss << Stack::second()->toString();
+      ss << Type::toString(Stack::second().type());
       raise(ss.str().c_str());
       return false;
     } else {
@@ -294,15 +528,15 @@ namespace PS {
       return false;
     }
 
-    if(!((Stack::top()->type == Stack::second()->type) &&
-         (Stack::second()->type == Stack::third()->type))) {
+    if(!((Stack::kind(Stack::top()) == Stack::kind(Stack::second())) &&
+         (Stack::kind(Stack::second()) == Stack::kind(Stack::third())))) {
       std::ostringstream ss;
       ss << "Expected three equal types but found ";
-      ss << Stack::top()->toString();
+      ss << Type::toString(Stack::top().type());
       ss << ", ";
-      ss << Stack::second()->toString();
+      ss << Type::toString(Stack::second().type());
       ss << " and ";
-      ss << Stack::third()->toString();
+      ss << Type::toString(Stack::third().type());
       raise(ss.str().c_str());
       return false;
     } else {
@@ -1,29 +1,82 @@
 #ifndef FREESTORE_H
 #define FREESTORE_H
 
-#include <deque>
-
-#include "Types.h"
+#include <cstdlib>
 
 namespace PS {
+  /**
+   * @brief A per-thread pool of freed values of type T.
+   * The memory of freed values is kept in an intrusive list (a freed value
+   * holds the link to the next one). Every thread has it's own list, so no
+   * locking is needed and values may be freed on another thread than the
+   * one that allocated them. A thread's list is released when it exits.
+   */
   template <typename T> class FreeStore {
   public:
-    T *get() {
-      if (store.empty()) {
+    static T *get() {
+      Pool &pool = local();
+      if (!pool.head) {
         return 0;
-      } else {
-        T *p = store.front();
-        store.pop_front();
-        return p;
       }
+
+      Node *node = pool.head;
+      pool.head = node->next;
+      pool.size--;
+      return reinterpret_cast<T *>(node);
     }
 
-    void destroy(T *p) {
-      store.push_back(p);
+    static void destroy(T *p) {
+      Pool &pool = local();
+      if (pool.size >= MAX_SIZE) {
+        free(p);
+        return;
+      }
+
+      if (!pool.head) {
+        reaper();
+      }
+
+      Node *node = reinterpret_cast<Node *>(p);
+      node->next = pool.head;
+      pool.head = node;
+      pool.size++;
     }
 
   private:
-    std::deque<T *> store;
+    struct Node {
+      Node *next;
+    };
+
+    // Trivially destructible, so it can be used until the thread is gone
+    struct Pool {
+      Node *head;
+      unsigned int size;
+    };
+
+    struct Reaper {
+      ~Reaper() {
+        Pool &pool = local();
+        while (pool.head) {
+          Node *node = pool.head;
+          pool.head = node->next;
+          free(node);
+        }
+        pool.size = 0;
+      }
+    };
+
+    // Values freed beyond this are given back to the system
+    static const unsigned int MAX_SIZE = 1 << 16;
+
+    static Pool &local() {
+      static thread_local Pool pool = { 0, 0 };
+      return pool;
+    }
+
+    static void reaper() {
+      static thread_local Reaper reaper;
+      (void) reaper;
+    }
   };
 }
 
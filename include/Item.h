@@ -0,0 +1,158 @@
+#ifndef ITEM_H
+#define ITEM_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "Types.h"
+
+namespace PS {
+  /**
+   * @brief A stack item in 8 bytes (NaN-boxing).
+   *
+   * Numbers are stored as the double itself. The quiet NaNs with the bits
+   * of QNAN set are not produced by arithmetic, they encode the other items:
+   * booleans are QNAN plus a tag, integers that fit in 48 bits are QNAN plus
+   * the integer tag plus the value, strings, blocks and larger integers are
+   * QNAN plus the sign bit plus the pointer to the heap value (pointers fit
+   * in 48 bits).
+   *
+   * So numbers, booleans and most integers never allocate. An item that
+   * points to a heap value holds a reference to it (see Type::retain).
+   */
+  class Item {
+  public:
+    Item() : bits(0) { }
+
+    explicit Item(double v) {
+      memcpy(&bits, &v, sizeof(double));
+
+      // A NaN that looks like a tagged item becomes the plain NaN
+      if ((bits & QNAN) == QNAN) {
+        bits = CANONICAL_NAN;
+      }
+    }
+
+    explicit Item(bool v) : bits(v ? TRUE_ITEM : FALSE_ITEM) { }
+
+    explicit Item(Type *v) : bits(OBJECT | (uint64_t) (uintptr_t) v) { }
+
+    /**
+     * @brief an integer item, inline if it fits in 48 bits
+     */
+    static Item integer(long long v) {
+      if (!fitsInline(v)) {
+        return boxed(v);
+      }
+
+      Item item;
+      item.bits = INTEGER | ((uint64_t) v & POINTER);
+      return item;
+    }
+
+    static bool fitsInline(long long v) {
+      return v >= MIN_INLINE && v <= MAX_INLINE;
+    }
+
+    static Item fromBits(uint64_t bits) {
+      Item item;
+      item.bits = bits;
+      return item;
+    }
+
+    bool isNumber() const {
+      return (bits & QNAN) != QNAN;
+    }
+
+    bool isBoolean() const {
+      return (bits | 1) == TRUE_ITEM;
+    }
+
+    bool isObject() const {
+      return (bits & OBJECT) == OBJECT;
+    }
+
+    bool isSmallInteger() const {
+      return (bits & TAG) == INTEGER;
+    }
+
+    bool isInteger() const {
+      return isSmallInteger() || (isObject() && asObject()->type == Integer_T);
+    }
+
+    /**
+     * @brief numbers and integers
+     */
+    bool isNumeric() const {
+      return isNumber() || isInteger();
+    }
+
+    DataType type() const {
+      if (isNumber()) {
+        return Number_T;
+      }
+
+      if (isSmallInteger()) {
+        return Integer_T;
+      }
+
+      return isObject() ? asObject()->type : Boolean_T;
+    }
+
+    double asNumber() const {
+      double v;
+      memcpy(&v, &bits, sizeof(double));
+      return v;
+    }
+
+    bool asBoolean() const {
+      return bits == TRUE_ITEM;
+    }
+
+    Type *asObject() const {
+      return (Type *) (uintptr_t) (bits & POINTER);
+    }
+
+    long long asSmallInteger() const {
+      // Sign extend the 48 bit value
+      return (long long) (bits << 16) >> 16;
+    }
+
+    long long asInteger() const {
+      return isSmallInteger() ? asSmallInteger() : static_cast<Integer *>(asObject())->value;
+    }
+
+    /**
+     * @brief the value of a number or integer as a double
+     */
+    double asDouble() const {
+      return isNumber() ? asNumber() : (double) asInteger();
+    }
+
+    bool operator==(const Item &other) const {
+      return bits == other.bits;
+    }
+
+    uint64_t bits;
+
+  private:
+    PS_NOINLINE static Item boxed(long long v) {
+      return Item(new Integer(v));
+    }
+
+    static const uint64_t QNAN = 0x7ffc000000000000ULL;
+    static const uint64_t SIGN = 0x8000000000000000ULL;
+    static const uint64_t OBJECT = SIGN | QNAN;
+    static const uint64_t TAG = 0xffff000000000000ULL;
+    static const uint64_t INTEGER = QNAN | 0x0001000000000000ULL;
+    static const uint64_t POINTER = 0x0000ffffffffffffULL;
+    static const uint64_t FALSE_ITEM = QNAN | 2;
+    static const uint64_t TRUE_ITEM = QNAN | 3;
+    static const uint64_t CANONICAL_NAN = 0x7ff8000000000000ULL;
+
+    static const long long MIN_INLINE = -(1LL << 47);
+    static const long long MAX_INLINE = (1LL << 47) - 1;
+  };
+}
+
+#endif // ITEM_H
@@ -0,0 +1,502 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "Types.h"
+#include "Item.h"
+
+namespace PS {
+  /**
+   * @brief Maps are hash tables from strings or numbers to any value.
+   *
+   * The table uses open addressing in the style of a Swiss table: every
+   * slot has a control byte that tells if it is empty, deleted or full,
+   * a full slot keeps 7 bits of the hash of it's key. A lookup compares
+   * a whole group of 16 control bytes at once (with SSE2 where available)
+   * and only looks at the keys whose bits match. The slots are stored in
+   * one array, so a lookup touches few cache lines.
+   *
+   * Numbers are compared by value, so 2 and 2.0 are the same key. The map
+   * holds a reference to it's keys and values. Like strings and arrays,
+   * maps are only changed in place while they are not shared. A copy of a
+   * map shares the keys and values with the original, values are copied
+   * when they are changed.
+   *
+   * The memory of all maps is counted, see totalMemory.
+   */
+  class Map : public Type {
+  public:
+    /**
+     * @param expected the number of entries to make room for
+     */
+    Map(size_t expected);
+    ~Map();
+    Map *clone() const;
+
+    /**
+     * @brief looks up a key. The value is not retained for the caller.
+     */
+    bool get(Item key, Item &value) const;
+
+    /**
+     * @brief add or replace an entry. The map takes over the references
+     * of the caller to key and value.
+     */
+    void put(Item key, Item value);
+    bool remove(Item key);
+
+    size_t size() const;
+
+    /**
+     * @brief the bytes used by the table (not by the keys and values)
+     */
+    size_t memoryUse() const;
+
+    /**
+     * @brief the bytes used by all maps of the process, wherever they are
+     * held (stacks, other maps, channels, ...). Maps move between VMs, so
+     * they are not counted per VM.
+     */
+    static size_t totalMemory();
+
+    /**
+     * @brief iterating: the slots 0 .. getCapacity() - 1, only full slots
+     * hold an entry.
+     */
+    size_t getCapacity() const;
+    bool isFull(size_t slot) const;
+    Item keyAt(size_t slot) const;
+    Item valueAt(size_t slot) const;
+
+    /**
+     * @brief strings and numbers (except NaN) can be keys
+     */
+    static bool isKey(Item key);
+
+    // The most entries a script can make room for in advance (see map-new)
+    static const size_t MAX_PRESIZE = (size_t) 1 << 24;
+
+    void *operator new (size_t size) {
+      void *p = FreeStore<Map>::get();
+      return p ? p : malloc(size);
+    }
+
+    void operator delete(void *p) {
+      FreeStore<Map>::destroy((Map *)p);
+    }
+
+  private:
+    Map(const Map &);
+    Map &operator=(const Map &);
+
+    struct Slot {
+      Item key;
+      Item value;
+    };
+
+    static const size_t GROUP = 16;
+    static const size_t NOT_FOUND = ~(size_t) 0;
+    static const int8_t EMPTY = -128;
+    static const int8_t DELETED = -2;
+
+    // Larger tables can't be addressed (and never fit into memory anyway)
+    static const size_t MAX_CAPACITY = ~(size_t) 0 / (sizeof(Slot) * 2);
+
+    static size_t capacityFor(size_t entries);
+    static size_t hashOf(Item key);
+    static bool sameKey(Item a, Item b);
+    static size_t lowestBit(uint32_t bits);
+    static std::atomic<size_t> &allocated();
+
+    static uint32_t match(const int8_t *group, int8_t h2);
+    static uint32_t matchEmpty(const int8_t *group);
+    static uint32_t matchFree(const int8_t *group);
+
+    void allocate(size_t capacity);
+    void deallocate();
+    size_t find(Item key, size_t hash) const;
+    size_t findFree(size_t hash) const;
+    void setControl(size_t slot, int8_t control);
+    void rehash(size_t capacity);
+
+    /**
+     * The control bytes, one per slot. The first group is repeated at the
+     * end, so a group can be loaded at any slot without wrapping around.
+     */
+    int8_t *control;
+    Slot *slots;
+    size_t mask;
+    size_t count;
+
+    // Inserts into empty slots left before the table has to grow
+    size_t growthLeft;
+  };
+
+  /**
+   * @brief throws std::bad_alloc if the table for 'expected' entries can't
+   * be allocated
+   */
+  inline Map::Map(size_t expected) : Type(Map_T), count(0) {
+    allocate(capacityFor(expected));
+    allocated() += sizeof(Map);
+  }
+
+  inline Map::~Map() {
+    for (size_t i = 0; i <= mask; i++) {
+      if (isFull(i)) {
+        if (slots[i].key.isObject()) {
+          slots[i].key.asObject()->release();
+        }
+        if (slots[i].value.isObject()) {
+          slots[i].value.asObject()->release();
+        }
+      }
+    }
+
+    deallocate();
+    allocated() -= sizeof(Map);
+  }
+
+  /**
+   * @brief a copy of the table that shares the keys and values
+   */
+  inline Map *Map::clone() const {
+    Map *copy = new Map(0);
+    copy->deallocate();
+
+    copy->allocate(mask + 1);
+    memcpy(copy->control, control, mask + 1 + GROUP);
+    copy->count = count;
+    copy->growthLeft = growthLeft;
+
+    for (size_t i = 0; i <= mask; i++) {
+      if (isFull(i)) {
+        copy->slots[i] = slots[i];
+        if (slots[i].key.isObject()) {
+          slots[i].key.asObject()->retain();
+        }
+        if (slots[i].value.isObject()) {
+          slots[i].value.asObject()->retain();
+        }
+      }
+    }
+
+    return copy;
+  }
+
+  inline bool Map::get(Item key, Item &value) const {
+    size_t slot = find(key, hashOf(key));
+    if (slot == NOT_FOUND) {
+      return false;
+    }
+
+    value = slots[slot].value;
+    return true;
+  }
+
+  inline void Map::put(Item key, Item value) {
+    size_t hash = hashOf(key);
+    size_t slot = find(key, hash);
+
+    if (slot != NOT_FOUND) {
+      if (key.isObject()) {
+        key.asObject()->release();
+      }
+      if (slots[slot].value.isObject()) {
+        slots[slot].value.asObject()->release();
+      }
+      slots[slot].value = value;
+      return;
+    }
+
+    slot = findFree(hash);
+    if (growthLeft == 0 && control[slot] == EMPTY) {
+      // Grows the table, or only drops the deleted slots if there are many
+      rehash(capacityFor(count * 2 + 1));
+      slot = findFree(hash);
+    }
+
+    if (control[slot] == EMPTY) {
+      growthLeft--;
+    }
+
+    setControl(slot, (int8_t) (hash & 0x7f));
+    slots[slot].key = key;
+    slots[slot].value = value;
+    count++;
+  }
+
+  inline bool Map::remove(Item key) {
+    size_t slot = find(key, hashOf(key));
+    if (slot == NOT_FOUND) {
+      return false;
+    }
+
+    if (slots[slot].key.isObject()) {
+      slots[slot].key.asObject()->release();
+    }
+    if (slots[slot].value.isObject()) {
+      slots[slot].value.asObject()->release();
+    }
+
+    // The slot may be part of a probe sequence, so it can't become empty
+    setControl(slot, DELETED);
+    count--;
+    return true;
+  }
+
+  inline size_t Map::size() const {
+    return count;
+  }
+
+  inline size_t Map::memoryUse() const {
+    return sizeof(Map) + (mask + 1 + GROUP) + (mask + 1) * sizeof(Slot);
+  }
+
+  inline size_t Map::totalMemory() {
+    return allocated().load();
+  }
+
+  inline size_t Map::getCapacity() const {
+    return mask + 1;
+  }
+
+  inline bool Map::isFull(size_t slot) const {
+    return control[slot] >= 0;
+  }
+
+  inline Item Map::keyAt(size_t slot) const {
+    return slots[slot].key;
+  }
+
+  inline Item Map::valueAt(size_t slot) const {
+    return slots[slot].value;
+  }
+
+  inline bool Map::isKey(Item key) {
+    DataType type = key.type();
+    if (type == Number_T) {
+      return !std::isnan(key.asNumber());
+    }
+
+    return type == Integer_T || type == String_T;
+  }
+
+  /**
+   * @brief the smallest power of two (at least one group) that holds
+   * 'entries' at a load of 7/8
+   */
+  inline size_t Map::capacityFor(size_t entries) {
+    size_t capacity = GROUP;
+    while (capacity * 7 / 8 < entries && capacity <= MAX_CAPACITY) {
+      capacity *= 2;
+    }
+
+    return capacity;
+  }
+
+  inline size_t Map::hashOf(Item key) {
+    uint64_t h;
+    if (key.type() == String_T) {
+      h = static_cast<String *>(key.asObject())->hash();
+    } else {
+      // 2 and 2.0 hash alike, and so do 0 and -0
+      double d = key.asDouble() + 0.0;
+      memcpy(&h, &d, sizeof(double));
+    }
+
+    // Mix, so that the low bits (the control byte) depend on all bits
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t) h;
+  }
+
+  inline bool Map::sameKey(Item a, Item b) {
+    if (a == b) {
+      return true;
+    }
+
+    if (a.type() == String_T || b.type() == String_T) {
+      return a.type() == b.type() &&
+          String::equal(static_cast<String *>(a.asObject()), static_cast<String *>(b.asObject()));
+    }
+
+    if (a.isInteger() && b.isInteger()) {
+      return a.asInteger() == b.asInteger();
+    }
+
+    return a.asDouble() == b.asDouble();
+  }
+
+  inline size_t Map::lowestBit(uint32_t bits) {
+#ifdef __GNUC__
+    return __builtin_ctz(bits);
+#else
+    size_t bit = 0;
+    while (!(bits & 1)) {
+      bits >>= 1;
+      bit++;
+    }
+    return bit;
+#endif
+  }
+
+  inline std::atomic<size_t> &Map::allocated() {
+    static std::atomic<size_t> bytes(0);
+    return bytes;
+  }
+
+#ifdef __SSE2__
+
+  inline uint32_t Map::match(const int8_t *group, int8_t h2) {
+    __m128i g = _mm_loadu_si128((const __m128i *) group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(h2)));
+  }
+
+  inline uint32_t Map::matchEmpty(const int8_t *group) {
+    return match(group, EMPTY);
+  }
+
+  // Empty and deleted slots have the high bit set
+  inline uint32_t Map::matchFree(const int8_t *group) {
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+  }
+
+#else
+
+  inline uint32_t Map::match(const int8_t *group, int8_t h2) {
+    uint32_t bits = 0;
+    for (size_t i = 0; i < GROUP; i++) {
+      bits |= (uint32_t) (group[i] == h2) << i;
+    }
+    return bits;
+  }
+
+  inline uint32_t Map::matchEmpty(const int8_t *group) {
+    return match(group, EMPTY);
+  }
+
+  inline uint32_t Map::matchFree(const int8_t *group) {
+    uint32_t bits = 0;
+    for (size_t i = 0; i < GROUP; i++) {
+      bits |= (uint32_t) (group[i] < 0) << i;
+    }
+    return bits;
+  }
+
+#endif
+
+  /**
+   * @brief a new, empty table. Throws std::bad_alloc like new if there is
+   * no memory for it, the current table is kept then.
+   */
+  inline void Map::allocate(size_t capacity) {
+    int8_t *newControl = 0;
+    Slot *newSlots = 0;
+    if (capacity <= MAX_CAPACITY) {
+      newControl = (int8_t *) malloc(capacity + GROUP);
+      newSlots = (Slot *) malloc(capacity * sizeof(Slot));
+    }
+
+    if (!newControl || !newSlots) {
+      free(newControl);
+      free(newSlots);
+      throw std::bad_alloc();
+    }
+
+    control = newControl;
+    slots = newSlots;
+    memset(control, EMPTY, capacity + GROUP);
+    mask = capacity - 1;
+    growthLeft = capacity * 7 / 8 - count;
+    allocated() += (capacity + GROUP) + capacity * sizeof(Slot);
+  }
+
+  inline void Map::deallocate() {
+    free(control);
+    free(slots);
+    allocated() -= (mask + 1 + GROUP) + (mask + 1) * sizeof(Slot);
+  }
+
+  /**
+   * @brief the groups are probed in triangular steps, which visits every
+   * group of a power of two table.
+   */
+  inline size_t Map::find(Item key, size_t hash) const {
+    int8_t h2 = (int8_t) (hash & 0x7f);
+    size_t position = (hash >> 7) & mask;
+
+    for (size_t step = GROUP; ; step += GROUP) {
+      uint32_t bits = match(control + position, h2);
+      while (bits) {
+        size_t slot = (position + lowestBit(bits)) & mask;
+        if (sameKey(slots[slot].key, key)) {
+          return slot;
+        }
+        bits &= bits - 1;
+      }
+
+      if (matchEmpty(control + position)) {
+        return NOT_FOUND;
+      }
+
+      position = (position + step) & mask;
+    }
+  }
+
+  inline size_t Map::findFree(size_t hash) const {
+    size_t position = (hash >> 7) & mask;
+
+    for (size_t step = GROUP; ; step += GROUP) {
+      uint32_t bits = matchFree(control + position);
+      if (bits) {
+        return (position + lowestBit(bits)) & mask;
+      }
+
+      position = (position + step) & mask;
+    }
+  }
+
+  inline void Map::setControl(size_t slot, int8_t value) {
+    control[slot] = value;
+
+    // Keep the copy of the first group in sync
+    if (slot < GROUP) {
+      control[mask + 1 + slot] = value;
+    }
+  }
+
+  inline void Map::rehash(size_t capacity) {
+    int8_t *oldControl = control;
+    Slot *oldSlots = slots;
+    size_t oldCapacity = mask + 1;
+
+    allocate(capacity);
+
+    for (size_t i = 0; i < oldCapacity; i++) {
+      if (oldControl[i] >= 0) {
+        size_t hash = hashOf(oldSlots[i].key);
+        size_t slot = findFree(hash);
+        setControl(slot, (int8_t) (hash & 0x7f));
+        slots[slot] = oldSlots[i];
+      }
+    }
+
+    free(oldControl);
+    free(oldSlots);
+    allocated() -= (oldCapacity + GROUP) + oldCapacity * sizeof(Slot);
+  }
+}
+
+#endif // MAP_H
@@ -1,8 +1,8 @@
 #ifndef NUMERICUTILS_H
 #define NUMERICUTILS_H
 
+#include <climits>
 #include <limits>
-#include <locale>
 
 namespace PS { namespace Util {
   class NumericUtils {
@@ -13,7 +13,7 @@ namespace PS { namespace Util {
      *
      * TODO: replace this with std::numeric_limits<double>::epsilon()
      */
-    static const double DOUBLE_EPSILON = 0.0000001;
+    static constexpr double DOUBLE_EPSILON = 0.0000001;
 
     /* double absolute */
     static inline double absDouble(double a) {
@@ -80,10 +80,47 @@ namespace PS { namespace Util {
       return result;
     }
 
-    static inline long hash(std::string &str) {
-      std::locale loc;
-      const std::collate<char>& coll = std::use_facet<std::collate<char> >(loc);
-      return coll.hash(str.data(),str.data()+str.length());
+    /* r = a + b, true if the sum doesn't fit */
+    static inline bool addOverflows(long long a, long long b, long long *r) {
+#ifdef __GNUC__
+      return __builtin_add_overflow(a, b, r);
+#else
+      if (b > 0 ? a > LLONG_MAX - b : a < LLONG_MIN - b) {
+        return true;
+      }
+
+      *r = a + b;
+      return false;
+#endif
+    }
+
+    /* r = a - b, true if the difference doesn't fit */
+    static inline bool subOverflows(long long a, long long b, long long *r) {
+#ifdef __GNUC__
+      return __builtin_sub_overflow(a, b, r);
+#else
+      if (b > 0 ? a < LLONG_MIN + b : a > LLONG_MAX + b) {
+        return true;
+      }
+
+      *r = a - b;
+      return false;
+#endif
+    }
+
+    /* r = a * b, true if the product doesn't fit */
+    static inline bool mulOverflows(long long a, long long b, long long *r) {
+#ifdef __GNUC__
+      return __builtin_mul_overflow(a, b, r);
+#else
+      if (a > 0 ? (b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a)
+                : (b > 0 ? a < LLONG_MIN / b : a != 0 && b < LLONG_MAX / a)) {
+        return true;
+      }
+
+      *r = a * b;
+      return false;
+#endif
     }
   };
 } }
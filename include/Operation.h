@@ -4,31 +4,95 @@
 #include "Type.h"
 
 namespace PS {
+  class Block;
+  class Environment;
+  typedef void (*ExternalFunction)(Environment *);
+
   /**
    * @brief VM opcodes.
    * The possible opcodes understood by the vm.
    */
   enum Opcode {
     Push_OC,
+    PushNumber_OC,
+    PushInteger_OC,
+    PushBoolean_OC,
     Call_OC,
     Plus_OC,
     Minus_OC,
+    Mul_OC,
+    Div_OC,
+    Equals_OC,
+    Gt_OC,
+    Lt_OC,
     Dup_OC,
     Swap_OC,
-    If_OC
+    Drop_OC,
+    If_OC,
+    IfElse_OC,
+    Repeat_OC,
+    Times_OC,
+    While_OC,
+    Inline_OC,
+
+    // Superinstructions, see Optimizer.h
+    PushAdd_OC,
+    PushSub_OC,
+    PushSubDup_OC,
+    DupPush_OC,
+    SwapPlus_OC,
+    PushMul_OC,
+    PushDiv_OC,
+    PushGt_OC,
+    PushLt_OC,
+    DupPushGt_OC,
+    DupPushLt_OC
   };
 
   /**
    * @brief Represents a vm operation.
-   * There are only two possible operations: push and call.
+   * Operations are stored by value in a contiguous array per block. The
+   * operand is kept inline: number, integer and boolean literals are stored directly, calls
+   * store the index of their call site and pushes of strings and blocks
+   * store an index into the constant pool of the block. Superinstructions
+   * keep their literal as the bits of an Item.
    */
   class Operation {
     public:
-      Operation (Opcode o, Type *v) : opcode(o), value(v) { }
+      Operation (Opcode o) : opcode(o) { operand.number = 0; }
 
       Opcode opcode;
-      Type *value;
+      union {
+        double number;
+        long long integer;
+        unsigned long long literal;
+        bool boolean;
+        unsigned int site;
+        unsigned int constant;
+      } operand;
     };
+
+  /**
+   * @brief A call site caches the definition that a call resolved to.
+   * The cache is valid as long as the epoch matches the dictionary epoch
+   * of the environment. Every definition bumps the dictionary epoch.
+   *
+   * If the body of the called block was inlined at this call site, the call
+   * became an Inline_OC guard followed by 'length' inlined operations.
+   */
+  class CallSite {
+  public:
+    CallSite (unsigned int s) : symbol(s), epoch(0), external(0), target(0), inlined(0), length(0), noInline(false) { }
+
+    unsigned int symbol;
+    unsigned long epoch;
+    ExternalFunction external;
+    Block *target;
+
+    Block *inlined;
+    unsigned int length;
+    bool noInline;
+  };
 }
 
 #endif // OPERATION_H
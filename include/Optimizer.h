@@ -0,0 +1,536 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sstream>
+
+#include "Types.h"
+#include "Fallible.h"
+#include "Environment.h"
+#include "StringTable.h"
+
+namespace PS {
+  /**
+   * @brief Compile passes over parsed blocks.
+   *
+   * Constant folding evaluates operations whose operands are all literals at
+   * compile time and replaces them with their result: 2 3 + => 5. This covers
+   * arithmetic, comparisons, dup, swap and calls to native functions that were
+   * declared pure.
+   * Operations that would raise an error are left alone, so the error
+   * still happens at run time. Literal pushes followed by drop are removed.
+   * An if or ifelse with a literal condition is replaced by the operations of
+   * the taken branch.
+   *
+   * The peephole pass then replaces
+   * frequent sequences of operations with fused superinstructions. A
+   * superinstruction does the work of the sequence with a single dispatch
+   * and without allocating intermediate values:
+   *
+   *   N +        => PushAdd_OC
+   *   N -        => PushSub_OC
+   *   N *        => PushMul_OC
+   *   N /        => PushDiv_OC
+   *   N >        => PushGt_OC
+   *   N <        => PushLt_OC
+   *   N - dup    => PushSubDup_OC
+   *   dup N >    => DupPushGt_OC
+   *   dup N <    => DupPushLt_OC
+   *   dup N      => DupPush_OC
+   *   swap +     => SwapPlus_OC
+   *
+   * N is a number or an integer that fits in an item, the superinstruction
+   * keeps it as the bits of the item (operand.literal).
+   * The fused operations behave exactly like the original sequence, including
+   * the errors they raise.
+   *
+   * Both passes are enabled by default and can be switched off on their own,
+   * e.g. to measure what each of them gains.
+   */
+  class Optimizer {
+  public:
+    Optimizer(const std::vector<ExternalFunction> *pureDefinitions);
+
+    void optimize(Block *block);
+
+    void setFolding(bool folding);
+    bool isFolding() const;
+    void setFusing(bool fusing);
+    bool isFusing() const;
+
+    /**
+     * @brief report how often each fusion fired since the last reset.
+     * @return one line per fusion in the form <name>: <count>
+     */
+    std::string report() const;
+    void reset();
+
+  private:
+    void fold(Block *block);
+    bool isLiteral(const Block *block, const Operation &op) const;
+    bool isBlock(const Block *block, const Operation &op) const;
+    Block *constantBlock(const Block *block, const Operation &op) const;
+    void splice(Block *block, std::vector<Operation> &code, const Block *taken);
+    bool evaluate(Block *block, std::vector<Operation> &code, const Operation &op);
+    ExternalFunction pureDefinition(const Block *block, const Operation &op) const;
+
+    void fuse(Block *block);
+    bool matches(const std::vector<Operation> &code, unsigned int at, Opcode a, Opcode b) const;
+    bool matches(const std::vector<Operation> &code, unsigned int at, Opcode a, Opcode b, Opcode c) const;
+    bool isA(const Operation &op, Opcode a) const;
+    Operation withLiteral(const Operation &op, Opcode fused) const;
+    bool isArithmetic(const std::vector<Operation> &code, unsigned int at) const;
+    void fired(const char *fusion);
+
+    std::map<std::string, unsigned int> fusions;
+
+    // Native functions that may be evaluated at compile time, by symbol
+    const std::vector<ExternalFunction> *pureDefinitions;
+
+    bool folding;
+    bool fusing;
+
+    // Longest run of literals that is considered for folding
+    static const unsigned int MAX_FOLD_OPERANDS = 8;
+  };
+
+  inline Optimizer::Optimizer(const std::vector<ExternalFunction> *pureDefinitions)
+    : pureDefinitions(pureDefinitions), folding(true), fusing(true) { }
+
+  /**
+   * @brief optimize a block and all blocks nested in it. Nested blocks
+   * are optimized first, so they can be spliced into their parent.
+   */
+  inline void Optimizer::optimize(Block *block) {
+    unsigned int constants = block->constants.size();
+    for (unsigned int i = 0; i < constants; i++) {
+      if (block->constants[i]->type == Block_T) {
+        optimize(static_cast<Block *>(block->constants[i]));
+      }
+    }
+
+    if (folding) {
+      fold(block);
+    }
+
+    if (fusing) {
+      fuse(block);
+    }
+  }
+
+  inline void Optimizer::setFolding(bool folding) {
+    this->folding = folding;
+  }
+
+  inline bool Optimizer::isFolding() const {
+    return this->folding;
+  }
+
+  inline void Optimizer::setFusing(bool fusing) {
+    this->fusing = fusing;
+  }
+
+  inline bool Optimizer::isFusing() const {
+    return this->fusing;
+  }
+
+  inline std::string Optimizer::report() const {
+    std::ostringstream ss;
+    std::map<std::string, unsigned int>::const_iterator iter;
+    for (iter = fusions.begin(); iter != fusions.end(); ++iter) {
+      ss << iter->first << ": " << iter->second << std::endl;
+    }
+    return ss.str();
+  }
+
+  inline void Optimizer::reset() {
+    fusions.clear();
+  }
+
+  inline bool Optimizer::matches(const std::vector<Operation> &code, unsigned int at, Opcode a, Opcode b) const {
+    return at + 1 < code.size() && isA(code[at], a) && isA(code[at + 1], b);
+  }
+
+  inline bool Optimizer::matches(const std::vector<Operation> &code, unsigned int at, Opcode a, Opcode b, Opcode c) const {
+    return matches(code, at, a, b) && at + 2 < code.size() && isA(code[at + 2], c);
+  }
+
+  /**
+   * @brief PushNumber_OC in a pattern stands for any literal that fits
+   * in an item: numbers and inline integers.
+   */
+  inline bool Optimizer::isA(const Operation &op, Opcode a) const {
+    if (a == PushNumber_OC && op.opcode == PushInteger_OC) {
+      return Item::fitsInline(op.operand.integer);
+    }
+
+    return op.opcode == a;
+  }
+
+  /**
+   * @brief the superinstruction 'fused' for the number literal 'op'
+   */
+  inline Operation Optimizer::withLiteral(const Operation &op, Opcode fused) const {
+    Operation result(fused);
+    result.operand.literal = op.opcode == PushInteger_OC ?
+          Item::integer(op.operand.integer).bits :
+          Item(op.operand.number).bits;
+    return result;
+  }
+
+  /**
+   * @brief true if there is an operation at index 'at' that can be fused
+   * with a preceding number literal.
+   */
+  inline bool Optimizer::isArithmetic(const std::vector<Operation> &code, unsigned int at) const {
+    if (at >= code.size()) {
+      return false;
+    }
+
+    switch (code[at].opcode) {
+    case Plus_OC:
+    case Minus_OC:
+    case Mul_OC:
+    case Div_OC:
+    case Gt_OC:
+    case Lt_OC:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  inline void Optimizer::fired(const char *fusion) {
+    fusions[fusion]++;
+  }
+
+  inline bool Optimizer::isLiteral(const Block *block, const Operation &op) const {
+    switch (op.opcode) {
+    case PushNumber_OC:
+    case PushInteger_OC:
+    case PushBoolean_OC:
+      return true;
+    case Push_OC:
+      return block->constants[op.operand.constant]->type == String_T;
+    default:
+      return false;
+    }
+  }
+
+  inline bool Optimizer::isBlock(const Block *block, const Operation &op) const {
+    return op.opcode == Push_OC && block->constants[op.operand.constant]->type == Block_T;
+  }
+
+  inline Block *Optimizer::constantBlock(const Block *block, const Operation &op) const {
+    return static_cast<Block *>(block->constants[op.operand.constant]);
+  }
+
+  /**
+   * @brief append the operations of 'taken' to code, which is the new code of
+   * 'block' under construction.
+   */
+  inline void Optimizer::splice(Block *block, std::vector<Operation> &code, const Block *taken) {
+    if (!taken) {
+      return;
+    }
+
+    // append() works on the operations of the block itself
+    block->value.swap(code);
+    block->append(taken);
+    block->value.swap(code);
+  }
+
+  inline ExternalFunction Optimizer::pureDefinition(const Block *block, const Operation &op) const {
+    if (op.opcode != Call_OC || !pureDefinitions) {
+      return 0;
+    }
+
+    unsigned int symbol = block->callSites[op.operand.site].symbol;
+    return symbol < pureDefinitions->size() ? (*pureDefinitions)[symbol] : 0;
+  }
+
+  /**
+   * @brief try to evaluate an operation on the literals at the end of code.
+   * The literals are pushed on a scratch environment, on top of two marker
+   * blocks. The result is only used if no error was raised, the markers are
+   * untouched (the operation didn't reach below the literals) and everything
+   * above them can be written as a literal again.
+   * @return true if the literals in code were replaced by the result.
+   */
+  inline bool Optimizer::evaluate(Block *block, std::vector<Operation> &code, const Operation &op) {
+    ExternalFunction pure = pureDefinition(block, op);
+    switch (op.opcode) {
+    case Plus_OC:
+    case Minus_OC:
+    case Mul_OC:
+    case Div_OC:
+    case Equals_OC:
+    case Gt_OC:
+    case Lt_OC:
+    case Dup_OC:
+    case Swap_OC:
+      break;
+    default:
+      if (!pure) {
+        return false;
+      }
+    }
+
+    unsigned int operands = 0;
+    while (operands < code.size() && operands < MAX_FOLD_OPERANDS &&
+           isLiteral(block, code[code.size() - 1 - operands])) {
+      operands++;
+    }
+
+    if (operands == 0) {
+      return false;
+    }
+
+    Fallible errors;
+    Environment scratch(&errors, 0);
+    // The stack gets it's own references, so the markers outlive it
+    Block *markers[2] = { new Block(), new Block() };
+    scratch.push(markers[0]->retain());
+    scratch.push(markers[1]->retain());
+
+    for (unsigned int i = code.size() - operands; i < code.size(); i++) {
+      const Operation &literal = code[i];
+      if (literal.opcode == PushNumber_OC) {
+        scratch.push(literal.operand.number);
+      } else if (literal.opcode == PushInteger_OC) {
+        scratch.push(literal.operand.integer);
+      } else if (literal.opcode == PushBoolean_OC) {
+        scratch.push(literal.operand.boolean);
+      } else {
+        scratch.push(block->constants[literal.operand.constant]->retain());
+      }
+    }
+
+    // Same semantics as the corresponding handlers in VM::run
+    switch (op.opcode) {
+    case Plus_OC:
+      if (scratch.expect(Number_T, Number_T)) {
+        scratch.directAdd();
+      }
+      break;
+    case Minus_OC:
+      if (scratch.expect(Number_T, Number_T)) {
+        scratch.directSub();
+      }
+      break;
+    case Mul_OC:
+      if (scratch.expect(Number_T, Number_T)) {
+        scratch.directMul();
+      }
+      break;
+    case Div_OC:
+      if (scratch.expect(Number_T, Number_T)) {
+        scratch.directDiv();
+      }
+      break;
+    case Equals_OC:
+      if (scratch.expectTwoEqual()) {
+        scratch.directEquals();
+      }
+      break;
+    case Gt_OC:
+      if (scratch.expect(Number_T, Number_T)) {
+        scratch.directGt();
+      }
+      break;
+    case Lt_OC:
+      if (scratch.expect(Number_T, Number_T)) {
+        scratch.directLt();
+      }
+      break;
+    case Dup_OC:
+      if (scratch.expectNotEmpty()) {
+        scratch.directDup();
+      }
+      break;
+    case Swap_OC:
+      if (scratch.expectAtLeast(2)) {
+        scratch.directSwap();
+      }
+      break;
+    default:
+      pure(&scratch);
+      break;
+    }
+
+    // Collect the results (topmost first), leaving the scratch stack empty
+    std::vector<Type *> results;
+    while (!scratch.empty()) {
+      results.push_back(scratch.popRaw());
+    }
+
+    bool folded = !errors.runtimeErrorOccured && results.size() >= 2 &&
+        results[results.size() - 1] == markers[0] &&
+        results[results.size() - 2] == markers[1];
+
+    for (unsigned int i = 0; folded && i < results.size() - 2; i++) {
+      DataType t = results[i]->type;
+      folded = t == Number_T || t == Integer_T || t == Boolean_T || t == String_T;
+    }
+
+    if (folded) {
+      code.erase(code.end() - operands, code.end());
+      for (unsigned int i = results.size() - 2; i > 0; i--) {
+        Type *t = results[i - 1];
+        if (t->type == Number_T) {
+          Operation literal(PushNumber_OC);
+          literal.operand.number = static_cast<Number *>(t)->value;
+          code.push_back(literal);
+        } else if (t->type == Integer_T) {
+          Operation literal(PushInteger_OC);
+          literal.operand.integer = static_cast<Integer *>(t)->value;
+          code.push_back(literal);
+        } else if (t->type == Boolean_T) {
+          Operation literal(PushBoolean_OC);
+          literal.operand.boolean = static_cast<Boolean *>(t)->value;
+          code.push_back(literal);
+        } else {
+          Operation literal(Push_OC);
+          literal.operand.constant = block->constants.size();
+          block->constants.push_back(StringTable::global().intern(static_cast<String *>(t)->str()));
+          code.push_back(literal);
+        }
+      }
+    }
+
+    for (unsigned int i = 0; i < results.size(); i++) {
+      results[i]->release();
+    }
+
+    markers[0]->release();
+    markers[1]->release();
+    return folded;
+  }
+
+  /**
+   * @brief constant folding and dead code elimination for a single block.
+   */
+  inline void Optimizer::fold(Block *block) {
+    std::vector<Operation> code;
+    code.swap(block->value);
+
+    std::vector<Operation> folded;
+    folded.reserve(code.size());
+
+    for (unsigned int i = 0; i < code.size(); i++) {
+      const Operation &op = code[i];
+      unsigned int n = folded.size();
+
+      // Literal followed by drop
+      if (op.opcode == Drop_OC && n >= 1 && isLiteral(block, folded[n - 1])) {
+        folded.pop_back();
+        fired("PushDrop");
+        continue;
+      }
+
+      // Literal condition, the taken branch (if any) is spliced in
+      if (op.opcode == If_OC && n >= 2 &&
+          folded[n - 2].opcode == PushBoolean_OC &&
+          isBlock(block, folded[n - 1])) {
+        Block *taken = folded[n - 2].operand.boolean ? constantBlock(block, folded[n - 1]) : 0;
+        folded.erase(folded.end() - 2, folded.end());
+        splice(block, folded, taken);
+        fired("DeadBranch");
+        continue;
+      }
+
+      if (op.opcode == IfElse_OC && n >= 3 &&
+          folded[n - 3].opcode == PushBoolean_OC &&
+          isBlock(block, folded[n - 2]) && isBlock(block, folded[n - 1])) {
+        Block *taken = constantBlock(block, folded[n - 3].operand.boolean ? folded[n - 2] : folded[n - 1]);
+        folded.erase(folded.end() - 3, folded.end());
+        splice(block, folded, taken);
+        fired("DeadBranch");
+        continue;
+      }
+
+      if (evaluate(block, folded, op)) {
+        fired("ConstantFold");
+        continue;
+      }
+
+      folded.push_back(op);
+    }
+
+    block->value.swap(folded);
+  }
+
+  /**
+   * @brief rewrite the operations of a single block.
+   * Matching is greedy from left to right. Call sites and constants are not
+   * touched, so their indices stay valid.
+   */
+  inline void Optimizer::fuse(Block *block) {
+    std::vector<Operation> &code = block->value;
+    std::vector<Operation> fused;
+    fused.reserve(code.size());
+
+    unsigned int i = 0;
+    while (i < code.size()) {
+      Operation op = code[i];
+
+      if (matches(code, i, PushNumber_OC, Minus_OC, Dup_OC)) {
+        op = withLiteral(code[i], PushSubDup_OC);
+        fired("PushSubDup");
+        i += 3;
+      } else if (matches(code, i, Dup_OC, PushNumber_OC, Gt_OC)) {
+        op = withLiteral(code[i + 1], DupPushGt_OC);
+        fired("DupPushGt");
+        i += 3;
+      } else if (matches(code, i, Dup_OC, PushNumber_OC, Lt_OC)) {
+        op = withLiteral(code[i + 1], DupPushLt_OC);
+        fired("DupPushLt");
+        i += 3;
+      } else if (matches(code, i, PushNumber_OC, Minus_OC)) {
+        op = withLiteral(code[i], PushSub_OC);
+        fired("PushSub");
+        i += 2;
+      } else if (matches(code, i, PushNumber_OC, Plus_OC)) {
+        op = withLiteral(code[i], PushAdd_OC);
+        fired("PushAdd");
+        i += 2;
+      } else if (matches(code, i, PushNumber_OC, Mul_OC)) {
+        op = withLiteral(code[i], PushMul_OC);
+        fired("PushMul");
+        i += 2;
+      } else if (matches(code, i, PushNumber_OC, Div_OC)) {
+        op = withLiteral(code[i], PushDiv_OC);
+        fired("PushDiv");
+        i += 2;
+      } else if (matches(code, i, PushNumber_OC, Gt_OC)) {
+        op = withLiteral(code[i], PushGt_OC);
+        fired("PushGt");
+        i += 2;
+      } else if (matches(code, i, PushNumber_OC, Lt_OC)) {
+        op = withLiteral(code[i], PushLt_OC);
+        fired("PushLt");
+        i += 2;
+      } else if (matches(code, i, Dup_OC, PushNumber_OC) &&
+                 !isArithmetic(code, i + 2)) {
+        // dup N + and the like are better served by PushAdd etc.
+        op = withLiteral(code[i + 1], DupPush_OC);
+        fired("DupPush");
+        i += 2;
+      } else if (matches(code, i, Swap_OC, Plus_OC)) {
+        op.opcode = SwapPlus_OC;
+        fired("SwapPlus");
+        i += 2;
+      } else {
+        i++;
+      }
+
+      fused.push_back(op);
+    }
+
+    code.swap(fused);
+  }
+}
+
+#endif // OPTIMIZER_H
@@ -0,0 +1,419 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PebbleScript.h"
+
+namespace PS {
+  /**
+   * @brief The threads that help ParallelRange. They are started with the
+   * first range and shared by all ranges of the process, also by ranges
+   * that run at the same time on different threads.
+   *
+   * The helping is optional: the caller does a share of the work itself, so
+   * a range finishes even if all helpers are busy with other ranges. Tasks
+   * that no helper has started when the caller is done are dropped.
+   */
+  class HelperThreads {
+  public:
+    typedef std::function<void ()> Task;
+
+    static HelperThreads &global();
+    ~HelperThreads();
+
+    unsigned int size() const;
+    void run(const std::vector<Task> &tasks, const Task &own);
+
+  private:
+    HelperThreads();
+    HelperThreads(const HelperThreads &);
+    HelperThreads &operator=(const HelperThreads &);
+
+    // The tasks of one call to run
+    struct Group {
+      unsigned int running;
+    };
+
+    void help();
+
+    std::vector<std::thread> threads;
+    std::deque<std::pair<Group *, Task> > queue;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    bool stopping;
+  };
+
+  inline HelperThreads &HelperThreads::global() {
+    static HelperThreads helpers;
+    return helpers;
+  }
+
+  /**
+   * @brief one thread less than there are cores, the caller is busy too
+   */
+  inline HelperThreads::HelperThreads() : stopping(false) {
+    unsigned int count = std::thread::hardware_concurrency();
+    for (unsigned int i = 1; i < count; i++) {
+      threads.push_back(std::thread(&HelperThreads::help, this));
+    }
+  }
+
+  inline HelperThreads::~HelperThreads() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_all();
+
+    for (unsigned int i = 0; i < threads.size(); i++) {
+      threads[i].join();
+    }
+  }
+
+  inline unsigned int HelperThreads::size() const {
+    return threads.size();
+  }
+
+  /**
+   * @brief queue 'tasks' for the helpers and run 'own' on this thread.
+   * Returns when 'own' and all tasks that were started have finished.
+   */
+  inline void HelperThreads::run(const std::vector<Task> &tasks, const Task &own) {
+    Group group;
+    group.running = 0;
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (unsigned int i = 0; i < tasks.size(); i++) {
+        queue.push_back(std::make_pair(&group, tasks[i]));
+      }
+    }
+    wake.notify_all();
+
+    own();
+
+    std::unique_lock<std::mutex> guard(lock);
+    std::deque<std::pair<Group *, Task> >::iterator iter = queue.begin();
+    while (iter != queue.end()) {
+      iter = iter->first == &group ? queue.erase(iter) : iter + 1;
+    }
+
+    while (group.running > 0) {
+      finished.wait(guard);
+    }
+  }
+
+  inline void HelperThreads::help() {
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (true) {
+      if (queue.empty()) {
+        if (stopping) {
+          return;
+        }
+
+        wake.wait(guard);
+        continue;
+      }
+
+      Group *group = queue.front().first;
+      Task task = queue.front().second;
+      queue.pop_front();
+      group->running++;
+
+      guard.unlock();
+      task();
+      guard.lock();
+
+      if (--group->running == 0) {
+        finished.notify_all();
+      }
+    }
+  }
+
+  /**
+   * @brief Runs a block for every index of a range on several threads.
+   *
+   * The block and the words it calls are copied into one frozen program that
+   * all workers share. Every worker has it's own VM (and so it's own stack),
+   * kept by the calling VM for the next range (see VM::getWorker): only pure
+   * native functions can be called, anything else (like def) is reported as
+   * an error. The workers run on the caller and on the HelperThreads.
+   *
+   * The range is cut into chunks that only depend on it's length. Results are
+   * kept per chunk and merged in chunk order, so they don't depend on the
+   * number of threads or on timing.
+   */
+  class ParallelRange {
+  public:
+    ParallelRange(VM *vm, long lo, long hi);
+    ~ParallelRange();
+
+    bool map(Block *body);
+    bool reduce(Block *body, Block *combine);
+
+    /**
+     * @brief the values of every chunk, in chunk order. For map these are
+     * the values of the indices, for reduce one partial result per chunk.
+     * They belong to the caller after a successful run.
+     */
+    std::vector<Type *> &getResults();
+    const std::string &getError() const;
+
+  private:
+    Block *snapshot(Block *block);
+    void collect(Block *block, std::map<unsigned int, Block *> &words);
+    bool start(Block *body, Block *combine);
+    void work(VM *worker);
+    void runChunk(VM *worker, unsigned int chunk);
+    bool call(VM *worker, Block *block, unsigned int expected, std::string &error);
+    void clear(Environment *env);
+
+    static const unsigned int MAX_CHUNKS = 64;
+
+    VM *vm;
+    long lo;
+    long hi;
+    unsigned int chunks;
+
+    // The copies of the blocks, owned by 'program'
+    Program *program;
+    Block *body;
+    Block *combine;
+    std::map<unsigned int, Block *> words;
+
+    std::atomic<unsigned int> nextChunk;
+    std::vector<std::vector<Type *> > chunkResults;
+    std::vector<std::string> chunkErrors;
+
+    std::vector<Type *> results;
+    std::string error;
+  };
+
+  inline ParallelRange::ParallelRange(VM *vm, long lo, long hi)
+    : vm(vm), lo(lo), hi(hi), program(0), body(0), combine(0), nextChunk(0) {
+    long length = hi > lo ? hi - lo : 0;
+    chunks = length < (long) MAX_CHUNKS ? (unsigned int) length : MAX_CHUNKS;
+  }
+
+  inline ParallelRange::~ParallelRange() {
+    delete program;
+  }
+
+  inline std::vector<Type *> &ParallelRange::getResults() {
+    return this->results;
+  }
+
+  inline const std::string &ParallelRange::getError() const {
+    return this->error;
+  }
+
+  /**
+   * @brief body leaves one value for every index
+   */
+  inline bool ParallelRange::map(Block *body) {
+    return start(body, 0);
+  }
+
+  /**
+   * @brief every chunk combines the values of it's indices (left to right)
+   * with combine. The caller combines the partial results.
+   */
+  inline bool ParallelRange::reduce(Block *body, Block *combine) {
+    return start(body, combine);
+  }
+
+  /**
+   * @brief copy a block and all words it calls (also indirectly).
+   * @return the copy of 'block', it belongs to 'program'
+   */
+  inline Block *ParallelRange::snapshot(Block *block) {
+    Block *copy = block->copy();
+    collect(copy, words);
+    return copy;
+  }
+
+  inline void ParallelRange::collect(Block *block, std::map<unsigned int, Block *> &words) {
+    Environment *env = vm->getEnvironment();
+
+    std::vector<CallSite>::iterator site;
+    for (site = block->callSites.begin(); site != block->callSites.end(); site++) {
+      unsigned int symbol = site->symbol;
+      if (words.count(symbol) || !env->hasDefinition(symbol)) {
+        continue;
+      }
+
+      Block *copy = env->getDefinition(symbol)->copy();
+      words[symbol] = copy;
+      collect(copy, words);
+    }
+
+    std::vector<Type *>::iterator iter;
+    for (iter = block->constants.begin(); iter != block->constants.end(); iter++) {
+      if ((*iter)->type == Block_T) {
+        collect(static_cast<Block *>(*iter), words);
+      }
+    }
+  }
+
+  inline bool ParallelRange::start(Block *body, Block *combine) {
+    if (chunks == 0) {
+      return true;
+    }
+
+    // One program owns all copies
+    Block *root = new Block();
+    this->body = snapshot(body);
+    root->constants.push_back(this->body);
+
+    if (combine) {
+      this->combine = snapshot(combine);
+      root->constants.push_back(this->combine);
+    }
+
+    std::map<unsigned int, Block *>::iterator word;
+    for (word = words.begin(); word != words.end(); ++word) {
+      root->constants.push_back(word->second);
+    }
+
+    program = new Program(root);
+
+    chunkResults.resize(chunks);
+    chunkErrors.resize(chunks);
+
+    unsigned int helpers = HelperThreads::global().size();
+    if (helpers > chunks - 1) {
+      helpers = chunks - 1;
+    }
+
+    // The calling thread is one of the workers
+    std::vector<HelperThreads::Task> tasks;
+    for (unsigned int i = 1; i <= helpers; i++) {
+      tasks.push_back(std::bind(&ParallelRange::work, this, vm->getWorker(i)));
+    }
+
+    HelperThreads::global().run(tasks, std::bind(&ParallelRange::work, this, vm->getWorker(0)));
+
+    // Report the error of the first chunk that failed
+    bool failed = false;
+    for (unsigned int c = 0; c < chunks; c++) {
+      if (!failed && !chunkErrors[c].empty()) {
+        error = chunkErrors[c];
+        failed = true;
+      }
+
+      std::vector<Type *>::iterator iter;
+      for (iter = chunkResults[c].begin(); iter != chunkResults[c].end(); ++iter) {
+        if (failed) {
+          delete *iter;
+        } else {
+          results.push_back(*iter);
+        }
+      }
+    }
+
+    if (failed) {
+      std::vector<Type *>::iterator iter;
+      for (iter = results.begin(); iter != results.end(); ++iter) {
+        delete *iter;
+      }
+      results.clear();
+    }
+
+    return !failed;
+  }
+
+  inline void ParallelRange::work(VM *worker) {
+    std::map<unsigned int, Block *>::iterator word;
+    for (word = words.begin(); word != words.end(); ++word) {
+      worker->getEnvironment()->def(SymbolTable::global().name(word->first).c_str(), word->second);
+    }
+
+    unsigned int chunk;
+    while ((chunk = nextChunk++) < chunks) {
+      runChunk(worker, chunk);
+    }
+
+    // The words refer to the program, which goes away with the range
+    worker->getEnvironment()->restoreDefinitions(std::vector<Block *>());
+  }
+
+  inline void ParallelRange::runChunk(VM *worker, unsigned int chunk) {
+    Environment *env = worker->getEnvironment();
+    long length = hi - lo;
+    long first = lo + length * chunk / chunks;
+    long last = lo + length * (chunk + 1) / chunks;
+    std::string &error = chunkErrors[chunk];
+
+    for (long i = first; i < last; i++) {
+      env->push((long long) i);
+
+      // Stack: the index (and the value so far, when reducing)
+      unsigned int expected = combine && i > first ? 2 : 1;
+      if (!call(worker, body, expected, error)) {
+        break;
+      }
+
+      if (combine && i > first && !call(worker, combine, 1, error)) {
+        break;
+      }
+    }
+
+    if (!error.empty()) {
+      clear(env);
+      return;
+    }
+
+    // Move the values out, bottom first
+    std::vector<Type *> &values = chunkResults[chunk];
+    values.resize(env->size());
+    for (unsigned int i = values.size(); i > 0; i--) {
+      // Values shared with the worker are copied
+      values[i - 1] = env->popRaw()->unshare();
+    }
+  }
+
+  /**
+   * @brief run a block on the worker.
+   * @param expected the stack size the block has to leave
+   */
+  inline bool ParallelRange::call(VM *worker, Block *block, unsigned int expected, std::string &error) {
+    Environment *env = worker->getEnvironment();
+    unsigned int base = combine ? 0 : env->size() - 1;
+
+    if (!worker->run(block)) {
+      error = worker->getError();
+      return false;
+    }
+
+    if (env->size() != base + expected) {
+      error = "A parallel block must leave exactly one value";
+      return false;
+    }
+
+    if (env->peekType() == Block_T) {
+      error = "A parallel block can't return a block";
+      return false;
+    }
+
+    return true;
+  }
+
+  inline void ParallelRange::clear(Environment *env) {
+    while (!env->empty()) {
+      env->popRaw()->release();
+    }
+  }
+}
+
+#endif // PARALLEL_H
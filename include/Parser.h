@@ -4,13 +4,15 @@
 #include <stack>
 #include <sstream>
 
-#include "Types.h"
 #include "NumericUtils.h"
+#include "Types.h"
+#include "SymbolTable.h"
+#include "StringTable.h"
 
 namespace PS {
   class Parser {
   public:
-    Parser(const char *source, Block *block);
+    Parser(const char *source, Block *block, SymbolTable *symbols);
     bool parse();
 
     std::deque<std::string> &getErrors();
@@ -30,6 +32,7 @@ namespace PS {
     void pushError(const char *msg);
     bool isPurelyNumeric(const std::string &str);
     double stringToDouble(const std::string &str);
+    bool stringToInteger(const std::string &str, long long &result);
 
     unsigned int index;
 
@@ -51,9 +54,12 @@ namespace PS {
      */
     std::stack<Block *> levels;
     std::string source;
+
+    // Words are interned into this table
+    SymbolTable *symbols;
   };
 
-  inline Parser::Parser(const char *source, Block *block) : index(0), withinString(false), source(std::string(source)) {
+  inline Parser::Parser(const char *source, Block *block, SymbolTable *symbols) : index(0), withinString(false), source(std::string(source)), symbols(symbols) {
     levels.push(block);
   }
 
@@ -72,7 +78,7 @@ namespace PS {
    * ...'
    */
   inline void Parser::endString() {
-    levels.top()->value.push_back(Operation(Push_OC, new String(currentString.str())));
+    levels.top()->emitConstant(StringTable::global().intern(currentString.str()));
   }
 
   inline void Parser::beginWord() {
@@ -88,19 +94,44 @@ namespace PS {
     std::string word = currentWord.str();
 
     if (word.compare("-") == 0) {
-      levels.top()->value.push_back(Operation(Minus_OC, 0));
+      levels.top()->emit(Minus_OC);
     } else if (word.compare("+") == 0) {
-      levels.top()->value.push_back(Operation(Plus_OC, 0));
+      levels.top()->emit(Plus_OC);
+    } else if (word.compare("*") == 0) {
+      levels.top()->emit(Mul_OC);
+    } else if (word.compare("/") == 0) {
+      levels.top()->emit(Div_OC);
+    } else if (word.compare("=") == 0) {
+      levels.top()->emit(Equals_OC);
+    } else if (word.compare(">") == 0) {
+      levels.top()->emit(Gt_OC);
+    } else if (word.compare("<") == 0) {
+      levels.top()->emit(Lt_OC);
     } else if (word.compare("dup") == 0) {
-      levels.top()->value.push_back(Operation(Dup_OC, 0));
+      levels.top()->emit(Dup_OC);
     } else if (word.compare("swap") == 0) {
-      levels.top()->value.push_back(Operation(Swap_OC, 0));
+      levels.top()->emit(Swap_OC);
+    } else if (word.compare("drop") == 0) {
+      levels.top()->emit(Drop_OC);
     } else if (word.compare("if") == 0) {
-      levels.top()->value.push_back(Operation(If_OC, 0));
+      levels.top()->emit(If_OC);
+    } else if (word.compare("ifelse") == 0) {
+      levels.top()->emit(IfElse_OC);
+    } else if (word.compare("repeat") == 0) {
+      levels.top()->emit(Repeat_OC);
+    } else if (word.compare("times") == 0) {
+      levels.top()->emit(Times_OC);
+    } else if (word.compare("while") == 0) {
+      levels.top()->emit(While_OC);
     } else if (isPurelyNumeric(word)) {
-      levels.top()->value.push_back(Operation(Push_OC, new Number(stringToDouble(word))));
+      long long integer;
+      if (stringToInteger(word, integer)) {
+        levels.top()->emitInteger(integer);
+      } else {
+        levels.top()->emitNumber(stringToDouble(word));
+      }
     } else {
-      levels.top()->value.push_back(Operation(Call_OC, new Number(Util::NumericUtils::hash(word))));
+      levels.top()->emitCall(symbols->intern(word));
     }
 
     beginWord();
@@ -127,7 +158,7 @@ namespace PS {
     levels.pop();
 
     Block *parent = levels.top();
-    parent->value.push_back(Operation(Push_OC, block));
+    parent->emitConstant(block);
 
     return true;
   }
@@ -165,6 +196,30 @@ namespace PS {
     return x;
   }
 
+  /**
+   * @brief numbers without a '.' are integers
+   * @return false if the string has a '.' or the value doesn't fit in
+   * 64 bits (it's a double then).
+   */
+  inline bool Parser::stringToInteger(const std::string& s, long long &result) {
+    std::string::const_iterator it = s.begin();
+    result = 0;
+
+    while (it != s.end()) {
+      if (*it == 46) {
+        return false;
+      }
+
+      if (Util::NumericUtils::mulOverflows(result, 10LL, &result) ||
+          Util::NumericUtils::addOverflows(result, (long long) (*it - '0'), &result)) {
+        return false;
+      }
+      it++;
+    }
+
+    return true;
+  }
+
   /**
    * @brief peek the next item on the input stream without moving the cursor.
    * @return the next char on the input stream.
@@ -5,231 +5,1790 @@
 #include "Fallible.h"
 #include "Runnable.h"
 #include "Parser.h"
+#include "Optimizer.h"
+#include "Program.h"
+#include "ContinuationStack.h"
+#include "Task.h"
 #include "NumericUtils.h"
 
 #include <iostream>
+#include <chrono>
+#include <climits>
 
-namespace PS {
-  struct Continuation {
-  public:
-    Block *block;
-    std::deque<Operation>::iterator iterator;
-  };
+/**
+ * Use direct threaded dispatch ("labels as values") where the compiler
+ * supports it. Define PS_NO_COMPUTED_GOTO to force the portable switch.
+ */
+#if defined(__GNUC__) && !defined(PS_NO_COMPUTED_GOTO)
+#define PS_COMPUTED_GOTO
+#endif
 
+namespace PS {
   /**
    * @brief The virtual machine class. Also the common entry point
    * for using pebble script.
    */
   class VM : public Fallible, public Runnable {
   public:
+    /**
+     * @brief how the last call to eval or resume ended.
+     * OutOfFuel and DeadlineExceeded leave the evaluation suspended,
+     * unless the budget ran out inside a nested run (see isSuspended).
+     * Pending means that a native function suspended the evaluation.
+     */
+    enum Status {
+      Finished,
+      Failed,
+      OutOfFuel,
+      DeadlineExceeded,
+      Pending
+    };
+
     VM ();
     ~VM ();
 
     Environment *eval(const char *source);
+    Environment *eval(const Program *program);
+    Program *compile(const char *source);
+    Environment *resume();
+    Environment *getEnvironment();
     std::string &getError();
 
+    Status getStatus() const;
+    bool isSuspended() const;
+    void cancel();
+
+    /**
+     * @brief limit the number of operations that one call to eval or
+     * resume may execute (0 means unlimited, the default).
+     */
+    void setFuel(unsigned long operations);
+    unsigned long getFuel() const;
+
+    /**
+     * @brief limit the wall-clock time of one call to eval or resume
+     * (zero means unlimited, the default).
+     */
+    void setTimeLimit(std::chrono::nanoseconds limit);
+    std::chrono::nanoseconds getTimeLimit() const;
+
     void def(const char *name, ExternalFunction def);
+    void def(const char *name, ExternalFunction def, bool pure);
+
+    /**
+     * @brief enable or disable all optimizations for subsequent calls to
+     * eval (enabled by default): constant folding and fusion (see
+     * getOptimizer to switch them one by one) and inlining.
+     */
+    void setOptimizing(bool optimizing);
+    bool isOptimizing() const;
+    Optimizer &getOptimizer();
+
+    /**
+     * @brief enable or disable inlining of hot words (enabled by default)
+     */
+    void setInlining(bool inlining);
+    bool isInlining() const;
+
+    /**
+     * @brief lists the words that were inlined so far
+     * @return one line per word in the form <word>: <number of call sites>
+     */
+    std::string getInliningReport();
+
+    /**
+     * @brief limit the number of continuation frames (nested calls, branches
+     * and loops). Exceeding it stops the run with a runtime error.
+     */
+    void setMaxDepth(unsigned int frames);
+    unsigned int getMaxDepth() const;
+
+    /**
+     * @brief the deepest the continuation stack got since the last reset
+     */
+    unsigned int getDepthHighWaterMark() const;
+    void resetDepthHighWaterMark();
+
+    /**
+     * @brief the bytes used by the tables of all maps (see Map::totalMemory)
+     */
+    size_t getMapMemory() const;
 
     bool run(Block *block);
-    void call(long hash);
+    void call(unsigned int symbol);
+
+    /**
+     * @brief true if calls to the word run a native function. Native
+     * functions take precedence over blocks of the same name.
+     */
+    bool hasNative(unsigned int symbol) const;
+    void suspend();
+
+    /**
+     * @brief the id of the channel that a suspended evaluation waits for
+     * (see chan-recv and Channels::resume), -1 if there is none. The VM
+     * forgets it as soon as the evaluation is resumed or dropped.
+     */
+    void await(long long channel);
+    long long getAwaited() const;
+
+    VM *createWorker() const;
+    VM *getWorker(unsigned int index);
+
+    /**
+     * @brief green threads. Tasks run interleaved on the thread of the VM,
+     * a task only gives up control in yield and join (see Stdlib).
+     */
+    unsigned int spawn(Block *block);
+    void yield();
+    void join(unsigned int task);
 
   private:
+    bool execute(unsigned int base, unsigned int loopBase);
+    Block *parse(const char *source);
+    void prepare();
+    Environment *start(Block *block);
+    Environment *finish(Block *block, bool finished);
+    void abandon();
+    void startBudget();
+    bool refuel();
+    bool exhausted(Status reason);
+    const char *describe(Status status) const;
+    bool pushContinuation(Block *block, unsigned int pc);
+    bool enterLoop();
+    void dropLoops(unsigned int size);
+    void resolve(CallSite &site);
+    CallSite *resolveFrozen(const Block *block, unsigned int index);
+    bool inlineCall(Block *caller, unsigned int at);
+    void moveFrames(ContinuationStack *frames, Block *block, unsigned int at, unsigned int length);
+    void raiseLookupError(unsigned int symbol);
+    void raiseOverflowError();
+    void switchTo(unsigned int task);
+    bool switchTask();
+    bool finishTask();
+    void endTasks();
+
     Environment *env;
-    std::stack<Continuation> *continuationStack;
+    ContinuationStack *continuationStack;
+    static const unsigned int RESERVED_DEPTH = 256;
+    static const unsigned int DEFAULT_MAX_DEPTH = 1 << 20;
+
+    // Loops in progress, one for each loop frame on the continuation stack
+    std::vector<Loop> loops;
+
+    Optimizer optimizer;
+    bool inlining;
+
+    /**
+     * @brief profiling for the inliner. Calls to blocks are counted per word.
+     * Once a word is called often enough, the next call sites that execute
+     * it get it's body inlined (if it is small and doesn't recurse).
+     */
+    std::vector<unsigned int> callCounts;
+    std::map<unsigned int, unsigned int> inlinedWords;
+
+    /**
+     * @brief references to the blocks that were inlined. An Inline_OC guard
+     * compares the current definition with it's inlined block, so that block
+     * must not be deleted (and it's address reused) while the guard exists.
+     */
+    std::vector<Block *> inlinedBlocks;
+
+    /**
+     * @brief call sites of frozen blocks. Frozen blocks are shared between
+     * VMs, so their call sites are never written. Each VM caches it's own
+     * resolution of them here instead, direct mapped by block and site index.
+     */
+    struct FrozenSite {
+      FrozenSite() : block(0), index(0), site(0) { }
+
+      const Block *block;
+      unsigned int index;
+      CallSite site;
+    };
+
+    std::vector<FrozenSite> frozenSites;
+    static const unsigned int FROZEN_SITES = 1024;
+    static const unsigned int INLINE_THRESHOLD = 64;
+    static const unsigned int MAX_INLINE_SIZE = 16;
+
+    // Nesting level of run (native functions can run blocks)
+    unsigned int runDepth;
+
+    /**
+     * @brief the execution budget. Operations are not counted one by one:
+     * 'slice' is charged with the length of every segment of operations
+     * when the VM enters a block (calls, branches, loop iterations and
+     * returns). Once the slice is used up, refuel accounts for it and checks
+     * the deadline, so the clock is only read every CLOCK_INTERVAL operations.
+     */
+    unsigned long fuel;
+    std::chrono::nanoseconds timeLimit;
+    long long fuelLeft;
+    std::chrono::steady_clock::time_point deadline;
+    long slice;
+    long sliceStart;
+    static const long CLOCK_INTERVAL = 4096;
+
+    Status status;
+
+    // The evaluation stopped and can be resumed
+    bool suspended;
+
+    /**
+     * @brief what a native function asked for. Checked after every call
+     * to a native function.
+     */
+    enum Request {
+      NoRequest,
+      SuspendRequest,
+      SwitchRequest
+    };
+
+    Request request;
+
+    // The budget ran out in a nested run, stop all runs
+    bool halted;
+
+    // The block of the suspended evaluation (the VM holds a reference)
+    Block *pendingBlock;
+
+    // The id of the channel the suspended evaluation waits for
+    long long awaited;
 
     /**
      * @brief pointers to (free or static) C++ functions that
      * are associated with names and can be called form inside
-     * the script.
+     * the script. Indexed by symbol.
+     */
+    std::vector<ExternalFunction> externalDefinitions;
+
+    /**
+     * @brief the subset of externalDefinitions that was declared pure.
+     * The optimizer may evaluate these at compile time.
      */
-    std::map<long, ExternalFunction> externalDefinitions;
+    std::vector<ExternalFunction> pureDefinitions;
+
+    // Only pure native functions may be called (see createWorker)
+    bool pureOnly;
+
+    // Workers kept for reuse (see getWorker)
+    std::vector<VM *> workers;
+
+    /**
+     * @brief the tasks of the current evaluation, indexed by id. The main
+     * task (id 0) is created by the first spawn. Ready tasks wait in 'ready'
+     * for their turn (round-robin).
+     */
+    std::vector<Task *> tasks;
+    std::deque<unsigned int> ready;
+    unsigned int current;
+    static const unsigned int TASK_RESERVED_DEPTH = 16;
   };
 
   inline VM::~VM() {
+    endTasks();
+    if (pendingBlock) {
+      pendingBlock->release();
+    }
     delete continuationStack;
     delete env;
+
+    for (unsigned int i = 0; i < inlinedBlocks.size(); i++) {
+      inlinedBlocks[i]->release();
+    }
+
+    for (unsigned int i = 0; i < workers.size(); i++) {
+      delete workers[i];
+    }
   }
 
-  inline VM::VM() : Fallible(), env(new Environment(this, this)), continuationStack(new std::stack<Continuation>) { }
+  inline VM::VM() : Fallible(), env(new Environment(this, this)), continuationStack(new ContinuationStack(RESERVED_DEPTH, DEFAULT_MAX_DEPTH)), optimizer(&pureDefinitions), inlining(true), runDepth(0),
+    fuel(0), timeLimit(0), fuelLeft(0), slice(LONG_MAX), sliceStart(LONG_MAX), status(Finished),
+    suspended(false), request(NoRequest), halted(false), pendingBlock(0), awaited(-1), pureOnly(false), current(0) { }
+
   inline std::string &VM::getError() {
     return this->runtimeError;
   }
 
-  inline void VM::def(const char *name, ExternalFunction def) {
-    std::string v = std::string(name);
-    long hash = Util::NumericUtils::hash(v);
-    externalDefinitions[hash] = def;
+  inline VM::Status VM::getStatus() const {
+    return this->status;
   }
 
   /**
-   * @brief evaluate expression.
-   * @param source the source code to evaluate.
-   * @return a pointer to an Environment object. The stack of the
-   * environment can be inspected in order to get the computed
-   * values (in case the script wasn't called just for it's side effect).
-   *
-   * TODO: a better eval function that can return concrete results.
+   * @brief the environment of this VM. Can be used to push the result
+   * of a pending native function before resuming.
    */
-  inline Environment *VM::eval(const char *source) {
-    this->runtimeError = std::string("");
-    this->runtimeErrorOccured = false;
+  inline Environment *VM::getEnvironment() {
+    return this->env;
+  }
 
-    Block *block = new Block();
-    Parser parser(source, block);
+  /**
+   * @brief true if the last evaluation ran out of fuel or time, or waits
+   * for a native function. It can be continued with resume.
+   */
+  inline bool VM::isSuspended() const {
+    return this->suspended;
+  }
 
-    if (parser.parse()) {
-      if (!this->run(block)) {
-        return 0;
-      } else {
-        delete block;
-        return this->env;
+  /**
+   * @brief drop a suspended evaluation, it can't be resumed afterwards.
+   * The values on the stack stay.
+   */
+  inline void VM::cancel() {
+    if (suspended) {
+      abandon();
+    }
+  }
+
+  inline void VM::setFuel(unsigned long operations) {
+    this->fuel = operations;
+  }
+
+  inline unsigned long VM::getFuel() const {
+    return this->fuel;
+  }
+
+  inline void VM::setTimeLimit(std::chrono::nanoseconds limit) {
+    this->timeLimit = limit;
+  }
+
+  inline std::chrono::nanoseconds VM::getTimeLimit() const {
+    return this->timeLimit;
+  }
+
+  /**
+   * @brief start a new budget for a call to eval or resume
+   */
+  inline void VM::startBudget() {
+    fuelLeft = fuel;
+    deadline = std::chrono::steady_clock::now() + timeLimit;
+    halted = false;
+    slice = sliceStart = 0;
+    refuel();
+  }
+
+  /**
+   * @brief account for the used slice and start the next one.
+   * @return false if the fuel is used up or the deadline has passed
+   */
+  inline bool VM::refuel() {
+    long size = LONG_MAX;
+
+    if (fuel) {
+      fuelLeft -= sliceStart - slice;
+      if (fuelLeft <= 0) {
+        return exhausted(OutOfFuel);
+      }
+
+      if (fuelLeft < size) {
+        size = (long) fuelLeft;
+      }
+    }
+
+    if (timeLimit.count()) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return exhausted(DeadlineExceeded);
+      }
+
+      if (size > CLOCK_INTERVAL) {
+        size = CLOCK_INTERVAL;
       }
-    } else {
-      this->runtimeError = parser.getErrors().front();
-      delete block;
-      return 0;
     }
+
+    slice = sliceStart = size;
+    return true;
   }
 
   /**
-   * @brief execute a block
-   * @param block pointer to the block to execute
+   * @brief the budget is used up. The slice stays empty, so that every
+   * run that is still active stops at it's next check.
    */
-  inline bool VM::run(Block *block) {
-    Continuation c;
-    c.block = block;
-    c.iterator = block->value.begin();
+  inline bool VM::exhausted(Status reason) {
+    status = reason;
+    slice = sliceStart = 0;
+    return false;
+  }
 
-    continuationStack->push(c);
+  inline const char *VM::describe(Status status) const {
+    switch (status) {
+    case OutOfFuel:
+      return "Out of fuel";
+    case DeadlineExceeded:
+      return "Deadline exceeded";
+    case Pending:
+      return "Waiting for a native function";
+    default:
+      return "";
+    }
+  }
 
-tc_startover:
+  /**
+   * @brief a VM to run pure code on another thread. It knows the native
+   * functions of this VM, but calling one that is not pure fails. It's
+   * dictionary is empty.
+   */
+  inline VM *VM::createWorker() const {
+    VM *worker = new VM();
+    worker->externalDefinitions = externalDefinitions;
+    worker->pureDefinitions = pureDefinitions;
+    worker->optimizer.setFolding(optimizer.isFolding());
+    worker->optimizer.setFusing(optimizer.isFusing());
+    worker->inlining = inlining;
+    worker->pureOnly = true;
+    return worker;
+  }
 
-    Continuation continuation = continuationStack->top(); continuationStack->pop();
-    block = continuation.block;
-    std::deque<Operation>::iterator iterator = continuation.iterator;
+  /**
+   * @brief a worker (see createWorker) that this VM keeps, so that repeated
+   * parallel runs don't create new VMs. It learns the native functions
+   * defined since it was created. Words and values left by the last user
+   * stay, the user has to clean up.
+   */
+  inline VM *VM::getWorker(unsigned int index) {
+    while (workers.size() <= index) {
+      workers.push_back(createWorker());
+    }
 
-tc_optimized:
+    VM *worker = workers[index];
+    if (worker->externalDefinitions != externalDefinitions || worker->pureDefinitions != pureDefinitions) {
+      worker->externalDefinitions = externalDefinitions;
+      worker->pureDefinitions = pureDefinitions;
+      worker->env->bumpEpoch();
+    }
 
-    for (; iterator != block->value.end(); ++iterator) {
-      Operation op = *iterator;
+    worker->optimizer.setFolding(optimizer.isFolding());
+    worker->optimizer.setFusing(optimizer.isFusing());
+    worker->inlining = inlining;
+    worker->runtimeErrorOccured = false;
+    return worker;
+  }
 
-      // Seems to be a little faster than a switch statement
+  /**
+   * @brief suspend the evaluation after the running native function
+   * returns. Only possible in the outermost run.
+   */
+  inline void VM::suspend() {
+    request = SuspendRequest;
+  }
 
-      if (op.opcode == Push_OC) {
-        this->env->push(op.value);
-        continue;
-      }
+  inline void VM::await(long long channel) {
+    awaited = channel;
+  }
 
-      if (op.opcode == Call_OC) {
-        Number *n = static_cast<Number *>(op.value);
-        long hash = (long) n->value;
+  inline long long VM::getAwaited() const {
+    return suspended ? awaited : -1;
+  }
 
-        if (externalDefinitions.find(hash) != externalDefinitions.end()) {
+  /**
+   * @brief start a new task that runs 'block' with an empty stack. The
+   * task takes over the reference of the caller.
+   * @return the id of the task
+   */
+  inline unsigned int VM::spawn(Block *block) {
+    if (tasks.empty()) {
+      // The running code becomes the main task
+      tasks.push_back(new Task(0));
+      current = 0;
+    }
 
-          ExternalFunction def = externalDefinitions[hash];
-          def(env);
-          continue;
-        } else if (env->hasDefinition(hash)) {
-          // Tail call?
-          if (&*iterator == &block->value.back()) {
-            block = env->getDefinition(hash);
-            iterator = block->value.begin();
-            goto tc_optimized;
-          } else {
-            Continuation _c;
-            _c.block = block;
-            _c.iterator = ++iterator;
-            continuationStack->push(_c);
-            block = env->getDefinition(hash);
-            iterator = block->value.begin();
-            goto tc_optimized;
-          }
-        } else {
-          std::ostringstream ss;
-          ss << "Failed to look up the word '";
-          ss << hash;
-          ss << "'";
-          runtimeError = ss.str();
-          raise(ss.str().c_str());
-          break;
-        }
-      }
-
-      if (op.opcode == If_OC) {
-        if (env->expect(Boolean_T, Block_T)) {
-          Block *b = env->popBlock();
-          if (env->pop<bool>()) {
-            block = b;
-            iterator = block->value.begin();
-            goto tc_optimized;
-          }
-        }
-        continue;
-      }
+    ContinuationStack *frames = new ContinuationStack(TASK_RESERVED_DEPTH, continuationStack->getLimit());
+    frames->push(block, 0);
 
-      if (op.opcode == Minus_OC) {
-        if (env->expect(Number_T, Number_T)) {
-          env->directSub(env->pop<double>());
-        }
-        continue;
-      }
+    unsigned int id = tasks.size();
+    tasks.push_back(new Task(frames));
+    ready.push_back(id);
+    return id;
+  }
 
-      if (op.opcode == Plus_OC) {
-        if (env->expect(Number_T, Number_T)) {
-          env->directAdd(env->pop<double>());
-        }
-        continue;
-      }
+  /**
+   * @brief let the next ready task run, after the calling native function
+   * returns.
+   */
+  inline void VM::yield() {
+    if (!ready.empty()) {
+      request = SwitchRequest;
+    }
+  }
 
-      if (op.opcode == Dup_OC) {
-        if (env->expectNotEmpty()) {
-          env->directDup();
-        }
-        continue;
+  /**
+   * @brief wait for a task to finish, then push copies of the values
+   * it left on it's stack.
+   */
+  inline void VM::join(unsigned int task) {
+    if (task >= tasks.size() || task == current) {
+      raise("Can't join this task");
+      return;
+    }
+
+    if (tasks[task]->state == Task::Done) {
+      env->pushCopies(tasks[task]->stack);
+      return;
+    }
+
+    tasks[current]->state = Task::Joining;
+    tasks[current]->joining = task;
+    request = SwitchRequest;
+  }
+
+  /**
+   * @brief exchange the state of the running task with that of another.
+   */
+  inline void VM::switchTo(unsigned int task) {
+    Task *from = tasks[current];
+    Task *to = tasks[task];
+
+    env->exchange(from->stack);
+    env->exchange(to->stack);
+    std::swap(continuationStack, from->frames);
+    std::swap(continuationStack, to->frames);
+    loops.swap(from->loops);
+    loops.swap(to->loops);
+
+    current = task;
+  }
+
+  /**
+   * @brief switch to the next ready task. A running task that is still
+   * ready goes to the end of the queue.
+   * @return false if no task can run
+   */
+  inline bool VM::switchTask() {
+    if (tasks[current]->state == Task::Ready) {
+      ready.push_back(current);
+    }
+
+    if (ready.empty()) {
+      raise("Deadlock: all tasks are waiting");
+      return false;
+    }
+
+    unsigned int next = ready.front();
+    ready.pop_front();
+    switchTo(next);
+    return true;
+  }
+
+  /**
+   * @brief the running task has no more frames. Wakes up the tasks that
+   * wait for it.
+   * @return true if another task runs now, false if all tasks are done
+   */
+  inline bool VM::finishTask() {
+    // It's values are still in the VM
+    Task *done = tasks[current];
+    done->state = Task::Done;
+
+    for (unsigned int i = 0; i < tasks.size(); i++) {
+      Task *t = tasks[i];
+      if (t->state == Task::Joining && t->joining == current) {
+        t->state = Task::Ready;
+        t->stack.pushCopies(*env);
+        ready.push_back(i);
       }
+    }
 
-      if (op.opcode == Swap_OC) {
-        if (env->expectAtLeast(2)) {
-          env->directSwap();
-        }
-        continue;
+    if (!ready.empty()) {
+      return switchTask();
+    }
+
+    for (unsigned int i = 0; i < tasks.size(); i++) {
+      if (tasks[i]->state != Task::Done) {
+        raise("Deadlock: all tasks are waiting");
+        return false;
       }
+    }
 
-      std::ostringstream ss;
-      ss << "Unkown Opcode '";
-      ss << op.opcode;
-      ss << "'";
-      runtimeError = ss.str();
-      raise(ss.str().c_str());
-      break;
+    return false;
+  }
+
+  /**
+   * @brief delete all tasks. The main task continues in the VM.
+   */
+  inline void VM::endTasks() {
+    if (tasks.empty()) {
+      return;
     }
 
-    if (continuationStack->size() > 0) {
-      goto tc_startover;
+    if (current != 0) {
+      switchTo(0);
     }
 
-    return !runtimeErrorOccured;
+    // Frames of a main task that waited for a join
+    continuationStack->truncate(0);
+    dropLoops(0);
+
+    for (unsigned int i = 0; i < tasks.size(); i++) {
+      delete tasks[i];
+    }
+
+    tasks.clear();
+    ready.clear();
+    current = 0;
   }
 
   /**
-   * @brief call a function. This can be an externally defined
-   * C++ function or a block referenced in the dictionary.
-   * @param v the stack item which represents the word to call
+   * @brief drop a suspended evaluation
    */
-  inline void VM::call(long hash) {
-    if (externalDefinitions.find(hash) != externalDefinitions.end()) {
-      ExternalFunction def = externalDefinitions[hash];
-      def(env);
-    } else if (env->hasDefinition(hash)) {
-      Block *definition = env->getDefinition(hash);
-      run(definition);
-    } else {
-      std::ostringstream ss;
-      ss << "Failed to look up the word '";
-      ss << hash;
-      ss << "'";
-      runtimeError = ss.str();
-      raise(ss.str().c_str());
+  inline void VM::abandon() {
+    endTasks();
+    continuationStack->truncate(0);
+    dropLoops(0);
+    pendingBlock->release();
+    pendingBlock = 0;
+    awaited = -1;
+    suspended = false;
+  }
+
+  inline void VM::def(const char *name, ExternalFunction def) {
+    this->def(name, def, false);
+  }
+
+  /**
+   * @brief bind a native function.
+   * @param pure true if the function only depends on the values it pops
+   * and has no side effects. Calls to pure functions with constant arguments
+   * are evaluated at compile time by the optimizer.
+   */
+  inline void VM::def(const char *name, ExternalFunction def, bool pure) {
+    unsigned int symbol = env->getSymbols().intern(name);
+    if (symbol >= externalDefinitions.size()) {
+      externalDefinitions.resize(symbol + 1, 0);
+      pureDefinitions.resize(symbol + 1, 0);
+    }
+
+    externalDefinitions[symbol] = def;
+    pureDefinitions[symbol] = pure ? def : 0;
+    env->bumpEpoch();
+  }
+
+  inline void VM::setOptimizing(bool optimizing) {
+    optimizer.setFolding(optimizing);
+    optimizer.setFusing(optimizing);
+    this->inlining = optimizing;
+  }
+
+  /**
+   * @brief true if any optimization is enabled
+   */
+  inline bool VM::isOptimizing() const {
+    return optimizer.isFolding() || optimizer.isFusing() || inlining;
+  }
+
+  inline void VM::setInlining(bool inlining) {
+    this->inlining = inlining;
+  }
+
+  inline bool VM::isInlining() const {
+    return this->inlining;
+  }
+
+  /**
+   * @brief the optimizer of this VM. It's report lists the
+   * fusions that fired in all scripts evaluated so far.
+   */
+  inline Optimizer &VM::getOptimizer() {
+    return this->optimizer;
+  }
+
+  inline bool VM::hasNative(unsigned int symbol) const {
+    return symbol < externalDefinitions.size() && externalDefinitions[symbol] &&
+        (!pureOnly || pureDefinitions[symbol]);
+  }
+
+  /**
+   * @brief look up the definition of a call site and cache it
+   * until the dictionary changes.
+   * @param site the call site to resolve
+   */
+  inline void VM::resolve(CallSite &site) {
+    if (site.symbol < externalDefinitions.size() && externalDefinitions[site.symbol] &&
+        (!pureOnly || pureDefinitions[site.symbol])) {
+      site.external = externalDefinitions[site.symbol];
+      site.target = 0;
+    } else {
+      site.external = 0;
+      site.target = env->hasDefinition(site.symbol) ? env->getDefinition(site.symbol) : 0;
+    }
+
+    if (site.symbol >= callCounts.size()) {
+      callCounts.resize(env->getSymbols().size(), 0);
+    }
+
+    site.noInline = false;
+    site.epoch = env->getEpoch();
+  }
+
+  /**
+   * @brief the cached resolution of a call site of a frozen block.
+   * An entry is only taken if it belongs to the same block and site and
+   * still describes the same call (the block may be gone and another one
+   * may have taken it's address).
+   * @param block the frozen block that contains the call
+   * @param index the index of the call site in the block
+   */
+  inline CallSite *VM::resolveFrozen(const Block *block, unsigned int index) {
+    if (frozenSites.empty()) {
+      frozenSites.resize(FROZEN_SITES);
+    }
+
+    const CallSite &shared = block->callSites[index];
+    size_t slot = ((reinterpret_cast<size_t>(block) >> 4) * 31 + index) & (FROZEN_SITES - 1);
+    FrozenSite &entry = frozenSites[slot];
+
+    if (entry.block != block || entry.index != index || entry.site.symbol != shared.symbol ||
+        entry.site.inlined != shared.inlined || entry.site.length != shared.length) {
+      entry.block = block;
+      entry.index = index;
+      entry.site = shared;
+      entry.site.epoch = 0;
+    }
+
+    if (entry.site.epoch != env->getEpoch()) {
+      resolve(entry.site);
+    }
+
+    return &entry.site;
+  }
+
+  /**
+   * @brief replace a call with the body of the called block.
+   * The call becomes an Inline_OC guard, followed by a copy of the operations
+   * of the block. The guard checks that the word still refers to the same
+   * block. If the word was redefined, the guard calls the new definition and
+   * skips the inlined copy.
+   *
+   * Only done for small words that don't call themselves (directly or from
+   * a nested block) and if the run is not nested (no native function holds
+   * on to the operations of the caller). Continuations into the caller are
+   * moved, also those of paused tasks.
+   * @param caller the block that contains the call
+   * @param at the index of the Call_OC operation
+   * @return true if the call was inlined
+   */
+  inline bool VM::inlineCall(Block *caller, unsigned int at) {
+    unsigned int symbol = caller->callSites[caller->value[at].operand.site].symbol;
+    CallSite &site = caller->callSites[caller->value[at].operand.site];
+    Block *callee = site.target;
+
+    bool inlinable =
+        callee != caller &&
+        callee->value.size() <= MAX_INLINE_SIZE &&
+        !callee->calls(symbol);
+
+    if (!inlinable) {
+      site.noInline = true;
+      return false;
+    }
+
+    unsigned int length = callee->value.size();
+    site.inlined = callee;
+    site.length = length;
+    inlinedBlocks.push_back(static_cast<Block *>(callee->retain()));
+
+    // Invalidates 'site'
+    caller->value[at].opcode = Inline_OC;
+    caller->insert(at + 1, callee);
+
+    moveFrames(continuationStack, caller, at, length);
+
+    // Paused green threads may continue in the caller as well
+    for (unsigned int i = 0; i < tasks.size(); i++) {
+      if (i != current) {
+        moveFrames(tasks[i]->frames, caller, at, length);
+      }
+    }
+
+    inlinedWords[symbol]++;
+    return true;
+  }
+
+  /**
+   * @brief continue after the operations that were inserted into 'block'
+   * behind 'at'.
+   */
+  inline void VM::moveFrames(ContinuationStack *frames, Block *block, unsigned int at, unsigned int length) {
+    Continuation *frame;
+    for (frame = frames->begin(); frame != frames->end(); frame++) {
+      if (frame->block == block && frame->pc > at) {
+        frame->pc += length;
+      }
+    }
+  }
+
+  inline std::string VM::getInliningReport() {
+    std::ostringstream ss;
+    std::map<unsigned int, unsigned int>::iterator iter;
+    for (iter = inlinedWords.begin(); iter != inlinedWords.end(); ++iter) {
+      ss << env->getSymbols().name(iter->first) << ": " << iter->second << std::endl;
+    }
+    return ss.str();
+  }
+
+  inline void VM::setMaxDepth(unsigned int frames) {
+    continuationStack->setLimit(frames);
+  }
+
+  inline unsigned int VM::getMaxDepth() const {
+    return continuationStack->getLimit();
+  }
+
+  inline unsigned int VM::getDepthHighWaterMark() const {
+    return continuationStack->getHighWaterMark();
+  }
+
+  inline size_t VM::getMapMemory() const {
+    return Map::totalMemory();
+  }
+
+  inline void VM::resetDepthHighWaterMark() {
+    continuationStack->resetHighWaterMark();
+  }
+
+  /**
+   * @return false (and raises an error) if the maximum depth is reached
+   */
+  inline bool VM::pushContinuation(Block *block, unsigned int pc) {
+    if (!continuationStack->push(block, pc)) {
+      raiseOverflowError();
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief start the innermost loop. The loop is driven from the continuation
+   * stack: every time execution returns to it's frame, the next iteration
+   * starts.
+   */
+  inline bool VM::enterLoop() {
+    return pushContinuation(0, 0);
+  }
+
+  /**
+   * @brief drop all loops above 'size' (and release their blocks)
+   */
+  inline void VM::dropLoops(unsigned int size) {
+    while (loops.size() > size) {
+      loops.back().release();
+      loops.pop_back();
+    }
+  }
+
+  inline void VM::raiseLookupError(unsigned int symbol) {
+    std::ostringstream ss;
+    if (pureOnly && symbol < externalDefinitions.size() && externalDefinitions[symbol]) {
+      ss << "The word '";
+      ss << env->getSymbols().name(symbol);
+      ss << "' is not pure and can't be used in a parallel block";
+    } else {
+      ss << "Failed to look up the word '";
+      ss << env->getSymbols().name(symbol);
+      ss << "'";
+    }
+    runtimeError = ss.str();
+    raise(ss.str().c_str());
+  }
+
+  inline void VM::raiseOverflowError() {
+    std::ostringstream ss;
+    ss << "Continuation stack overflow (maximum depth is ";
+    ss << continuationStack->getLimit();
+    ss << ")";
+    runtimeError = ss.str();
+    raise(ss.str().c_str());
+  }
+
+  /**
+   * @brief evaluate expression.
+   * @param source the source code to evaluate.
+   * @return a pointer to an Environment object. The stack of the
+   * environment can be inspected in order to get the computed
+   * values (in case the script wasn't called just for it's side effect).
+   *
+   * TODO: a better eval function that can return concrete results.
+   *
+   * If the evaluation runs out of fuel or time, 0 is returned and the
+   * status tells why. A suspended evaluation is dropped by the next eval.
+   */
+  inline Environment *VM::eval(const char *source) {
+    prepare();
+
+    Block *block = parse(source);
+    if (!block) {
+      status = Failed;
+      return 0;
+    }
+
+    return start(block);
+  }
+
+  /**
+   * @brief run a compiled program. The program is not modified, other
+   * VMs may run it at the same time.
+   */
+  inline Environment *VM::eval(const Program *program) {
+    prepare();
+    return start(program->getBlock());
+  }
+
+  /**
+   * @brief parse and optimize a script once, to run it many times or
+   * in several VMs. Native functions declared pure are evaluated at compile
+   * time, so VMs that run the program should bind the same functions.
+   * @return the program (owned by the caller) or 0 if the source can't
+   * be parsed (see getError)
+   */
+  inline Program *VM::compile(const char *source) {
+    this->runtimeError = std::string("");
+    this->runtimeErrorOccured = false;
+
+    Block *block = parse(source);
+    return block ? new Program(block) : 0;
+  }
+
+  inline Block *VM::parse(const char *source) {
+    Block *block = new Block();
+    Parser parser(source, block, &env->getSymbols());
+
+    if (!parser.parse()) {
+      this->runtimeError = parser.getErrors().front();
+      block->release();
+      return 0;
+    }
+
+    if (optimizer.isFolding() || optimizer.isFusing()) {
+      optimizer.optimize(block);
+    }
+
+    return block;
+  }
+
+  inline void VM::prepare() {
+    if (suspended) {
+      abandon();
+    }
+
+    this->runtimeError = std::string("");
+    this->runtimeErrorOccured = false;
+    this->request = NoRequest;
+    this->awaited = -1;
+  }
+
+  inline Environment *VM::start(Block *block) {
+    startBudget();
+    return finish(block, this->run(block));
+  }
+
+  /**
+   * @brief the end of eval or resume. Keeps the block of a suspended
+   * evaluation.
+   */
+  inline Environment *VM::finish(Block *block, bool finished) {
+    if (suspended) {
+      pendingBlock = block;
+      return 0;
+    }
+
+    pendingBlock = 0;
+    endTasks();
+    block->release();
+
+    if (!finished) {
+      if (!halted) {
+        status = Failed;
+      }
+      return 0;
+    }
+
+    status = Finished;
+    return this->env;
+  }
+
+  /**
+   * @brief continue a suspended evaluation with a new budget.
+   * @return the environment if the evaluation finished, 0 if it failed
+   * or was suspended again.
+   */
+  inline Environment *VM::resume() {
+    if (!suspended) {
+      raise("There is no suspended evaluation to resume");
+      status = Failed;
+      return 0;
+    }
+
+    if (!runtimeErrorOccured) {
+      this->runtimeError = std::string("");
+    }
+
+    suspended = false;
+    awaited = -1;
+    request = NoRequest;
+    startBudget();
+    return finish(pendingBlock, execute(0, 0));
+  }
+
+  /**
+   * @brief execute a block
+   * @param block pointer to the block to execute
+   *
+   * The interpreter loop is direct threaded: every opcode handler jumps
+   * straight to the handler of the next operation through a table of
+   * label addresses (GCC/Clang "labels as values"). Other compilers get
+   * a plain switch statement, see PS_DISPATCH below.
+   */
+  inline bool VM::run(Block *block) {
+    // Frames and loops below these belong to an outer (nesting) run
+    unsigned int base = continuationStack->size();
+    unsigned int loopBase = loops.size();
+
+    block->retain();
+    if (!pushContinuation(block, 0)) {
+      block->release();
+      return false;
+    }
+
+    return execute(base, loopBase);
+  }
+
+  /**
+   * @brief the interpreter loop. Runs until the continuation stack is
+   * back at 'base'.
+   */
+  inline bool VM::execute(unsigned int base, unsigned int loopBase) {
+#ifdef PS_COMPUTED_GOTO
+    // Must be kept in the same order as the Opcode enum
+    static void *dispatchTable[] = {
+      &&op_Push_OC,
+      &&op_PushNumber_OC,
+      &&op_PushInteger_OC,
+      &&op_PushBoolean_OC,
+      &&op_Call_OC,
+      &&op_Plus_OC,
+      &&op_Minus_OC,
+      &&op_Mul_OC,
+      &&op_Div_OC,
+      &&op_Equals_OC,
+      &&op_Gt_OC,
+      &&op_Lt_OC,
+      &&op_Dup_OC,
+      &&op_Swap_OC,
+      &&op_Drop_OC,
+      &&op_If_OC,
+      &&op_IfElse_OC,
+      &&op_Repeat_OC,
+      &&op_Times_OC,
+      &&op_While_OC,
+      &&op_Inline_OC,
+      &&op_PushAdd_OC,
+      &&op_PushSub_OC,
+      &&op_PushSubDup_OC,
+      &&op_DupPush_OC,
+      &&op_SwapPlus_OC,
+      &&op_PushMul_OC,
+      &&op_PushDiv_OC,
+      &&op_PushGt_OC,
+      &&op_PushLt_OC,
+      &&op_DupPushGt_OC,
+      &&op_DupPushLt_OC
+    };
+
+#define PS_DISPATCH()   goto *dispatchTable[ip->opcode];
+#define PS_OPCODE(oc)   op_##oc:
+#define PS_END_DISPATCH()
+#else
+#define PS_DISPATCH()   switch (ip->opcode) {
+#define PS_OPCODE(oc)   case oc:
+#define PS_END_DISPATCH() default: goto unknown_opcode; }
+#endif
+
+    // Advance to the next operation and jump to it's handler
+#define PS_NEXT()       if (++ip == end) goto tc_end; goto dispatch;
+
+    // Save the return point 'next' in the current block
+#define PS_SAVE(next)   if (!pushContinuation(block, (next) - &block->value[0])) goto tc_unwind;
+
+    // Leave the current block: save 'next', or release it if there is nothing left to run
+#define PS_LEAVE(next)  if ((next) == end) block->release(); else PS_SAVE(next) block = 0;
+
+    // Leave the current block and continue in 'target' (with a reference held for it)
+#define PS_ENTER(next, target) { \
+      Block *entered = (target); \
+      if ((next) == end) { \
+        block->release(); \
+      } else if (!pushContinuation(block, (next) - &block->value[0])) { \
+        entered->release(); \
+        goto tc_unwind; \
+      } \
+      block = entered; \
+      pc = 0; \
+      goto tc_optimized; \
+    }
+
+    // After a native function: handle it's request, then continue at 'next'
+#define PS_CHECK_REQUEST(next) if (request) { pc = (next) - &block->value[0]; goto tc_request; }
+
+    runDepth++;
+
+    /**
+     * The operation that is currently executed and the end of it's block.
+     * The VM holds a reference to the running block (while 'block' is set)
+     * and to the blocks of the continuation frames.
+     */
+    Block *block = 0;
+    const Operation *ip = 0;
+    const Operation *end;
+    unsigned int pc;
+
+    // The first operation of the current segment (for the budget)
+    const Operation *segment = 0;
+
+tc_startover:
+
+    if (!continuationStack->top().block) {
+      goto tc_loop;
+    }
+
+    block = continuationStack->top().block;
+    pc = continuationStack->top().pc;
+    continuationStack->pop();
+
+tc_optimized:
+
+    // Charge the segment that ended here, see refuel
+    if ((slice -= ip - segment + 1) <= 0) goto tc_budget;
+
+tc_enter:
+
+    if (pc >= block->value.size()) {
+      segment = ip;
+      goto tc_end;
+    }
+
+    ip = segment = &block->value[pc];
+    end = ip + (block->value.size() - pc);
+
+dispatch:
+
+    PS_DISPATCH()
+
+    PS_OPCODE(Push_OC) {
+      // Constants are strings and blocks, no need to unbox
+      this->env->push(Item(block->constants[ip->operand.constant]->retain()));
+      PS_NEXT()
+    }
+
+    PS_OPCODE(PushNumber_OC) {
+      this->env->push(ip->operand.number);
+      PS_NEXT()
+    }
+
+    PS_OPCODE(PushInteger_OC) {
+      this->env->push(Item::integer(ip->operand.integer));
+      PS_NEXT()
+    }
+
+    PS_OPCODE(PushBoolean_OC) {
+      this->env->push(ip->operand.boolean);
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Call_OC) {
+      CallSite *site;
+      if (block->frozen) {
+        // Frozen blocks are shared, their call sites are cached per VM
+        site = resolveFrozen(block, ip->operand.site);
+      } else {
+        site = &block->callSites[ip->operand.site];
+        if (site->epoch != env->getEpoch()) {
+          resolve(*site);
+        }
+      }
+
+      if (site->external) {
+        site->external(env);
+        PS_CHECK_REQUEST(ip + 1)
+        PS_NEXT()
+      } else if (site->target) {
+        if (!block->frozen && !site->noInline && inlining && runDepth == 1 &&
+            ++callCounts[site->symbol] >= INLINE_THRESHOLD) {
+          pc = ip - &block->value[0];
+          long used = ip - segment;
+
+          if (inlineCall(block, pc)) {
+            // The operations of the block may have moved
+            slice -= used;
+            ip = segment = 0;
+
+            // Continue with the guard that replaced the call
+            goto tc_optimized;
+          }
+        }
+
+        // Tail call if there is nothing left to run
+        PS_ENTER(ip + 1, static_cast<Block *>(site->target->retain()))
+      } else {
+        raiseLookupError(site->symbol);
+        goto tc_end;
+      }
+    }
+
+    PS_OPCODE(Inline_OC) {
+      CallSite *site;
+      if (block->frozen) {
+        // Frozen blocks are shared, their call sites are cached per VM
+        site = resolveFrozen(block, ip->operand.site);
+      } else {
+        site = &block->callSites[ip->operand.site];
+        if (site->epoch != env->getEpoch()) {
+          resolve(*site);
+        }
+      }
+
+      // Still the same definition? Then run the inlined operations.
+      if (site->target == site->inlined) {
+        PS_NEXT()
+      }
+
+      // The word was redefined. Call it and skip the inlined operations.
+      const Operation *after = ip + 1 + site->length;
+
+      if (site->external) {
+        site->external(env);
+        PS_CHECK_REQUEST(after)
+        ip = after - 1;
+        PS_NEXT()
+      } else if (site->target) {
+        PS_ENTER(after, static_cast<Block *>(site->target->retain()))
+      } else {
+        raiseLookupError(site->symbol);
+        goto tc_end;
+      }
+    }
+
+    /**
+     * if and ifelse continue with the taken branch. Unless they are the
+     * last operation of their block, the rest of the block runs after
+     * the branch.
+     */
+
+    PS_OPCODE(If_OC) {
+      if (env->expect(Boolean_T, Block_T)) {
+        Block *b = env->popBlock();
+        if (env->pop<bool>()) {
+          PS_ENTER(ip + 1, b)
+        }
+
+        b->release();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(IfElse_OC) {
+      if (env->expect(Boolean_T, Block_T, Block_T)) {
+        Block *onElse = env->popBlock();
+        Block *onIf = env->popBlock();
+        bool condition = env->pop<bool>();
+
+        (condition ? onElse : onIf)->release();
+        PS_ENTER(ip + 1, condition ? onIf : onElse)
+      }
+      PS_NEXT()
+    }
+
+    /**
+     * Loops. The loop state lives in 'loops', the loop frame on the
+     * continuation stack starts the next iteration (see tc_loop).
+     *
+     *   n { body } repeat               run body n times
+     *   n { body } times                same, with the index (0..n-1) on the stack
+     *   { condition } { body } while    run body while condition leaves true
+     */
+
+    PS_OPCODE(Repeat_OC) {
+      if (env->expect(Number_T, Block_T)) {
+        Loop loop;
+        loop.kind = Loop::Repeat;
+        loop.condition = 0;
+        loop.body = env->popBlock();
+        loop.index = 0;
+        loop.count = env->popCount();
+        loop.inCondition = false;
+
+        if (loop.count > 0) {
+          loops.push_back(loop);
+          PS_LEAVE(ip + 1)
+          if (!enterLoop()) goto tc_unwind;
+          goto tc_loop;
+        }
+
+        loop.release();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Times_OC) {
+      if (env->expect(Number_T, Block_T)) {
+        Loop loop;
+        loop.kind = Loop::Times;
+        loop.condition = 0;
+        loop.body = env->popBlock();
+        loop.index = 0;
+        loop.count = env->popCount();
+        loop.inCondition = false;
+
+        if (loop.count > 0) {
+          loops.push_back(loop);
+          PS_LEAVE(ip + 1)
+          if (!enterLoop()) goto tc_unwind;
+          goto tc_loop;
+        }
+
+        loop.release();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(While_OC) {
+      if (env->expect(Block_T, Block_T)) {
+        Loop loop;
+        loop.kind = Loop::While;
+        loop.body = env->popBlock();
+        loop.condition = env->popBlock();
+        loop.index = 0;
+        loop.count = 0;
+        loop.inCondition = false;
+
+        loops.push_back(loop);
+        PS_LEAVE(ip + 1)
+        if (!enterLoop()) goto tc_unwind;
+        goto tc_loop;
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Minus_OC) {
+      if (env->expect(Number_T, Number_T)) {
+        env->directSub();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Plus_OC) {
+      if (env->expect(Number_T, Number_T)) {
+        env->directAdd();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Mul_OC) {
+      if (env->expect(Number_T, Number_T)) {
+        env->directMul();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Div_OC) {
+      if (env->expect(Number_T, Number_T)) {
+        env->directDiv();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Equals_OC) {
+      if (env->expectTwoEqual()) {
+        env->directEquals();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Gt_OC) {
+      if (env->expect(Number_T, Number_T)) {
+        env->directGt();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Lt_OC) {
+      if (env->expect(Number_T, Number_T)) {
+        env->directLt();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Dup_OC) {
+      if (env->expectNotEmpty()) {
+        env->directDup();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Swap_OC) {
+      if (env->expectAtLeast(2)) {
+        env->directSwap();
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(Drop_OC) {
+      if (env->expectNotEmpty()) {
+        env->directDrop();
+      }
+      PS_NEXT()
+    }
+
+    /**
+     * Superinstructions. The fast path works in place on the top of the
+     * stack. If the types don't match, the original sequence is replayed
+     * to raise exactly the same errors. The literal is kept as the bits
+     * of it's item.
+     */
+
+    PS_OPCODE(PushAdd_OC) {
+      if (env->peekIs(Number_T)) {
+        env->directAdd(Item::fromBits(ip->operand.literal));
+      } else {
+        env->push(Item::fromBits(ip->operand.literal));
+        if (env->expect(Number_T, Number_T)) {
+          env->directAdd();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(PushSub_OC) {
+      if (env->peekIs(Number_T)) {
+        env->directSub(Item::fromBits(ip->operand.literal));
+      } else {
+        env->push(Item::fromBits(ip->operand.literal));
+        if (env->expect(Number_T, Number_T)) {
+          env->directSub();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(PushSubDup_OC) {
+      if (env->peekIs(Number_T)) {
+        env->directSub(Item::fromBits(ip->operand.literal));
+        env->directDup();
+      } else {
+        env->push(Item::fromBits(ip->operand.literal));
+        if (env->expect(Number_T, Number_T)) {
+          env->directSub();
+        }
+
+        if (env->expectNotEmpty()) {
+          env->directDup();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(DupPush_OC) {
+      if (env->expectNotEmpty()) {
+        env->directDup();
+      }
+      env->push(Item::fromBits(ip->operand.literal));
+      PS_NEXT()
+    }
+
+    PS_OPCODE(SwapPlus_OC) {
+      // Addition is commutative, no need to swap
+      if (env->peekIs(Number_T, Number_T)) {
+        env->directAdd();
+      } else {
+        if (env->expectAtLeast(2)) {
+          env->directSwap();
+        }
+
+        if (env->expect(Number_T, Number_T)) {
+          env->directAdd();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(PushMul_OC) {
+      if (env->peekIs(Number_T)) {
+        env->directMul(Item::fromBits(ip->operand.literal));
+      } else {
+        env->push(Item::fromBits(ip->operand.literal));
+        if (env->expect(Number_T, Number_T)) {
+          env->directMul();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(PushDiv_OC) {
+      if (env->peekIs(Number_T)) {
+        env->directDiv(Item::fromBits(ip->operand.literal));
+      } else {
+        env->push(Item::fromBits(ip->operand.literal));
+        if (env->expect(Number_T, Number_T)) {
+          env->directDiv();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(PushGt_OC) {
+      if (env->peekIs(Number_T)) {
+        env->directGt(Item::fromBits(ip->operand.literal));
+      } else {
+        env->push(Item::fromBits(ip->operand.literal));
+        if (env->expect(Number_T, Number_T)) {
+          env->directGt();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(PushLt_OC) {
+      if (env->peekIs(Number_T)) {
+        env->directLt(Item::fromBits(ip->operand.literal));
+      } else {
+        env->push(Item::fromBits(ip->operand.literal));
+        if (env->expect(Number_T, Number_T)) {
+          env->directLt();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(DupPushGt_OC) {
+      if (env->peekIs(Number_T)) {
+        env->push(Item(Util::Arithmetic::greater(env->peek(), Item::fromBits(ip->operand.literal))));
+      } else {
+        if (env->expectNotEmpty()) {
+          env->directDup();
+        }
+        env->push(Item::fromBits(ip->operand.literal));
+        if (env->expect(Number_T, Number_T)) {
+          env->directGt();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_OPCODE(DupPushLt_OC) {
+      if (env->peekIs(Number_T)) {
+        env->push(Item(Util::Arithmetic::smaller(env->peek(), Item::fromBits(ip->operand.literal))));
+      } else {
+        if (env->expectNotEmpty()) {
+          env->directDup();
+        }
+        env->push(Item::fromBits(ip->operand.literal));
+        if (env->expect(Number_T, Number_T)) {
+          env->directLt();
+        }
+      }
+      PS_NEXT()
+    }
+
+    PS_END_DISPATCH()
+
+#ifndef PS_COMPUTED_GOTO
+unknown_opcode:
+    {
+      std::ostringstream ss;
+      ss << "Unkown Opcode '";
+      ss << ip->opcode;
+      ss << "'";
+      runtimeError = ss.str();
+      raise(ss.str().c_str());
+    }
+#endif
+
+tc_loop:
+
+    /**
+     * Back at a loop frame: start the next iteration. The frame is removed
+     * before the last iteration of a counted loop, so that the body runs in
+     * tail position (with the reference the loop held).
+     */
+    {
+      Loop &loop = loops.back();
+      bool done = false;
+
+      if (loop.kind == Loop::While) {
+        if (!loop.inCondition) {
+          loop.inCondition = true;
+          block = static_cast<Block *>(loop.condition->retain());
+        } else if (env->expect(Boolean_T) && env->pop<bool>()) {
+          loop.inCondition = false;
+          block = static_cast<Block *>(loop.body->retain());
+        } else {
+          done = true;
+        }
+      } else {
+        if (loop.kind == Loop::Times) {
+          env->push(Item::integer(loop.index));
+        }
+
+        block = loop.body;
+        loop.index++;
+        if (loop.index >= loop.count) {
+          loops.pop_back();
+          continuationStack->pop();
+        } else {
+          block->retain();
+        }
+      }
+
+      if (done) {
+        loop.release();
+        loops.pop_back();
+        continuationStack->pop();
+        goto tc_end;
+      }
+
+      pc = 0;
+      goto tc_optimized;
+    }
+
+tc_end:
+
+    if (block) {
+      block->release();
+      block = 0;
+    }
+
+    if (continuationStack->size() > base) {
+      goto tc_startover;
+    }
+
+    // A task ended, continue with the next one
+    if (runDepth == 1 && !tasks.empty() && finishTask()) {
+      goto tc_startover;
+    }
+
+    goto tc_done;
+
+tc_budget:
+
+    if (refuel()) {
+      goto tc_enter;
+    }
+
+    /**
+     * Out of fuel or time. The outermost run saves the next segment and
+     * returns, resume continues from there. A nested run can't be suspended
+     * (a native function is waiting for it), the whole evaluation stops.
+     */
+    if (runDepth == 1 && !halted) {
+      if (!pushContinuation(block, pc)) {
+        goto tc_unwind;
+      }
+
+      if (!runtimeErrorOccured) {
+        runtimeError = describe(status);
+      }
+
+      suspended = true;
+      runDepth--;
+      return false;
+    }
+
+    halted = true;
+    raise(describe(status));
+    goto tc_unwind;
+
+tc_request:
+
+    if (request == SwitchRequest) {
+      goto tc_switch;
+    }
+
+    /**
+     * A native function suspended the evaluation. Like running out of fuel,
+     * this only works in the outermost run. The host pushes the result of
+     * the function and calls resume, which continues at 'pc'.
+     */
+    request = NoRequest;
+
+    if (runDepth == 1) {
+      if (!pushContinuation(block, pc)) {
+        goto tc_unwind;
+      }
+
+      if (!runtimeErrorOccured) {
+        runtimeError = describe(Pending);
+      }
+
+      status = Pending;
+      suspended = true;
+      runDepth--;
+      return false;
+    }
+
+    raise("A native function can't suspend a nested run");
+    goto tc_unwind;
+
+tc_switch:
+
+    // yield or join. The running task continues at 'pc' when it's turn comes.
+    request = NoRequest;
+
+    if (runDepth != 1) {
+      raise("Tasks can't be switched in a nested run");
+      goto tc_unwind;
+    }
+
+    if (!pushContinuation(block, pc)) {
+      goto tc_unwind;
+    }
+
+    // The frame holds the reference now
+    block = 0;
+
+    if (switchTask()) {
+      goto tc_startover;
+    }
+
+    goto tc_unwind;
+
+tc_unwind:
+
+    // Unwind everything this run started, the error is already raised
+    if (block) {
+      block->release();
+    }
+
+    continuationStack->truncate(base);
+    dropLoops(loopBase);
+
+tc_done:
+
+#undef PS_DISPATCH
+#undef PS_OPCODE
+#undef PS_END_DISPATCH
+#undef PS_NEXT
+#undef PS_SAVE
+#undef PS_LEAVE
+#undef PS_ENTER
+#undef PS_CHECK_REQUEST
+
+    runDepth--;
+    return !runtimeErrorOccured;
+  }
+
+  /**
+   * @brief call a function. This can be an externally defined
+   * C++ function or a block referenced in the dictionary.
+   * @param symbol the symbol of the word to call
+   */
+  inline void VM::call(unsigned int symbol) {
+    if (symbol < externalDefinitions.size() && externalDefinitions[symbol] &&
+        (!pureOnly || pureDefinitions[symbol])) {
+      ExternalFunction def = externalDefinitions[symbol];
+      def(env);
+    } else if (env->hasDefinition(symbol)) {
+      Block *definition = env->getDefinition(symbol);
+      run(definition);
+    } else {
+      raiseLookupError(symbol);
     }
   }
 }
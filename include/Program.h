@@ -0,0 +1,96 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <set>
+#include <vector>
+
+#include "Types.h"
+
+namespace PS {
+  /**
+   * @brief A compiled script. The blocks of a program are frozen, so it can
+   * be run by any number of VMs at the same time, also on different threads.
+   * Programs are created with VM::compile.
+   *
+   * Words defined by a program refer to it's blocks. The program must not be
+   * deleted before the VMs that ran it.
+   */
+  class Program {
+  public:
+    Program(Block *block);
+    ~Program();
+
+    Block *getBlock() const;
+
+  private:
+    Program(const Program &);
+    Program &operator=(const Program &);
+
+    void collect(Type *t, std::set<Type *> &values);
+
+    Block *block;
+  };
+
+  /**
+   * @param block the compiled block, the program takes ownership
+   */
+  inline Program::Program(Block *block) : block(block) {
+    block->freeze();
+  }
+
+  /**
+   * @brief delete all blocks and constants. Frozen values are immortal and
+   * the optimizer and the inliner may share constants between blocks, so
+   * the counts are rebuilt from the blocks that refer to each value first.
+   * Releasing the root then deletes every value after the last block that
+   * holds it, parents before their children.
+   */
+  inline Program::~Program() {
+    std::set<Type *> values;
+    collect(block, values);
+
+    std::set<Type *>::iterator iter;
+    for (iter = values.begin(); iter != values.end(); ++iter) {
+      (*iter)->references = 0;
+    }
+
+    for (iter = values.begin(); iter != values.end(); ++iter) {
+      if ((*iter)->type != Block_T) {
+        continue;
+      }
+
+      std::vector<Type *> &constants = static_cast<Block *>(*iter)->constants;
+      for (unsigned int i = 0; i < constants.size(); i++) {
+        if (values.count(constants[i])) {
+          constants[i]->references++;
+        }
+      }
+    }
+
+    block->references = 1;
+    block->release();
+  }
+
+  inline Block *Program::getBlock() const {
+    return this->block;
+  }
+
+  inline void Program::collect(Type *t, std::set<Type *> &values) {
+    // Interned strings belong to the StringTable
+    if (t->type == String_T && static_cast<String *>(t)->isInterned()) {
+      return;
+    }
+
+    if (!values.insert(t).second || t->type != Block_T) {
+      return;
+    }
+
+    Block *b = static_cast<Block *>(t);
+    std::vector<Type *>::iterator iter;
+    for (iter = b->constants.begin(); iter != b->constants.end(); ++iter) {
+      collect(*iter, values);
+    }
+  }
+}
+
+#endif // PROGRAM_H
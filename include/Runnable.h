@@ -4,14 +4,12 @@
 #include "Types.h"
 
 namespace PS {
-  class Environment;
-  typedef void (*ExternalFunction)(Environment *);
-
   class Runnable {
   public:
     virtual ~Runnable() { }
     virtual bool run(Block *block) = 0;
     virtual void def(const char *name, ExternalFunction def) = 0;
+    virtual void suspend() = 0;
   };
 }
 
@@ -1,39 +1,77 @@
 #ifndef STACK_H
 #define STACK_H
 
+#include <cstring>
+
 #include "Types.h"
+#include "Item.h"
+#include "Map.h"
+#include "Arithmetic.h"
 
 namespace PS {
   /**
-   * @brief Custom stack implementation on top of std::deque.
-   * Has additional features to probe it's elements.
+   * @brief Custom stack implementation on top of a growable array.
+   * Has additional features to probe it's elements. The items are stored
+   * by value (see Item), only strings and blocks live on the heap. The
+   * stack holds a reference to every heap value on it.
+   *
+   * The stack grows upward. The top item is kept apart in 'tos', the
+   * array holds the items below it. So the operations on the top (like
+   * dup 1 -) don't touch the array, and the compiler can keep the top in
+   * a register within an operation.
+   *
+   * Probing (top, second, third, expect) is unchecked: the caller has
+   * verified the size before.
    */
 
   class Stack {
   public:
-    Stack() { }
+    Stack();
     ~Stack();
 
     std::string toString();
 
-    void directSub(double v);
-    void directAdd(double v);
+    /**
+     * @brief arithmetic and comparisons on the top. With an operand they
+     * work on the top and the operand, without one on the two topmost items
+     * (the top is the right hand side). See Util::Arithmetic.
+     */
+    void directSub(Item v);
+    void directAdd(Item v);
+    void directMul(Item v);
+    void directDiv(Item v);
+    void directGt(Item v);
+    void directLt(Item v);
+    void directSub();
+    void directAdd();
+    void directMul();
+    void directDiv();
+    void directGt();
+    void directLt();
+    void directEquals();
     void directDup();
     void directSwap();
+    void directDrop();
+
+    bool empty();
+    unsigned int size();
+    bool hasAtLeast(unsigned int count);
+
+    void exchange(Stack &other);
+    void pushCopies(const Stack &other);
 
   protected:
-    Type *pop();
+    Item pop();
     /**
      * @brief top, second and third probe the corresponding items on the stack
      * without removing them.
-     * @return a pointer to the corresponding stack item.
+     * @return a copy of the corresponding stack item.
      */
-    Type *top();
-    Type* second();
-    Type* third();
-    void push(Type *v);
-    bool empty();
-    unsigned int size();
+    Item top();
+    Item second();
+    Item third();
+    Item below(unsigned int depth);
+    void push(Item v);
 
     /**
      * @brief expect assert a certain stack condition
@@ -43,122 +81,367 @@ namespace PS {
     bool expect(DataType a);
     bool expect(DataType a, DataType b);
     bool expect(DataType a, DataType b, DataType c);
+    bool expect(DataType a, DataType b, DataType c, DataType d, DataType e);
+
+    void release(Item v);
+
+    /**
+     * @brief the type of an item, integers count as numbers
+     */
+    static DataType kind(Item v);
 
   private:
-    std::deque<Type *> data;
+    Stack(const Stack &);
+    Stack &operator=(const Stack &);
+
+    static bool matches(Item v, DataType a);
+    void grow();
+    Item at(unsigned int index) const;
+
+    static const unsigned int RESERVED_ITEMS = 64;
+
+    /**
+     * @brief items[0] is a spare slot: pushing on an empty stack moves
+     * the (invalid) top there. The items below the top follow.
+     */
+    Item *items;
+
+    // One past the item below the top, the size is sp - items
+    Item *sp;
+    Item *limit;
+    Item tos;
   };
 
+  inline Stack::Stack()
+    : items(new Item[RESERVED_ITEMS]), sp(items), limit(items + RESERVED_ITEMS) { }
+
   inline Stack::~Stack() {
-    std::deque<Type *>::iterator iter;
-    for (iter = data.begin(); iter != data.end(); ++iter) {
-      delete *iter;
+    if (sp != items) {
+      release(tos);
     }
+
+    for (Item *p = items + 1; p < sp; p++) {
+      release(*p);
+    }
+
+    delete[] items;
+  }
+
+  PS_ALWAYS_INLINE inline void Stack::directSub(Item v) {
+    Item result = Util::Arithmetic::sub(tos, v);
+    release(tos);
+    release(v);
+    tos = result;
+  }
+
+  PS_ALWAYS_INLINE inline void Stack::directAdd(Item v) {
+    Item result = Util::Arithmetic::add(tos, v);
+    release(tos);
+    release(v);
+    tos = result;
   }
 
-  inline void Stack::directSub(double v) {
-    ((Number *) data.front())->value -= v;
+  inline void Stack::directMul(Item v) {
+    Item result = Util::Arithmetic::mul(tos, v);
+    release(tos);
+    release(v);
+    tos = result;
   }
 
-  inline void Stack::directAdd(double v) {
-    ((Number *) data.front())->value += v;
+  inline void Stack::directDiv(Item v) {
+    Item result = Util::Arithmetic::div(tos, v);
+    release(tos);
+    release(v);
+    tos = result;
   }
 
-  inline Type *Stack::pop() {
-    Type *v = data.front(); data.pop_front();
+  /**
+   * @brief replace the number on top of the stack with the result
+   * of the comparison <top> > v
+   */
+  inline void Stack::directGt(Item v) {
+    bool result = Util::Arithmetic::greater(tos, v);
+    release(tos);
+    release(v);
+    tos = Item(result);
+  }
+
+  inline void Stack::directLt(Item v) {
+    bool result = Util::Arithmetic::smaller(tos, v);
+    release(tos);
+    release(v);
+    tos = Item(result);
+  }
+
+  inline void Stack::directSub() {
+    directSub(pop());
+  }
+
+  inline void Stack::directAdd() {
+    directAdd(pop());
+  }
+
+  inline void Stack::directMul() {
+    directMul(pop());
+  }
+
+  inline void Stack::directDiv() {
+    directDiv(pop());
+  }
+
+  inline void Stack::directGt() {
+    directGt(pop());
+  }
+
+  inline void Stack::directLt() {
+    directLt(pop());
+  }
+
+  /**
+   * @brief replace the two topmost items with a boolean that tells if they
+   * are equal. Both items must be of the same type. Blocks are compared by
+   * identity.
+   */
+  inline void Stack::directEquals() {
+    Item a = tos;
+    Item b = sp[-1];
+    bool result = false;
+    DataType type = kind(a);
+
+    switch (type) {
+    case Number_T:
+      result = Util::Arithmetic::equal(a, b);
+      break;
+    case String_T:
+      result = String::equal((String *) a.asObject(), (String *) b.asObject());
+      break;
+    case Boolean_T:
+      result = a == b;
+      break;
+    case Block_T:
+    case Map_T:
+      result = a == b;
+      break;
+    case Array_T:
+      result = ((Array *) a.asObject())->value == ((Array *) b.asObject())->value;
+      break;
+    default:
+      break;
+    }
+
+    sp--;
+    tos = Item(result);
+    release(a);
+    release(b);
+  }
+
+  PS_ALWAYS_INLINE inline void Stack::release(Item v) {
+    if (v.isObject()) {
+      v.asObject()->release();
+    }
+  }
+
+  PS_ALWAYS_INLINE inline Item Stack::pop() {
+    Item v = tos;
+    tos = *--sp;
     return v;
   }
 
-  inline void Stack::directDup() {
-    data.push_front(data.front()->clone());
+  /**
+   * @brief copy the top item. Strings and blocks are shared, not copied.
+   */
+  PS_ALWAYS_INLINE inline void Stack::directDup() {
+    if (tos.isObject()) {
+      tos.asObject()->retain();
+    }
+    push(tos);
   }
 
   inline void Stack::directSwap() {
-    Type *a = data.front(); data.pop_front();
-    Type *b = data.front(); data.pop_front();
-    data.push_front(a);
-    data.push_front(b);
+    Item t = tos;
+    tos = sp[-1];
+    sp[-1] = t;
+  }
+
+  inline void Stack::directDrop() {
+    release(tos);
+    tos = *--sp;
   }
 
-  inline Type *Stack::top() {
-    return data.at(0);
+  inline Item Stack::top() {
+    return tos;
   }
 
-  inline Type *Stack::second() {
-    return data.at(1);
+  inline Item Stack::second() {
+    return sp[-1];
   }
 
-  inline Type *Stack::third() {
-    return data.at(2);
+  inline Item Stack::third() {
+    return sp[-2];
   }
 
-  inline void Stack::push(Type *v) {
-    data.push_front(v);
+  /**
+   * @brief the item 'depth' places below the top, below(0) is the top
+   */
+  inline Item Stack::below(unsigned int depth) {
+    return depth ? sp[-(int) depth] : tos;
+  }
+
+  PS_ALWAYS_INLINE inline void Stack::push(Item v) {
+    if (sp == limit) {
+      grow();
+    }
+
+    *sp++ = tos;
+    tos = v;
   }
 
   inline bool Stack::empty() {
-    return this->data.empty();
+    return sp == items;
   }
 
   inline unsigned int Stack::size() {
-    return this->data.size();
+    return sp - items;
+  }
+
+  inline bool Stack::hasAtLeast(unsigned int count) {
+    return items + count <= sp;
+  }
+
+  /**
+   * @brief the item at 'index', counted from the bottom
+   */
+  inline Item Stack::at(unsigned int index) const {
+    return items + index + 1 == sp ? tos : items[index + 1];
+  }
+
+  PS_NOINLINE inline void Stack::grow() {
+    unsigned int capacity = limit - items;
+    unsigned int count = sp - items;
+
+    Item *moved = new Item[capacity * 2];
+    std::memcpy(moved, items, count * sizeof(Item));
+    delete[] items;
+
+    items = moved;
+    sp = moved + count;
+    limit = moved + capacity * 2;
+  }
+
+  /**
+   * @brief swap the contents with another stack in constant time
+   */
+  inline void Stack::exchange(Stack &other) {
+    std::swap(items, other.items);
+    std::swap(sp, other.sp);
+    std::swap(limit, other.limit);
+    std::swap(tos, other.tos);
+  }
+
+  /**
+   * @brief push copies of all items of another stack (bottom first).
+   * Heap values are shared with the other stack.
+   */
+  inline void Stack::pushCopies(const Stack &other) {
+    unsigned int count = other.sp - other.items;
+    for (unsigned int i = 0; i < count; i++) {
+      Item v = other.at(i);
+      if (v.isObject()) {
+        v.asObject()->retain();
+      }
+      push(v);
+    }
+  }
+
+  inline DataType Stack::kind(Item v) {
+    DataType type = v.type();
+    return type == Integer_T ? Number_T : type;
+  }
+
+  /**
+   * @brief an integer is accepted where a number is expected
+   */
+  inline bool Stack::matches(Item v, DataType a) {
+    DataType type = v.type();
+    return type == a || a == Any_T || (a == Number_T && type == Integer_T);
   }
 
   inline bool Stack::expect(DataType a) {
-    return (data.at(0)->type == a || a == Any_T);
+    return matches(tos, a);
   }
 
   inline bool Stack::expect(DataType a, DataType b) {
-    return
-        (data.at(1)->type == a || a == Any_T) &&
-        (data.at(0)->type == b || b == Any_T);
+    return matches(sp[-1], a) && matches(tos, b);
   }
 
   inline bool Stack::expect(DataType a, DataType b, DataType c) {
-    return
-        (data.at(2)->type == a || a == Any_T) &&
-        (data.at(1)->type == b || b == Any_T) &&
-        (data.at(0)->type == c || c == Any_T);
+    return matches(sp[-2], a) && matches(sp[-1], b) && matches(tos, c);
+  }
+
+  inline bool Stack::expect(DataType a, DataType b, DataType c, DataType d, DataType e) {
+    return matches(sp[-4], a) && matches(sp[-3], b) && matches(sp[-2], c) && matches(sp[-1], d) && matches(tos, e);
   }
 
   inline std::string Stack::toString() {
-    std::deque<Type *>::iterator iter;
     std::ostringstream ss;
     bool isFirst = true;
     ss << "< ";
 
-    for (iter = data.begin(); iter != data.end(); ++iter) {
+    // Topmost first
+    for (unsigned int i = size(); i > 0; i--) {
       if (!isFirst) {
         ss << ", ";
       }
 
-      Type *t = *iter;
-      switch(t->type) {
+      Item t = at(i - 1);
+      switch(t.type()) {
       case String_T:
         {
-        String *s = static_cast<String *>(t);
-        ss << "'" << s->value << "'";
+        String *s = static_cast<String *>(t.asObject());
+        ss << "'";
+        ss.write(s->data(), s->size());
+        ss << "'";
         break;
         }
       case Number_T:
         {
-        Number *s = static_cast<Number *>(t);
-        ss << s->value;
+        ss << t.asNumber();
+        break;
+        }
+      case Integer_T:
+        {
+        ss << t.asInteger();
         break;
         }
       case Boolean_T:
         {
-        Boolean *s = static_cast<Boolean *>(t);
-        ss << (s->value ? "true" : "false");
+        ss << (t.asBoolean() ? "true" : "false");
         break;
         }
       case Block_T:
         {
-        Block *s = static_cast<Block *>(t);
+        Block *s = static_cast<Block *>(t.asObject());
         ss << "{Block (";
         ss << s->value.size();
         ss << " items)}";
         break;
         }
+      case Array_T:
+        {
+        Array *s = static_cast<Array *>(t.asObject());
+        ss << "{Array (";
+        ss << s->value.size();
+        ss << " items)}";
+        break;
+        }
+      case Map_T:
+        {
+        Map *s = static_cast<Map *>(t.asObject());
+        ss << "{Map (";
+        ss << s->size();
+        ss << " entries)}";
+        break;
+        }
       default:
         break;
       }
@@ -1,30 +1,19 @@
 #ifndef STDLIB_H
 #define STDLIB_H
 
+#include <cmath>
 #include <sstream>
 
 #include "NumericUtils.h"
 #include "PebbleScript.h"
+#include "Parallel.h"
+#include "Batch.h"
+#include "Channel.h"
+#include "ArrayKernels.h"
 
 namespace PS { namespace Stdlib {
 
-  void mul(Environment *env) {
-    if (env->expect(Number_T, Number_T)) {
-      double a = env->pop<double>();
-      double b = env->pop<double>();
-      env->push(a * b);
-    }
-  }
-
-  void div(Environment *env) {
-    if (env->expect(Number_T, Number_T)) {
-      double a = env->pop<double>();
-      double b = env->pop<double>();
-      env->push(b / a);
-    }
-  }
-
-  void print(Environment *env) {
+  inline void print(Environment *env) {
     if (env->expectNotEmpty()) {
       std::ostringstream ss;
       switch(env->peekType()) {
@@ -34,6 +23,9 @@ namespace PS { namespace Stdlib {
       case Number_T:
         ss << env->pop<double>();
         break;
+      case Integer_T:
+        ss << env->pop<long long>();
+        break;
       case Boolean_T:
         ss << env->pop<bool>();
         break;
@@ -43,6 +35,27 @@ namespace PS { namespace Stdlib {
           ss << "{Block (";
           ss << block->value.size();
           ss << " items)}";
+          block->release();
+          break;
+        }
+      case Array_T:
+        {
+          Array *array = static_cast<Array *>(env->popRaw());
+          ss << "[";
+          for (unsigned int i = 0; i < array->value.size(); i++) {
+            ss << (i ? " " : "") << array->value[i];
+          }
+          ss << "]";
+          array->release();
+          break;
+        }
+      case Map_T:
+        {
+          Map *map = static_cast<Map *>(env->popRaw());
+          ss << "{Map (";
+          ss << map->size();
+          ss << " entries)}";
+          map->release();
           break;
         }
       default:
@@ -52,15 +65,15 @@ namespace PS { namespace Stdlib {
     }
   }
 
-  void dump(Environment *env) {
+  inline void dump(Environment *env) {
     std::cout << env->toString() << std::endl;
   }
 
-  void cr(Environment *) {
+  inline void cr(Environment *) {
     std::cout << std::endl;
   }
 
-  void def(Environment *env) {
+  inline void def(Environment *env) {
     if (env->expect(String_T, Block_T)) {
       Block *block = env->popBlock();
       std::string name = env->pop<std::string>();
@@ -68,110 +81,874 @@ namespace PS { namespace Stdlib {
     }
   }
 
-  void equals(Environment *env) {
-    if (env->expectTwoEqual()) {
-      bool result = false;
+  /**
+   * lo hi { body } pmap-range
+   * Runs body for every index in [lo, hi) on several threads. body gets the
+   * index and leaves one value. The values are pushed in index order.
+   * body may only call pure native functions.
+   */
+  inline void pmapRange(Environment *env) {
+    if (env->expect(Number_T, Number_T, Block_T)) {
+      Block *body = env->popBlock();
+      long hi = env->popCount();
+      long lo = env->popCount();
 
-      switch (env->peekType()) {
-      case Number_T:
-        {
-          double a = env->pop<double>();
-          double b = env->pop<double>();
-          result = Util::NumericUtils::equalWithEpsilon(a, b);
-          break;
-        }
-      case String_T:
-        {
-          std::string a = env->pop<std::string>();
-          std::string b = env->pop<std::string>();
-          result = a.compare(b) == 0;
-          break;
-        }
-      case Boolean_T:
-        {
-          result = env->pop<bool>() == env->pop<bool>();
-          break;
-        }
-      case Block_T:
-        {
-          // Compare pointers
-          Block *a = env->popBlock();
-          Block *b = env->popBlock();
-          result = a == b;
+      // The VM is the only Runnable
+      ParallelRange range(static_cast<VM *>(env->getMachine()), lo, hi);
+      bool mapped = range.map(body);
+      body->release();
+
+      if (!mapped) {
+        env->raise(range.getError().c_str());
+        return;
+      }
+
+      std::vector<Type *>::iterator iter;
+      for (iter = range.getResults().begin(); iter != range.getResults().end(); ++iter) {
+        env->push(*iter);
+      }
+    }
+  }
+
+  /**
+   * lo hi init { combine } { body } preduce
+   * Like pmap-range, but the values are combined: combine gets two values
+   * and leaves one. The result is init combined with the values of all
+   * indices. combine has to be associative, the values are combined in
+   * index order but not strictly from left to right.
+   */
+  inline void preduce(Environment *env) {
+    // Nothing is taken from the stack if an operand is wrong
+    if (env->expect(Number_T, Number_T, Any_T, Block_T, Block_T)) {
+      Block *body = env->popBlock();
+      Block *combine = env->popBlock();
+      Type *init = env->popRaw();
+      long hi = env->popCount();
+      long lo = env->popCount();
+
+      ParallelRange range(static_cast<VM *>(env->getMachine()), lo, hi);
+      bool reduced = range.reduce(body, combine);
+      body->release();
+
+      if (!reduced) {
+        env->raise(range.getError().c_str());
+        combine->release();
+        init->release();
+        return;
+      }
+
+      // Combine the partial results in chunk order
+      env->push(init);
+
+      // Errors raised before don't stop the combining
+      VM *vm = static_cast<VM *>(env->getMachine());
+      bool failedBefore = vm->runtimeErrorOccured;
+      vm->runtimeErrorOccured = false;
+
+      std::vector<Type *> &results = range.getResults();
+      for (unsigned int i = 0; i < results.size(); i++) {
+        env->push(results[i]);
+        if (!env->run(combine)) {
+          // Drop the results that were not combined
+          for (i++; i < results.size(); i++) {
+            results[i]->release();
+          }
           break;
         }
-      default:
-        break;
       }
 
-      env->push(new Boolean(result));
+      vm->runtimeErrorOccured = vm->runtimeErrorOccured || failedBefore;
+      combine->release();
     }
   }
 
-  void gt(Environment *env) {
-    if (env->expect(Number_T, Number_T)) {
-      double a = env->pop<double>();
-      double b = env->pop<double>();
-      env->push(Util::NumericUtils::greaterWithEpsilon(b, a));
+  /**
+   * { body } spawn
+   * Starts a task that runs body with an empty stack. Leaves the id of the
+   * task. Tasks take turns when they call yield or join.
+   */
+  inline void spawn(Environment *env) {
+    if (env->expect(Block_T)) {
+      Block *body = env->popBlock();
+      VM *vm = static_cast<VM *>(env->getMachine());
+      env->push((long long) vm->spawn(body));
+    }
+  }
+
+  /**
+   * yield
+   * Lets the other ready tasks run first.
+   */
+  inline void yield(Environment *env) {
+    static_cast<VM *>(env->getMachine())->yield();
+  }
+
+  /**
+   * id join
+   * Waits until the task has finished and pushes the values it left.
+   */
+  inline void join(Environment *env) {
+    if (env->expect(Number_T)) {
+      double id = env->pop<double>();
+      static_cast<VM *>(env->getMachine())->join(id < 0 ? UINT_MAX : (unsigned int) id);
+    }
+  }
+
+  /**
+   * @brief add a channel to the table and leave it's id
+   */
+  inline void openChannel(Environment *env, Channel *channel) {
+    long long id = Channels::global().open(channel);
+    if (id < 0) {
+      env->raise("Too many channels, close the ones that are no longer used");
+      return;
+    }
+
+    env->push(id);
+  }
+
+  /**
+   * @brief raise an error unless a channel can have this capacity
+   */
+  inline bool checkCapacity(Environment *env, double capacity) {
+    if (!(capacity >= 1 && capacity <= Channel::MAX_CAPACITY)) {
+      std::ostringstream ss;
+      ss << "A channel needs a capacity between 1 and " << Channel::MAX_CAPACITY;
+      env->raise(ss.str().c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * @return the channel with this id (the caller releases it) or 0 if
+   * there is no open channel with this id
+   */
+  inline Channel *findChannel(double id) {
+    // Larger ids are never handed out
+    return id >= 0 && id < 9007199254740992.0 ? Channels::global().get((long long) id) : 0;
+  }
+
+  /**
+   * capacity chan-new
+   * Creates a channel for any number of threads and leaves it's id.
+   */
+  inline void chanNew(Environment *env) {
+    if (env->expect(Number_T)) {
+      double capacity = env->pop<double>();
+      if (!checkCapacity(env, capacity)) {
+        return;
+      }
+
+      openChannel(env, new MPMCChannel((unsigned int) capacity));
+    }
+  }
+
+  /**
+   * capacity chan-new-spsc
+   * Creates a channel for one sending and one receiving thread and leaves
+   * it's id. The first thread that sends (or receives) is the only one that
+   * can, chan-send and chan-recv fail on other threads.
+   */
+  inline void chanNewSpsc(Environment *env) {
+    if (env->expect(Number_T)) {
+      double capacity = env->pop<double>();
+      if (!checkCapacity(env, capacity)) {
+        return;
+      }
+
+      openChannel(env, new SPSCChannel((unsigned int) capacity));
+    }
+  }
+
+  /**
+   * value id chan-send
+   * Sends a number, string or boolean. Fails if the channel is full.
+   * The arguments are checked before anything is taken from the stack.
+   */
+  inline void chanSend(Environment *env) {
+    if (env->expectAtLeast(2) && env->expect(Number_T)) {
+      Channel *channel = findChannel(env->peekNumber());
+      if (!channel) {
+        env->raise("Unknown channel");
+        return;
+      }
+
+      // Only plain values cross threads, copies of blocks and maps share
+      // their elements and the reference counts of those aren't atomic
+      if (env->peekIs(Block_T, Number_T) || env->peekIs(Map_T, Number_T) || env->peekIs(Array_T, Number_T)) {
+        channel->release();
+        env->raise("Only numbers, strings and booleans can be sent");
+        return;
+      }
+
+      if (!channel->canSend()) {
+        channel->release();
+        env->raise("Another thread sends to this channel");
+        return;
+      }
+
+      env->pop<double>();
+
+      // Values shared within the VM are copied, the channel gets it's own
+      Type *value = env->popRaw()->unshare();
+
+      if (!channel->trySend(value)) {
+        value->release();
+        env->raise("The channel is full");
+      }
+
+      channel->release();
+    }
+  }
+
+  /**
+   * id chan-recv
+   * Leaves the oldest value of a channel. If the channel is empty, the VM is
+   * suspended until the host continues it with Channels::resume.
+   */
+  inline void chanRecv(Environment *env) {
+    if (env->expect(Number_T)) {
+      double id = env->pop<double>();
+      Channel *channel = findChannel(id);
+      if (!channel) {
+        env->raise("Unknown channel");
+        return;
+      }
+
+      if (!channel->canReceive()) {
+        channel->release();
+        env->raise("Another thread receives from this channel");
+        return;
+      }
+
+      Type *value = channel->tryReceive();
+      channel->release();
+      if (value) {
+        env->push(value);
+        return;
+      }
+
+      static_cast<VM *>(env->getMachine())->await((long long) id);
+      env->suspend();
+    }
+  }
+
+  /**
+   * id chan-close
+   * Closes a channel, it's id is unknown afterwards. Values still in the
+   * channel are dropped once no thread uses it any longer. A VM that waits
+   * for the channel continues with an error.
+   */
+  inline void chanClose(Environment *env) {
+    if (env->expect(Number_T)) {
+      double id = env->pop<double>();
+      if (!(id >= 0 && id < 9007199254740992.0) || !Channels::global().close((long long) id)) {
+        env->raise("Unknown channel");
+      }
+    }
+  }
+
+  /**
+   * a b concat
+   * Leaves a followed by b. A string that is only on the stack is extended
+   * in place, so building a string in a loop takes linear time.
+   */
+  inline void concat(Environment *env) {
+    if (env->expect(String_T, String_T)) {
+      String *b = static_cast<String *>(env->popRaw());
+      String *a = static_cast<String *>(env->popRaw());
+      env->push(String::concat(a, b));
+    }
+  }
+
+  /**
+   * string start count substr
+   * Leaves count characters of string from start on. Fewer if the string
+   * ends before.
+   */
+  inline void substr(Environment *env) {
+    if (env->expect(String_T, Number_T, Number_T)) {
+      double count = env->pop<double>();
+      double start = env->pop<double>();
+      String *s = static_cast<String *>(env->popRaw());
+
+      if (start < 0 || start > s->size() || count < 0) {
+        s->release();
+        env->raise("substr out of range");
+        return;
+      }
+
+      unsigned int from = (unsigned int) start;
+      unsigned int length = count < s->size() - from ? (unsigned int) count : s->size() - from;
+      env->push(s->substr(from, length));
+      s->release();
+    }
+  }
+
+  /**
+   * string length
+   * Leaves the number of characters of string.
+   */
+  inline void length(Environment *env) {
+    if (env->expect(String_T)) {
+      String *s = static_cast<String *>(env->popRaw());
+      env->push((long long) s->size());
+      s->release();
+    }
+  }
+
+  /**
+   * Arrays. Indices count from 0. The words that change an array change it
+   * in place if it is not shared, otherwise they work on a copy.
+   */
+
+  inline Array *popArray(Environment *env) {
+    return static_cast<Array *>(env->popRaw());
+  }
+
+  /**
+   * @brief raise an error unless 'size' is a size a script can ask for.
+   * NaN and infinite sizes are too large.
+   */
+  inline bool checkArraySize(Environment *env, double size) {
+    if (size < 0) {
+      env->raise("An array can't have a negative size");
+      return false;
+    }
+
+    if (!(size <= Array::MAX_SIZE)) {
+      std::ostringstream ss;
+      ss << "An array can't have more than " << Array::MAX_SIZE << " numbers";
+      env->raise(ss.str().c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * count array-new
+   * Leaves an array of count zeros.
+   */
+  inline void arrayNew(Environment *env) {
+    if (env->expect(Number_T)) {
+      double count = env->pop<double>();
+      if (!checkArraySize(env, count)) {
+        return;
+      }
+
+      env->push(new Array((size_t) count));
     }
   }
 
-  void lt(Environment *env) {
+  /**
+   * lo hi array-range
+   * Leaves the array lo, lo + 1, ... up to hi (exclusive).
+   */
+  inline void arrayRange(Environment *env) {
     if (env->expect(Number_T, Number_T)) {
-      double a = env->pop<double>();
-      double b = env->pop<double>();
-      env->push(Util::NumericUtils::smallerWithEpsilon(b, a));
+      double hi = env->pop<double>();
+      double lo = env->pop<double>();
+
+      double size = hi > lo ? std::ceil(hi - lo) : 0;
+      if (!checkArraySize(env, size)) {
+        return;
+      }
+
+      Array *array = new Array((size_t) size);
+      for (size_t i = 0; i < array->value.size(); i++) {
+        array->value[i] = lo + i;
+      }
+      env->push(array);
+    }
+  }
+
+  /**
+   * v1 ... vn n array-of
+   * Leaves the array of the n numbers below n (v1 first).
+   */
+  inline void arrayOf(Environment *env) {
+    if (env->expect(Number_T)) {
+      double count = env->pop<double>();
+      if (!checkArraySize(env, count)) {
+        return;
+      }
+
+      if (!env->expectAtLeast((unsigned int) count)) {
+        return;
+      }
+
+      size_t n = (size_t) count;
+      Array *array = new Array(n);
+      for (size_t i = n; i > 0; i--) {
+        if (!env->expect(Number_T)) {
+          array->release();
+          return;
+        }
+        array->value[i - 1] = env->pop<double>();
+      }
+      env->push(array);
+    }
+  }
+
+  /**
+   * array index array-get
+   * Leaves the number at index.
+   */
+  inline void arrayGet(Environment *env) {
+    if (env->expect(Array_T, Number_T)) {
+      double index = env->pop<double>();
+      Array *array = popArray(env);
+
+      if (index < 0 || index >= array->value.size()) {
+        array->release();
+        env->raise("array index out of range");
+        return;
+      }
+
+      env->push(array->value[(size_t) index]);
+      array->release();
+    }
+  }
+
+  /**
+   * array index value array-set
+   * Leaves the array with the number at index replaced by value.
+   */
+  inline void arraySet(Environment *env) {
+    if (env->expect(Array_T, Number_T, Number_T)) {
+      double value = env->pop<double>();
+      double index = env->pop<double>();
+      Array *array = popArray(env);
+
+      if (index < 0 || index >= array->value.size()) {
+        array->release();
+        env->raise("array index out of range");
+        return;
+      }
+
+      array = static_cast<Array *>(array->unshare());
+      array->value[(size_t) index] = value;
+      env->push(array);
     }
   }
 
-  void ifElseCond(Environment *env) {
-    if (env->expect(Boolean_T, Block_T, Block_T)) {
-      Block *onElse = env->popBlock();
-      Block *onIf = env->popBlock();
-      bool condition = env->pop<bool>();
+  /**
+   * array array-length
+   */
+  inline void arrayLength(Environment *env) {
+    if (env->expect(Array_T)) {
+      Array *array = popArray(env);
+      env->push((long long) array->value.size());
+      array->release();
+    }
+  }
 
-      if (condition) {
-        env->run(onIf);
+  /**
+   * array start count array-slice
+   * Leaves a new array of count numbers from start on. Fewer if the array
+   * ends before.
+   */
+  inline void arraySlice(Environment *env) {
+    if (env->expect(Array_T, Number_T, Number_T)) {
+      double count = env->pop<double>();
+      double start = env->pop<double>();
+      Array *array = popArray(env);
+      size_t size = array->value.size();
+
+      if (start < 0 || start > size || count < 0) {
+        array->release();
+        env->raise("array-slice out of range");
+        return;
+      }
+
+      size_t from = (size_t) start;
+      size_t length = count < size - from ? (size_t) count : size - from;
+
+      Array *slice = new Array(0);
+      slice->value.assign(array->value.begin() + from, array->value.begin() + from + length);
+      env->push(slice);
+      array->release();
+    }
+  }
+
+  /**
+   * array array-sum, array array-min, array array-max
+   * min and max of an empty array are an error.
+   */
+  inline void arraySum(Environment *env) {
+    if (env->expect(Array_T)) {
+      Array *array = popArray(env);
+      env->push(Util::ArrayKernels::sum(array->value.data(), array->value.size()));
+      array->release();
+    }
+  }
+
+  inline void arrayMin(Environment *env) {
+    if (env->expect(Array_T)) {
+      Array *array = popArray(env);
+      if (array->value.empty()) {
+        env->raise("array-min of an empty array");
       } else {
-        env->run(onElse);
+        env->push(Util::ArrayKernels::min(array->value.data(), array->value.size()));
+      }
+      array->release();
+    }
+  }
+
+  inline void arrayMax(Environment *env) {
+    if (env->expect(Array_T)) {
+      Array *array = popArray(env);
+      if (array->value.empty()) {
+        env->raise("array-max of an empty array");
+      } else {
+        env->push(Util::ArrayKernels::max(array->value.data(), array->value.size()));
+      }
+      array->release();
+    }
+  }
+
+  /**
+   * @brief pop two arrays of the same size (b on top). Leaves nothing and
+   * raises an error if the sizes differ.
+   */
+  inline bool popArrays(Environment *env, Array *&a, Array *&b) {
+    b = popArray(env);
+    a = popArray(env);
+    if (a->value.size() != b->value.size()) {
+      a->release();
+      b->release();
+      env->raise("The arrays differ in size");
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * a b array-dot
+   * Leaves the dot product of two arrays of the same size.
+   */
+  inline void arrayDot(Environment *env) {
+    Array *a, *b;
+    if (env->expect(Array_T, Array_T) && popArrays(env, a, b)) {
+      env->push(Util::ArrayKernels::dot(a->value.data(), b->value.data(), a->value.size()));
+      a->release();
+      b->release();
+    }
+  }
+
+  /**
+   * a b array-add, a b array-mul
+   * Leave the elementwise sum and product of two arrays of the same size.
+   */
+  inline void arrayAdd(Environment *env) {
+    Array *a, *b;
+    if (env->expect(Array_T, Array_T) && popArrays(env, a, b)) {
+      a = static_cast<Array *>(a->unshare());
+      Util::ArrayKernels::add(a->value.data(), b->value.data(), a->value.size());
+      env->push(a);
+      b->release();
+    }
+  }
+
+  inline void arrayMul(Environment *env) {
+    Array *a, *b;
+    if (env->expect(Array_T, Array_T) && popArrays(env, a, b)) {
+      a = static_cast<Array *>(a->unshare());
+      Util::ArrayKernels::mul(a->value.data(), b->value.data(), a->value.size());
+      env->push(a);
+      b->release();
+    }
+  }
+
+  /**
+   * array k array-scale
+   * Leaves the array with every number multiplied by k.
+   */
+  inline void arrayScale(Environment *env) {
+    if (env->expect(Array_T, Number_T)) {
+      double k = env->pop<double>();
+      Array *array = static_cast<Array *>(popArray(env)->unshare());
+      Util::ArrayKernels::scale(array->value.data(), k, array->value.size());
+      env->push(array);
+    }
+  }
+
+  /**
+   * array array-sort
+   * Leaves the array sorted ascending.
+   */
+  inline void arraySort(Environment *env) {
+    if (env->expect(Array_T)) {
+      Array *array = static_cast<Array *>(popArray(env)->unshare());
+      Util::ArrayKernels::sort(array->value.data(), array->value.size());
+      env->push(array);
+    }
+  }
+
+  /**
+   * rows width { body } batch-map
+   * Runs body for every row of the array, a row is 'width' numbers in a row.
+   * body gets the numbers of the row and leaves one number (or boolean).
+   * Leaves an array with the value of every row. Numeric blocks run over
+   * all rows at once (see Batch).
+   */
+  inline void batchMap(Environment *env) {
+    if (env->expect(Array_T, Number_T, Block_T)) {
+      Block *body = env->popBlock();
+      double width = env->pop<double>();
+      Array *rows = popArray(env);
+
+      size_t size = rows->value.size();
+      if (width < 1 || size % (size_t) width != 0) {
+        env->raise("The array must hold whole rows of at least one number");
+        body->release();
+        rows->release();
+        return;
+      }
+
+      Batch batch(static_cast<VM *>(env->getMachine()), body, (unsigned int) width);
+      body->release();
+
+      Array *results = new Array(size / (size_t) width);
+      bool finished = batch.run(rows->value.data(), results->value.size(), results->value.data());
+      rows->release();
+
+      if (!finished) {
+        env->raise(batch.getError().c_str());
+        results->release();
+        return;
       }
+
+      env->push(results);
     }
   }
 
-  void repeat(Environment *env) {
-    if (env->expect(Number_T, Block_T)) {
-      Block *b = env->popBlock();
-      /**
-       * We must bless this block before entering the loop.
-       * Otherwise it's values would be deleted after the first
-       * iteration (when they are pop'd).
-       */
-      b->bless();
+  /**
+   * Maps. Keys are strings or numbers, values may be anything. The words
+   * that change a map change it in place if it is not shared, otherwise
+   * they work on a copy.
+   */
 
-      int count = (int) env->pop<double>();
+  inline Map *popMap(Environment *env) {
+    return static_cast<Map *>(env->popRaw());
+  }
+
+  /**
+   * @brief check that the top of the stack can be a key
+   */
+  inline bool expectKey(Environment *env) {
+    if (!Map::isKey(env->peek())) {
+      env->raise("A map key must be a string or a number");
+      return false;
+    }
+
+    return true;
+  }
+
+  inline void retainItem(Item v) {
+    if (v.isObject()) {
+      v.asObject()->retain();
+    }
+  }
+
+  inline void releaseItem(Item v) {
+    if (v.isObject()) {
+      v.asObject()->release();
+    }
+  }
+
+  /**
+   * count map-new
+   * Leaves an empty map with room for count entries. Room for more than
+   * 2^24 entries can't be made in advance, the map grows as needed.
+   */
+  inline void mapNew(Environment *env) {
+    if (env->expect(Number_T)) {
+      double count = env->pop<double>();
+      if (!(count <= Map::MAX_PRESIZE)) {
+        std::ostringstream ss;
+        ss << "A map can't be made for more than " << Map::MAX_PRESIZE << " entries";
+        env->raise(ss.str().c_str());
+        return;
+      }
+
+      env->push(new Map(count > 0 ? (size_t) count : 0));
+    }
+  }
 
-      if (count < 0) {
+  /**
+   * map key value map-put
+   * Leaves the map with key set to value.
+   */
+  inline void mapPut(Environment *env) {
+    if (env->expect(Map_T, Any_T, Any_T)) {
+      Item value = env->popItem();
+      if (!expectKey(env)) {
+        releaseItem(value);
         return;
+      }
+
+      Item key = env->popItem();
+      Map *map = static_cast<Map *>(popMap(env)->unshare());
+      map->put(key, value);
+      env->push(map);
+    }
+  }
+
+  /**
+   * map key map-get
+   * Leaves the value of key. A missing key is an error.
+   */
+  inline void mapGet(Environment *env) {
+    if (env->expect(Map_T, Any_T) && expectKey(env)) {
+      Item key = env->popItem();
+      Map *map = popMap(env);
+
+      Item value;
+      if (map->get(key, value)) {
+        retainItem(value);
+        env->push(value);
       } else {
-        for (int i = 0; i < count; i++) {
-          env->run(b);
+        env->raise("The key is not in the map");
+      }
+
+      releaseItem(key);
+      map->release();
+    }
+  }
+
+  /**
+   * map key map-has
+   * Leaves true if the map has the key.
+   */
+  inline void mapHas(Environment *env) {
+    if (env->expect(Map_T, Any_T) && expectKey(env)) {
+      Item key = env->popItem();
+      Map *map = popMap(env);
+
+      Item value;
+      env->push(map->get(key, value));
+
+      releaseItem(key);
+      map->release();
+    }
+  }
+
+  /**
+   * map key map-remove
+   * Leaves the map without key (if it had it).
+   */
+  inline void mapRemove(Environment *env) {
+    if (env->expect(Map_T, Any_T) && expectKey(env)) {
+      Item key = env->popItem();
+      Map *map = popMap(env);
+
+      Item value;
+      if (map->get(key, value)) {
+        map = static_cast<Map *>(map->unshare());
+        map->remove(key);
+      }
+
+      env->push(map);
+      releaseItem(key);
+    }
+  }
+
+  /**
+   * map map-size
+   */
+  inline void mapSize(Environment *env) {
+    if (env->expect(Map_T)) {
+      Map *map = popMap(env);
+      env->push((long long) map->size());
+      map->release();
+    }
+  }
+
+  /**
+   * map { body } map-each
+   * Runs body for every entry, with the key and the value on the stack.
+   * The order of the entries is unspecified.
+   */
+  inline void mapEach(Environment *env) {
+    if (env->expect(Map_T, Block_T)) {
+      Block *body = env->popBlock();
+      Map *map = popMap(env);
+
+      // The map can't change while we hold it, a change works on a copy
+      for (size_t i = 0; i < map->getCapacity(); i++) {
+        if (!map->isFull(i)) {
+          continue;
+        }
+
+        retainItem(map->keyAt(i));
+        retainItem(map->valueAt(i));
+        env->push(map->keyAt(i));
+        env->push(map->valueAt(i));
+        if (!env->run(body)) {
+          break;
         }
       }
+
+      body->release();
+      map->release();
     }
   }
 
-  void install(VM &vm) {
+  /**
+   * map-memory
+   * Leaves the bytes used by the tables of all maps (see Map::totalMemory).
+   */
+  inline void mapMemory(Environment *env) {
+    env->push((long long) static_cast<VM *>(env->getMachine())->getMapMemory());
+  }
+
+  inline void install(VM &vm) {
     vm.def("def", def);
-    vm.def("=", equals);
-    vm.def("ifelse", ifElseCond);
-    vm.def("repeat", repeat);
-    vm.def("*", mul);
-    vm.def("/", div);
-    vm.def(">", gt);
-    vm.def("<", lt);
     vm.def(".", print);
     vm.def("cr", cr);
     vm.def("dump", dump);
+    vm.def("pmap-range", pmapRange);
+    vm.def("preduce", preduce);
+    vm.def("spawn", spawn);
+    vm.def("yield", yield);
+    vm.def("join", join);
+    vm.def("chan-new", chanNew);
+    vm.def("chan-new-spsc", chanNewSpsc);
+    vm.def("chan-send", chanSend);
+    vm.def("chan-recv", chanRecv);
+    vm.def("chan-close", chanClose);
+    vm.def("concat", concat, true);
+    vm.def("substr", substr, true);
+    vm.def("length", length, true);
+    vm.def("array-new", arrayNew, true);
+    vm.def("array-range", arrayRange, true);
+    vm.def("array-of", arrayOf, true);
+    vm.def("array-get", arrayGet, true);
+    vm.def("array-set", arraySet, true);
+    vm.def("array-length", arrayLength, true);
+    vm.def("array-slice", arraySlice, true);
+    vm.def("array-sum", arraySum, true);
+    vm.def("array-min", arrayMin, true);
+    vm.def("array-max", arrayMax, true);
+    vm.def("array-dot", arrayDot, true);
+    vm.def("array-add", arrayAdd, true);
+    vm.def("array-mul", arrayMul, true);
+    vm.def("array-scale", arrayScale, true);
+    vm.def("array-sort", arraySort, true);
+    vm.def("batch-map", batchMap);
+    vm.def("map-new", mapNew, true);
+    vm.def("map-put", mapPut, true);
+    vm.def("map-get", mapGet, true);
+    vm.def("map-has", mapHas, true);
+    vm.def("map-remove", mapRemove, true);
+    vm.def("map-size", mapSize, true);
+    vm.def("map-each", mapEach);
+    vm.def("map-memory", mapMemory);
   }
 
 } }
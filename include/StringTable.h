@@ -0,0 +1,86 @@
+#ifndef STRINGTABLE_H
+#define STRINGTABLE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "Types.h"
+
+namespace PS {
+  /**
+   * @brief Interns string literals.
+   * Every distinct literal is stored once. The interned strings are
+   * immortal and never changed, so they can be shared by all VMs, also on
+   * different threads, and compared by identity.
+   *
+   * There is one table for the whole process and it's strings live until
+   * exit, so only short literals are interned and the table is bounded.
+   * Other literals are ordinary constants of their block, they are freed
+   * with it (or with the Program). It may be used from several threads.
+   */
+  class StringTable {
+  public:
+    static StringTable &global();
+    ~StringTable();
+
+    String *intern(const std::string &text);
+    size_t size();
+
+    // Longer literals are not interned
+    static const size_t MAX_LENGTH = 64;
+    // Strings in the table at most
+    static const size_t MAX_STRINGS = 1 << 16;
+
+  private:
+    std::mutex lock;
+    std::map<std::string, String *> strings;
+  };
+
+  inline StringTable &StringTable::global() {
+    static StringTable table;
+    return table;
+  }
+
+  inline StringTable::~StringTable() {
+    std::map<std::string, String *>::iterator iter;
+    for (iter = strings.begin(); iter != strings.end(); ++iter) {
+      delete iter->second;
+    }
+  }
+
+  /**
+   * @brief returns the interned string for 'text'. Unknown strings are
+   * added to the table while it has room. A text that is too long or
+   * doesn't fit gets a new string that is not interned, with a reference
+   * for the caller.
+   */
+  inline String *StringTable::intern(const std::string &text) {
+    if (text.size() > MAX_LENGTH) {
+      return new String(text);
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    std::map<std::string, String *>::iterator iter = strings.find(text);
+    if (iter != strings.end()) {
+      return iter->second;
+    }
+
+    if (strings.size() >= MAX_STRINGS) {
+      return new String(text);
+    }
+
+    String *s = new String(text);
+    s->intern();
+    strings[text] = s;
+    return s;
+  }
+
+  inline size_t StringTable::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return strings.size();
+  }
+}
+
+#endif // STRINGTABLE_H
@@ -0,0 +1,73 @@
+#ifndef SYMBOLTABLE_H
+#define SYMBOLTABLE_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <string>
+
+namespace PS {
+  /**
+   * @brief Interns word names.
+   * Every distinct name is assigned a small integer id (it's symbol) the
+   * first time it is seen. Symbols are dense and can be used to index the
+   * dictionaries directly.
+   *
+   * There is one table for the whole process, so that compiled programs
+   * can be run by any VM. It may be used from several threads.
+   */
+  class SymbolTable {
+  public:
+    static SymbolTable &global();
+
+    unsigned int intern(const std::string &name);
+    const std::string &name(unsigned int symbol);
+    unsigned int size();
+
+  private:
+    std::mutex lock;
+    std::map<std::string, unsigned int> symbols;
+
+    // A deque, so that references to names stay valid when it grows
+    std::deque<std::string> names;
+  };
+
+  inline SymbolTable &SymbolTable::global() {
+    static SymbolTable table;
+    return table;
+  }
+
+  /**
+   * @brief returns the symbol of a name. Unknown names are added to the table.
+   * @param name the name of the word
+   * @return the symbol for this name
+   */
+  inline unsigned int SymbolTable::intern(const std::string &name) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    std::map<std::string, unsigned int>::iterator iter = symbols.find(name);
+    if (iter != symbols.end()) {
+      return iter->second;
+    }
+
+    unsigned int symbol = names.size();
+    symbols[name] = symbol;
+    names.push_back(name);
+    return symbol;
+  }
+
+  /**
+   * @brief reverse lookup of a symbol (for error messages).
+   */
+  inline const std::string &SymbolTable::name(unsigned int symbol) {
+    std::lock_guard<std::mutex> guard(lock);
+    return names[symbol];
+  }
+
+  inline unsigned int SymbolTable::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return names.size();
+  }
+}
+
+#endif // SYMBOLTABLE_H
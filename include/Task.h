@@ -0,0 +1,83 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <vector>
+
+#include "Stack.h"
+#include "ContinuationStack.h"
+
+namespace PS {
+  /**
+   * @brief state of a running repeat, times or while loop.
+   * Counted loops run their body 'count' times. A while loop alternates
+   * between it's condition and it's body. A loop holds a reference to
+   * it's body and condition.
+   */
+  struct Loop {
+  public:
+    void release();
+
+    enum Kind {
+      Repeat,
+      Times,
+      While
+    };
+
+    Kind kind;
+    Block *condition;
+    Block *body;
+    long index;
+    long count;
+    bool inCondition;
+  };
+
+  /**
+   * @brief a green thread, see the words spawn, yield and join.
+   * The running task keeps it's state in the VM. A task that is not running
+   * keeps it's operand stack, continuation stack and loops here. A context
+   * switch exchanges them with the VM, which only swaps pointers.
+   */
+  struct Task {
+  public:
+    enum State {
+      Ready,
+      Joining,
+      Done
+    };
+
+    Task(ContinuationStack *frames);
+    ~Task();
+
+    State state;
+
+    // The task this one waits for
+    unsigned int joining;
+
+    Stack stack;
+    ContinuationStack *frames;
+    std::vector<Loop> loops;
+
+  private:
+    Task(const Task &);
+    Task &operator=(const Task &);
+  };
+
+  inline void Loop::release() {
+    body->release();
+    if (condition) {
+      condition->release();
+    }
+  }
+
+  inline Task::Task(ContinuationStack *frames) : state(Ready), joining(0), frames(frames) { }
+
+  inline Task::~Task() {
+    for (unsigned int i = 0; i < loops.size(); i++) {
+      loops[i].release();
+    }
+
+    delete frames;
+  }
+}
+
+#endif // TASK_H
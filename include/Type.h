@@ -3,6 +3,27 @@
 
 #include <string>
 
+// Keeps rarely taken paths out of the interpreter loop
+#ifdef __GNUC__
+#define PS_NOINLINE __attribute__((noinline))
+#else
+#define PS_NOINLINE
+#endif
+
+// Small operations the interpreter loop needs inline
+#ifdef __GNUC__
+#define PS_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define PS_ALWAYS_INLINE
+#endif
+
+// Arrays that don't overlap, so loops over them can be vectorized
+#ifdef __GNUC__
+#define PS_RESTRICT __restrict__
+#else
+#define PS_RESTRICT
+#endif
+
 namespace PS {
   /**
    * @brief Possible types of stack items.
@@ -12,6 +33,9 @@ namespace PS {
     String_T,
     Boolean_T,
     Block_T,
+    Integer_T,
+    Array_T,
+    Map_T,
     // The 'Any' type is onle used
     // as a wildcard to query the
     // stack
@@ -26,7 +50,7 @@ namespace PS {
   class Type {
   public:
     virtual ~Type() { }
-    Type(DataType t) : type(t), blessed(false) { }
+    Type(DataType t) : type(t), references(1) { }
     DataType type;
 
     /**
@@ -35,19 +59,83 @@ namespace PS {
      */
     virtual Type *clone() const = 0;
     std::string toString();
-    std::string toString(DataType t);
+    static std::string toString(DataType t);
+
+    /**
+     * @brief values are reference counted. A new value has one reference,
+     * that of it's creator. Everything that stores a value (a stack, the
+     * constant pool of a block, the dictionary, a continuation frame) holds
+     * a reference and releases it when it's done. The value is deleted
+     * with the last reference.
+     */
+    Type *retain();
+    void release();
 
     /**
-     * @brief prevents the deletion of this item in a pop operation.
-     * If this flag is set, the value may not be deleted because
-     * it is referenced in the dictionary.
+     * @brief copy on write: values may only be changed by the only holder
+     * of a reference.
      */
-    bool blessed;
+    bool isShared() const;
+    Type *unshare();
+
+    /**
+     * @brief immortal values are never deleted by release. The blocks of a
+     * program are immortal (see Block::freeze), so VMs on different threads
+     * can use them without touching the count.
+     */
+    void makeImmortal();
+
+    unsigned int references;
+
+  private:
+    void destroy();
+
+    static const unsigned int IMMORTAL = ~0u;
   };
 
+  PS_ALWAYS_INLINE inline Type *Type::retain() {
+    if (references != IMMORTAL) {
+      references++;
+    }
+    return this;
+  }
+
+  PS_ALWAYS_INLINE inline void Type::release() {
+    if (references != IMMORTAL && --references == 0) {
+      destroy();
+    }
+  }
+
+  PS_NOINLINE inline void Type::destroy() {
+    delete this;
+  }
+
+  inline bool Type::isShared() const {
+    return references != 1;
+  }
+
+  /**
+   * @brief give up a reference for one that is not shared.
+   * @return this value if the caller is it's only holder, a copy otherwise
+   */
+  inline Type *Type::unshare() {
+    if (!isShared()) {
+      return this;
+    }
+
+    Type *copy = clone();
+    release();
+    return copy;
+  }
+
+  inline void Type::makeImmortal() {
+    references = IMMORTAL;
+  }
+
   /**
    * @brief return a human-readable string representation of the type
-   * @return either "number", "string", "boolean" or "block"
+   * @return either "number", "string", "boolean", "block", "integer", "array"
+   * or "map"
    */
   inline std::string Type::toString() {
     return toString(this->type);
@@ -63,6 +151,12 @@ namespace PS {
       return std::string("boolean");
     case Block_T:
       return std::string("block");
+    case Integer_T:
+      return std::string("integer");
+    case Array_T:
+      return std::string("array");
+    case Map_T:
+      return std::string("map");
     case Any_T:
       return std::string("any");
     default:
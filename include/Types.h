@@ -2,8 +2,11 @@
 #define TYPES_H
 
 #include <deque>
+#include <vector>
 #include <string>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 #include "Operation.h"
@@ -12,58 +15,234 @@
 
 /**
  * Built-In Types.
- * Number, String, Boolean and Block.
+ * Number, String, Boolean, Block and Array.
  */
 
 namespace PS {
   /**
-   * Numbers are always represented as doubles.
-   * Integer arithmetic may be added as a module of integer-operations.
+   * Numbers with a decimal point are represented as doubles.
    */
   class Number : public Value<double> {
   public:    
-    static FreeStore<Number> freeStore;
     Number (double v) : Value<double>(v, Number_T) { }
     Number *clone() const {
       return new Number(this->value);
     }
 
     void *operator new (size_t size) {
-      void *p = freeStore.get();
+      void *p = FreeStore<Number>::get();
       return p ? p : malloc(size);
     }
 
     void operator delete(void *p) {
-      freeStore.destroy((Number *)p);
+      FreeStore<Number>::destroy((Number *)p);
     }
   };
 
-  FreeStore<Number> Number::freeStore;
+  /**
+   * Numbers without a decimal point are exact 64-bit integers. Mixed with
+   * doubles they are promoted. Most integers are stored in the stack item
+   * itself (see Item), only very large ones live on the heap.
+   */
+  class Integer : public Value<long long> {
+  public:
+    Integer (long long v) : Value<long long>(v, Integer_T) { }
+    Integer *clone() const {
+      return new Integer(this->value);
+    }
+
+    void *operator new (size_t size) {
+      void *p = FreeStore<Integer>::get();
+      return p ? p : malloc(size);
+    }
+
+    void operator delete(void *p) {
+      FreeStore<Integer>::destroy((Integer *)p);
+    }
+  };
 
   /**
    * Strings are built into pebble. The string literals are written
    * as 'Hello World!'. Single quotes in strings are possible:
    * 'Hello ''World!''' => Hello 'World!'
+   *
+   * Strings are immutable while they are shared. Short strings are stored
+   * inline, longer ones in a buffer of their own. A string that is not
+   * shared (see Type::isShared) is appended to in place, so it doubles as
+   * a builder: concatenating in a loop takes amortized linear time.
+   *
+   * Short literals are interned (see StringTable), two interned strings are
+   * equal only if they are the same string.
    */
-  class String : public Value<std::string> {
+  class String : public Type {
   public:
-    static FreeStore<String> freeStore;
-    String (std::string v) : Value<std::string>(v, String_T) { }
+    String (const std::string &v) : Type(String_T) {
+      init(v.data(), v.size());
+    }
+
+    String (const char *data, unsigned int length) : Type(String_T) {
+      init(data, length);
+    }
+
+    ~String() {
+      if (!isInline()) {
+        free(storage.heap);
+      }
+    }
+
     String *clone() const {
-      return new String(this->value);
+      return new String(data(), length);
+    }
+
+    /**
+     * @brief the characters, terminated by a zero byte
+     */
+    const char *data() const {
+      return isInline() ? storage.small : storage.heap;
+    }
+
+    unsigned int size() const {
+      return length;
+    }
+
+    std::string str() const {
+      return std::string(data(), length);
+    }
+
+    bool isInterned() const {
+      return interned;
+    }
+
+    /**
+     * @brief FNV-1a hash of the characters, computed once
+     */
+    size_t hash() const {
+      if (!hashed) {
+        uint64_t h = 14695981039346656037ULL;
+        const char *p = data();
+        for (unsigned int i = 0; i < length; i++) {
+          h = (h ^ (unsigned char) p[i]) * 1099511628211ULL;
+        }
+        hashCode = (size_t) h;
+        hashed = true;
+      }
+
+      return hashCode;
+    }
+
+    static bool equal(const String *a, const String *b) {
+      if (a == b) {
+        return true;
+      }
+
+      if ((a->interned && b->interned) || a->length != b->length) {
+        return false;
+      }
+
+      return memcmp(a->data(), b->data(), a->length) == 0;
+    }
+
+    /**
+     * @brief a followed by b. Takes over the references of the caller to
+     * both strings and returns a reference to the result. If a is not
+     * shared the result is a itself, with b appended.
+     */
+    static String *concat(String *a, String *b) {
+      String *result = a;
+      if (a->isShared()) {
+        result = new String(a->data(), a->length);
+        a->release();
+      }
+
+      result->append(b->data(), b->length);
+      b->release();
+      return result;
+    }
+
+    /**
+     * @brief a new string of 'count' characters from 'start' (unchecked)
+     */
+    String *substr(unsigned int start, unsigned int count) const {
+      return new String(data() + start, count);
+    }
+
+    /**
+     * @brief make this string the interned one for it's characters. Only
+     * used by the StringTable.
+     */
+    void intern() {
+      hash();
+      interned = true;
+      makeImmortal();
     }
 
     void *operator new (size_t size) {
-      void *p = freeStore.get();
+      void *p = FreeStore<String>::get();
       return p ? p : malloc(size);
     }
 
     void operator delete(void *p) {
-      freeStore.destroy((String *)p);
+      FreeStore<String>::destroy((String *)p);
     }
-  };
 
-  FreeStore<String> String::freeStore;
+  private:
+    String(const String &);
+    String &operator=(const String &);
+
+    void init(const char *data, unsigned int size) {
+      length = 0;
+      capacity = INLINE_CAPACITY;
+      hashed = false;
+      interned = false;
+      storage.small[0] = 0;
+      append(data, size);
+    }
+
+    bool isInline() const {
+      return capacity == INLINE_CAPACITY;
+    }
+
+    /**
+     * @brief append in place, the buffer grows by doubling
+     */
+    void append(const char *data, unsigned int size) {
+      if (length + size > capacity) {
+        unsigned int grown = capacity * 2;
+        if (grown < length + size) {
+          grown = length + size;
+        }
+
+        char *buffer = (char *) malloc(grown + 1);
+        memcpy(buffer, this->data(), length);
+        if (!isInline()) {
+          free(storage.heap);
+        }
+
+        storage.heap = buffer;
+        capacity = grown;
+      }
+
+      char *p = isInline() ? storage.small : storage.heap;
+      memcpy(p + length, data, size);
+      length += size;
+      p[length] = 0;
+      hashed = false;
+    }
+
+    // Strings up to this length are stored inline
+    static const unsigned int INLINE_CAPACITY = 23;
+
+    unsigned int length;
+    unsigned int capacity;
+    mutable size_t hashCode;
+    mutable bool hashed;
+    bool interned;
+
+    union {
+      char small[INLINE_CAPACITY + 1];
+      char *heap;
+    } storage;
+  };
 
   /**
    * Currently there is a boolean type but no boolean literals.
@@ -73,56 +252,253 @@ namespace PS {
    */
   class Boolean : public Value<bool> {
   public:
-    static FreeStore<Boolean> freeStore;
     Boolean (bool v) : Value<bool>(v, Boolean_T) { }
     Boolean *clone() const {
       return new Boolean(this->value);
     }
 
     void *operator new (size_t size) {
-      void *p = freeStore.get();
+      void *p = FreeStore<Boolean>::get();
       return p ? p : malloc(size);
     }
 
     void operator delete(void *p) {
-      freeStore.destroy((Boolean *)p);
+      FreeStore<Boolean>::destroy((Boolean *)p);
     }
   };
 
-  FreeStore<Boolean> Boolean::freeStore;
+  /**
+   * Arrays are sequences of numbers in one contiguous buffer. A long run of
+   * numbers is one value instead of many stack items. Arrays are made and
+   * used with the array words of the Stdlib, the bulk operations run as
+   * vectorized kernels (see ArrayKernels). Like strings, arrays are only
+   * changed in place while they are not shared.
+   */
+  class Array : public Value<std::vector<double> > {
+  public:
+    // The largest array scripts can create (1 GiB of numbers)
+    static const size_t MAX_SIZE = (size_t) 1 << 27;
+
+    Array (size_t size) : Value<std::vector<double> >(std::vector<double>(), Array_T) {
+      this->value.resize(size);
+    }
+
+    Array *clone() const {
+      Array *copy = new Array(0);
+      copy->value = this->value;
+      return copy;
+    }
+
+    void *operator new (size_t size) {
+      void *p = FreeStore<Array>::get();
+      return p ? p : malloc(size);
+    }
+
+    void operator delete(void *p) {
+      FreeStore<Array>::destroy((Array *)p);
+    }
+  };
 
   /**
    * Blocks represent a group of operations that are not immediately executed,
    * but pushed on the stack as a single item. They can be assiciated with names
    * in the dictionary which gives them some function-character.
+   *
+   * The operations of a block are stored in one contiguous array. Strings and
+   * nested blocks can't be stored inline, they live in the constant pool of
+   * the block and are referenced by index.
    */
-  class Block : public Value<std::deque<Operation> > {
+  class Block : public Value<std::vector<Operation> > {
   public:
-    Block (std::deque<Operation> v) : Value<std::deque<Operation> >(v, Block_T) { }
-    Block () : Value<std::deque<Operation> >(std::deque<Operation>(), Block_T) { }
+    Block (std::vector<Operation> v) : Value<std::vector<Operation> >(v, Block_T), frozen(false) { }
+    Block () : Value<std::vector<Operation> >(std::vector<Operation>(), Block_T), frozen(false) { }
+
+    ~Block() {
+      std::vector<Type *>::iterator iter;
+      for (iter = this->constants.begin(); iter != this->constants.end(); iter++) {
+        (*iter)->release();
+      }
+    }
+
+    /**
+     * @brief the constant pool. Push_OC operations refer to these values.
+     * The block holds a reference to each of them.
+     */
+    std::vector<Type *> constants;
 
-    void bless() {
-      if (this->blessed) {
+    /**
+     * @brief the call sites. Call_OC operations refer to these.
+     */
+    std::vector<CallSite> callSites;
+
+    /**
+     * @brief frozen blocks belong to a compiled program (see Program.h)
+     * and may be run by several VMs at once. The VM never writes to them:
+     * their call sites are not cached and calls are not inlined.
+     */
+    bool frozen;
+
+    void emit(Opcode opcode) {
+      this->value.push_back(Operation(opcode));
+    }
+
+    void emitNumber(double number) {
+      Operation op(PushNumber_OC);
+      op.operand.number = number;
+      this->value.push_back(op);
+    }
+
+    void emitInteger(long long integer) {
+      Operation op(PushInteger_OC);
+      op.operand.integer = integer;
+      this->value.push_back(op);
+    }
+
+    void emitBoolean(bool boolean) {
+      Operation op(PushBoolean_OC);
+      op.operand.boolean = boolean;
+      this->value.push_back(op);
+    }
+
+    void emitCall(unsigned int symbol) {
+      Operation op(Call_OC);
+      op.operand.site = this->callSites.size();
+      this->callSites.push_back(CallSite(symbol));
+      this->value.push_back(op);
+    }
+
+    void emitConstant(Type *constant) {
+      Operation op(Push_OC);
+      op.operand.constant = this->constants.size();
+      this->constants.push_back(constant);
+      this->value.push_back(op);
+    }
+
+    /**
+     * @brief insert the operations of another block before the operation at
+     * index 'at'. Constants and call sites are copied over and the operands
+     * that refer to them are moved.
+     */
+    void insert(unsigned int at, const Block *other) {
+      unsigned int constantOffset = this->constants.size();
+      unsigned int siteOffset = this->callSites.size();
+
+      std::vector<Type *>::const_iterator constant;
+      for (constant = other->constants.begin(); constant != other->constants.end(); constant++) {
+        this->constants.push_back((*constant)->retain());
+      }
+
+      this->callSites.insert(this->callSites.end(), other->callSites.begin(), other->callSites.end());
+
+      std::vector<Operation> operations(other->value);
+      std::vector<Operation>::iterator iter;
+      for (iter = operations.begin(); iter != operations.end(); iter++) {
+        if (iter->opcode == Push_OC) {
+          iter->operand.constant += constantOffset;
+        } else if (iter->opcode == Call_OC || iter->opcode == Inline_OC) {
+          iter->operand.site += siteOffset;
+        }
+      }
+
+      this->value.insert(this->value.begin() + at, operations.begin(), operations.end());
+    }
+
+    void append(const Block *other) {
+      insert(this->value.size(), other);
+    }
+
+    /**
+     * @brief true if this block or a block nested in it calls a word.
+     */
+    bool calls(unsigned int symbol) const {
+      std::vector<CallSite>::const_iterator site;
+      for (site = this->callSites.begin(); site != this->callSites.end(); site++) {
+        if (site->symbol == symbol) {
+          return true;
+        }
+      }
+
+      std::vector<Type *>::const_iterator iter;
+      for (iter = this->constants.begin(); iter != this->constants.end(); iter++) {
+        if ((*iter)->type == Block_T && static_cast<const Block *>(*iter)->calls(symbol)) {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    /**
+     * @brief freeze this block and all blocks nested in it. They and their
+     * constants become immortal.
+     */
+    void freeze() {
+      if (this->frozen) {
         return;
       }
 
-      this->blessed = true;
-      std::deque<Operation>::iterator iter;
-      for (iter = this->value.begin(); iter != this->value.end(); iter++) {
-        Type *t = (*iter).value;
-        if (!t) continue;
+      this->makeImmortal();
+      this->frozen = true;
+
+      std::vector<CallSite>::iterator site;
+      for (site = this->callSites.begin(); site != this->callSites.end(); site++) {
+        site->epoch = 0;
+      }
+
+      std::vector<Type *>::iterator iter;
+      for (iter = this->constants.begin(); iter != this->constants.end(); iter++) {
+        Type *t = *iter;
 
         if (t->type == Block_T) {
-          Block *block = static_cast<Block *>(t);
-          block->bless();
+          static_cast<Block *>(t)->freeze();
+        } else {
+          // The hash is cached, compute it before other threads can see the string
+          if (t->type == String_T) {
+            static_cast<String *>(t)->hash();
+          }
+          t->makeImmortal();
+        }
+      }
+    }
+
+    /**
+     * @brief a deep copy: nested blocks and constants are copied as well.
+     * The call sites of the copy are unresolved.
+     */
+    Block *copy() const {
+      Block *block = new Block(this->value);
+      block->callSites = this->callSites;
+
+      std::vector<CallSite>::iterator site;
+      for (site = block->callSites.begin(); site != block->callSites.end(); site++) {
+        site->epoch = 0;
+      }
+
+      std::vector<Type *>::const_iterator iter;
+      for (iter = this->constants.begin(); iter != this->constants.end(); iter++) {
+        if ((*iter)->type == Block_T) {
+          block->constants.push_back(static_cast<Block *>(*iter)->copy());
         } else {
-          t->blessed = true;
+          block->constants.push_back((*iter)->clone());
         }
       }
+
+      return block;
     }
 
+    /**
+     * @brief a shallow copy, the constants are shared.
+     */
     Block *clone() const {
-      return new Block(this->value);
+      Block *block = new Block(this->value);
+      block->callSites = this->callSites;
+
+      std::vector<Type *>::const_iterator iter;
+      for (iter = this->constants.begin(); iter != this->constants.end(); iter++) {
+        block->constants.push_back((*iter)->retain());
+      }
+
+      return block;
     }
   };
 }
@@ -0,0 +1,426 @@
+#ifndef VMPOOL_H
+#define VMPOOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PebbleScript.h"
+
+namespace PS {
+  /**
+   * @brief the outcome of a job run by a VMPool.
+   * 'values' is the stack of the VM after the run (bottom first). The
+   * result owns them.
+   */
+  class JobResult {
+  public:
+    JobResult();
+    JobResult(JobResult &&other);
+    JobResult &operator=(JobResult &&other);
+    ~JobResult();
+
+    VM::Status status;
+    std::string error;
+    std::vector<Type *> values;
+
+    // Time spent waiting in a queue and running
+    std::chrono::nanoseconds queueTime;
+    std::chrono::nanoseconds runTime;
+
+  private:
+    JobResult(const JobResult &);
+    JobResult &operator=(const JobResult &);
+    void clear();
+  };
+
+  /**
+   * @brief counters of a VMPool, see VMPool::getStatistics.
+   */
+  struct PoolStatistics {
+  public:
+    unsigned long queued;
+    unsigned long completed;
+    unsigned long stolen;
+
+    // Submission to completion
+    std::chrono::nanoseconds meanLatency;
+    std::chrono::nanoseconds maxLatency;
+
+    // Completed jobs per second since the pool was created
+    double throughput;
+  };
+
+  /**
+   * @brief Runs compiled programs on a fixed set of threads, each with
+   * it's own VM.
+   *
+   * The VMs are created once and prepared by the setup function (e.g. to
+   * install the Stdlib and to set a fuel limit). A job is a program and the
+   * values that are pushed before it runs. The results come back through a
+   * future or a callback.
+   *
+   * Every worker has it's own queue. Jobs are spread round-robin (jobs
+   * submitted by a callback stay on it's worker) and an idle worker steals
+   * from the others. Owners take the oldest job, thieves the newest.
+   *
+   * Every job starts with the words the setup function defined, words
+   * defined by a job are removed after it. A job that runs out of fuel or
+   * time, or waits for a native function, can't be resumed: it fails.
+   */
+  class VMPool {
+  public:
+    typedef void (*Setup)(VM &vm);
+    typedef std::function<void (JobResult &)> Callback;
+
+    VMPool(unsigned int threads, Setup setup);
+    ~VMPool();
+
+    Program *compile(const char *source, std::string *error);
+
+    std::future<JobResult> submit(const Program *program, const std::vector<Type *> &inputs);
+    void submit(const Program *program, const std::vector<Type *> &inputs, Callback callback);
+
+    unsigned int size() const;
+    PoolStatistics getStatistics() const;
+
+  private:
+    struct Job {
+    public:
+      const Program *program;
+      std::vector<Type *> inputs;
+      std::promise<JobResult> promise;
+      Callback callback;
+      std::chrono::steady_clock::time_point submitted;
+    };
+
+    struct Worker {
+    public:
+      VM vm;
+      std::mutex lock;
+      std::deque<Job *> jobs;
+      std::thread thread;
+    };
+
+    VMPool(const VMPool &);
+    VMPool &operator=(const VMPool &);
+
+    void enqueue(Job *job);
+    Job *take(unsigned int index);
+    void work(unsigned int index);
+    void execute(unsigned int index, Job *job);
+    void record(std::chrono::nanoseconds latency);
+
+    std::vector<Worker *> workers;
+
+    // For compile. Prepared like the workers, so pure words fold the same.
+    VM compiler;
+    std::mutex compileLock;
+
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    bool stopping;
+
+    std::atomic<unsigned long> pending;
+    std::atomic<unsigned long> completed;
+    std::atomic<unsigned long> stolen;
+    std::atomic<unsigned int> next;
+    std::atomic<long long> totalLatency;
+    std::atomic<long long> maxLatency;
+    std::chrono::steady_clock::time_point started;
+
+    // The pool and worker of the current thread (for local submission)
+    static VMPool *&currentPool();
+    static unsigned int &currentWorker();
+  };
+
+  inline JobResult::JobResult() : status(VM::Finished), queueTime(0), runTime(0) { }
+
+  inline JobResult::JobResult(JobResult &&other)
+    : status(other.status), error(std::move(other.error)), values(std::move(other.values)),
+      queueTime(other.queueTime), runTime(other.runTime) {
+    other.values.clear();
+  }
+
+  inline JobResult &JobResult::operator=(JobResult &&other) {
+    if (this != &other) {
+      clear();
+      status = other.status;
+      error = std::move(other.error);
+      values = std::move(other.values);
+      queueTime = other.queueTime;
+      runTime = other.runTime;
+      other.values.clear();
+    }
+    return *this;
+  }
+
+  inline JobResult::~JobResult() {
+    clear();
+  }
+
+  inline void JobResult::clear() {
+    std::vector<Type *>::iterator iter;
+    for (iter = values.begin(); iter != values.end(); ++iter) {
+      delete *iter;
+    }
+    values.clear();
+  }
+
+  /**
+   * @param threads the number of workers, 0 for one per core
+   * @param setup called once for every VM, may be 0
+   */
+  inline VMPool::VMPool(unsigned int threads, Setup setup)
+    : stopping(false), pending(0), completed(0), stolen(0), next(0),
+      totalLatency(0), maxLatency(0), started(std::chrono::steady_clock::now()) {
+    if (threads == 0) {
+      threads = std::thread::hardware_concurrency();
+      if (threads == 0) {
+        threads = 1;
+      }
+    }
+
+    if (setup) {
+      setup(compiler);
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+      Worker *worker = new Worker();
+      if (setup) {
+        setup(worker->vm);
+      }
+      workers.push_back(worker);
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+      workers[i]->thread = std::thread(&VMPool::work, this, i);
+    }
+  }
+
+  /**
+   * @brief runs the jobs that are still queued and stops the workers.
+   */
+  inline VMPool::~VMPool() {
+    {
+      std::lock_guard<std::mutex> guard(sleepLock);
+      stopping = true;
+    }
+    wake.notify_all();
+
+    std::vector<Worker *>::iterator iter;
+    for (iter = workers.begin(); iter != workers.end(); ++iter) {
+      (*iter)->thread.join();
+    }
+
+    for (iter = workers.begin(); iter != workers.end(); ++iter) {
+      delete *iter;
+    }
+  }
+
+  /**
+   * @brief compile a program for this pool.
+   * @return the program (owned by the caller, it must outlive the pool)
+   * or 0 with the parser error in 'error'
+   */
+  inline Program *VMPool::compile(const char *source, std::string *error) {
+    std::lock_guard<std::mutex> guard(compileLock);
+
+    Program *program = compiler.compile(source);
+    if (!program && error) {
+      *error = compiler.getError();
+    }
+
+    return program;
+  }
+
+  /**
+   * @brief queue a job.
+   * @param inputs values to push before the program runs, the pool takes
+   * ownership of them
+   */
+  inline std::future<JobResult> VMPool::submit(const Program *program, const std::vector<Type *> &inputs) {
+    Job *job = new Job();
+    job->program = program;
+    job->inputs = inputs;
+    std::future<JobResult> result = job->promise.get_future();
+    enqueue(job);
+    return result;
+  }
+
+  /**
+   * @brief queue a job. The callback runs on the worker thread.
+   */
+  inline void VMPool::submit(const Program *program, const std::vector<Type *> &inputs, Callback callback) {
+    Job *job = new Job();
+    job->program = program;
+    job->inputs = inputs;
+    job->callback = callback;
+    enqueue(job);
+  }
+
+  inline unsigned int VMPool::size() const {
+    return workers.size();
+  }
+
+  inline PoolStatistics VMPool::getStatistics() const {
+    PoolStatistics statistics;
+    statistics.queued = pending.load();
+    statistics.completed = completed.load();
+    statistics.stolen = stolen.load();
+
+    long long total = totalLatency.load();
+    statistics.meanLatency = std::chrono::nanoseconds(statistics.completed ? total / (long long) statistics.completed : 0);
+    statistics.maxLatency = std::chrono::nanoseconds(maxLatency.load());
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    statistics.throughput = elapsed.count() > 0 ? statistics.completed / elapsed.count() : 0;
+    return statistics;
+  }
+
+  inline VMPool *&VMPool::currentPool() {
+    static thread_local VMPool *pool = 0;
+    return pool;
+  }
+
+  inline unsigned int &VMPool::currentWorker() {
+    static thread_local unsigned int worker = 0;
+    return worker;
+  }
+
+  inline void VMPool::enqueue(Job *job) {
+    job->submitted = std::chrono::steady_clock::now();
+
+    unsigned int index = currentPool() == this ? currentWorker() : next++ % workers.size();
+    {
+      std::lock_guard<std::mutex> guard(workers[index]->lock);
+      workers[index]->jobs.push_back(job);
+    }
+
+    {
+      // Counted under the lock, so that a worker can't miss the wake up
+      std::lock_guard<std::mutex> guard(sleepLock);
+      pending++;
+    }
+    wake.notify_one();
+  }
+
+  /**
+   * @brief the next job for a worker: the oldest of it's own, or the newest
+   * of another worker.
+   */
+  inline VMPool::Job *VMPool::take(unsigned int index) {
+    Job *job = 0;
+
+    {
+      Worker *worker = workers[index];
+      std::lock_guard<std::mutex> guard(worker->lock);
+      if (!worker->jobs.empty()) {
+        job = worker->jobs.front();
+        worker->jobs.pop_front();
+      }
+    }
+
+    for (unsigned int i = 1; !job && i < workers.size(); i++) {
+      Worker *victim = workers[(index + i) % workers.size()];
+      std::lock_guard<std::mutex> guard(victim->lock);
+      if (!victim->jobs.empty()) {
+        job = victim->jobs.back();
+        victim->jobs.pop_back();
+        stolen++;
+      }
+    }
+
+    if (job) {
+      pending--;
+    }
+
+    return job;
+  }
+
+  inline void VMPool::work(unsigned int index) {
+    currentPool() = this;
+    currentWorker() = index;
+
+    while (true) {
+      Job *job = take(index);
+      if (job) {
+        execute(index, job);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> guard(sleepLock);
+      if (pending == 0) {
+        if (stopping) {
+          return;
+        }
+
+        wake.wait(guard);
+      }
+    }
+  }
+
+  inline void VMPool::execute(unsigned int index, Job *job) {
+    VM &vm = workers[index]->vm;
+    Environment *env = vm.getEnvironment();
+    JobResult result;
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    result.queueTime = begin - job->submitted;
+
+    std::vector<Type *>::iterator iter;
+    for (iter = job->inputs.begin(); iter != job->inputs.end(); ++iter) {
+      env->push(*iter);
+    }
+
+    std::vector<Block *> definitions = env->saveDefinitions();
+
+    vm.eval(job->program);
+    result.status = vm.getStatus();
+    result.error = vm.getError();
+
+    if (vm.isSuspended()) {
+      vm.cancel();
+      result.status = VM::Failed;
+      result.error = "A job can't be suspended: " + result.error;
+    }
+
+    env->restoreDefinitions(definitions);
+
+    // Move the stack into the result. Values shared with the VM are copied.
+    result.values.resize(env->size());
+    for (unsigned int i = result.values.size(); i > 0; i--) {
+      result.values[i - 1] = env->popRaw()->unshare();
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    result.runTime = end - begin;
+    record(end - job->submitted);
+
+    if (job->callback) {
+      job->callback(result);
+    } else {
+      job->promise.set_value(std::move(result));
+    }
+
+    delete job;
+  }
+
+  inline void VMPool::record(std::chrono::nanoseconds latency) {
+    long long ns = latency.count();
+    totalLatency += ns;
+
+    long long max = maxLatency.load();
+    while (ns > max && !maxLatency.compare_exchange_weak(max, ns)) { }
+
+    completed++;
+  }
+}
+
+#endif // VMPOOL_H
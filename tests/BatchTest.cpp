@@ -0,0 +1,99 @@
+#include "Check.h"
+#include "Batch.h"
+
+#include <cmath>
+#include <cstdlib>
+
+using namespace PS;
+
+/**
+ * A vectorized batch must give the same results as the VM running the
+ * block row by row.
+ */
+static void compare(VM &vm, const char *source, unsigned int width, bool vectorized) {
+  std::string literal = std::string("{ ") + source + " }";
+  Environment *env = vm.eval(literal.c_str());
+  PS_CHECK(env && env->peekIs(Block_T));
+  if (!env) {
+    return;
+  }
+  Block *block = env->popBlock();
+
+  const size_t rows = 1000;
+  std::vector<double> inputs(rows * width);
+  std::vector<double> results(rows);
+  for (size_t i = 0; i < inputs.size(); i++) {
+    // Zeros and small integers hit the edges of comparisons and divisions
+    int kind = rand() % 4;
+    inputs[i] = kind == 0 ? 0 : kind == 1 ? (rand() % 7) - 3 : (rand() % 2000 - 1000) / 37.0;
+  }
+
+  Batch batch(&vm, block, width);
+  PS_CHECK(batch.isVectorized() == vectorized);
+  PS_CHECK(batch.run(inputs.data(), rows, results.data()));
+
+  for (size_t row = 0; row < rows; row++) {
+    for (unsigned int i = 0; i < width; i++) {
+      env->push(inputs[row * width + i]);
+    }
+
+    vm.run(block);
+    double expected = env->peekIs(Boolean_T) ? (env->pop<bool>() ? 1 : 0) : env->pop<double>();
+    if (!(expected == results[row] || (std::isnan(expected) && std::isnan(results[row])))) {
+      std::cerr << source << ": row " << row << std::endl;
+      PS_CHECK(expected == results[row]);
+      break;
+    }
+  }
+
+  block->release();
+}
+
+static void testVectorized() {
+  VM vm;
+  Stdlib::install(vm);
+  vm.eval("'sq' { dup * } def 'clamp' { dup 0 < { drop 0 } if dup 1 > { drop 1 } if } def "
+      "'countdown' { dup 0 > { 1 - countdown } if } def");
+
+  compare(vm, "+", 2, true);
+  compare(vm, "swap - 2 *", 2, true);
+  compare(vm, "/", 2, true);
+  compare(vm, "=", 2, true);
+  compare(vm, ">", 2, true);
+  compare(vm, "<", 2, true);
+  compare(vm, "dup 0 > { 2 * } { 0 swap - } ifelse", 1, true);
+  compare(vm, "clamp", 1, true);
+  compare(vm, "sq swap sq + 1 swap /", 2, true);
+  compare(vm, "dup 1 > { dup 2 > { 3 * } { 5 + } ifelse } { 1 - } ifelse", 1, true);
+  compare(vm, "drop drop 3", 2, true);
+
+  // Recursion and loops run row by row
+  compare(vm, "countdown", 1, false);
+  compare(vm, "{ 1 - dup 0 > } { } while", 1, false);
+}
+
+static void testWords() {
+  VM vm;
+  Stdlib::install(vm);
+
+  Environment *env = vm.eval("0 6 array-range 2 { * } batch-map 2 array-get");
+  PS_CHECK(env && env->pop<double>() == 20);
+
+  // A row that takes more than it's numbers fails without touching the
+  // values below
+  env = vm.eval("'below' 0 4 array-range 1 { drop drop drop } batch-map");
+  PS_CHECK(!env);
+  env = vm.getEnvironment();
+  PS_CHECK(env->size() == 1 && env->peekIs(String_T) && env->pop<std::string>() == "below");
+
+  env = vm.eval("7 0 4 array-range 2 { dup 2 > { drop 'x' } if } batch-map");
+  PS_CHECK(!env);
+  env = vm.getEnvironment();
+  PS_CHECK(env->size() == 1 && env->pop<double>() == 7);
+}
+
+int main() {
+  testVectorized();
+  testWords();
+  return Test::finish("BatchTest");
+}
@@ -0,0 +1,201 @@
+#include "Check.h"
+#include "Channel.h"
+
+#include <string>
+#include <thread>
+
+using namespace PS;
+
+static std::string withId(const char *before, long id, const char *after) {
+  return before + std::to_string(id) + after;
+}
+
+static void testQueues() {
+  SPSCChannel spsc(3);
+  MPMCChannel mpmc(3);
+  PS_CHECK(spsc.capacity() == 4 && mpmc.capacity() == 4);
+
+  Channel *channels[] = { &spsc, &mpmc };
+  for (unsigned int c = 0; c < 2; c++) {
+    Channel *channel = channels[c];
+    PS_CHECK(channel->tryReceive() == 0);
+
+    for (int i = 0; i < 4; i++) {
+      PS_CHECK(channel->trySend(new String(std::to_string(i))));
+    }
+
+    Type *extra = new String("4");
+    PS_CHECK(!channel->trySend(extra));
+    extra->release();
+
+    // First in, first out
+    for (int i = 0; i < 4; i++) {
+      Type *value = channel->tryReceive();
+      PS_CHECK(value && static_cast<String *>(value)->str() == std::to_string(i));
+      value->release();
+    }
+  }
+}
+
+static void testThreads() {
+  MPMCChannel channel(16);
+  const int count = 10000;
+  const int senders = 4;
+
+  std::vector<std::thread> threads;
+  for (int s = 0; s < senders; s++) {
+    threads.push_back(std::thread([&channel]() {
+      for (int i = 0; i < count; i++) {
+        channel.send(new String("1"));
+      }
+    }));
+  }
+
+  int received = 0;
+  for (int i = 0; i < count * senders; i++) {
+    Type *value = channel.receive();
+    received += static_cast<String *>(value)->str() == "1";
+    value->release();
+  }
+
+  for (unsigned int t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+
+  PS_CHECK(received == count * senders);
+}
+
+static void testWords() {
+  VM vm;
+  Stdlib::install(vm);
+
+  long id = (long) Test::evalNumber(vm, "4 chan-new");
+  PS_CHECK(Test::evalNumber(vm, withId("41 ", id, " chan-send 1 ").c_str()) == 1);
+  PS_CHECK(Test::evalNumber(vm, withId("", id, " chan-recv 1 +").c_str()) == 42);
+
+  // Strings are moved to the receiver
+  Environment *env = vm.eval(withId("'text' ", id, " chan-send ").append(withId("", id, " chan-recv")).c_str());
+  PS_CHECK(env && env->peekIs(String_T) && env->pop<std::string>() == "text");
+
+  // Nothing is taken from the stack if the value can't be sent
+  env = vm.getEnvironment();
+  unsigned int size = env->size();
+  PS_CHECK(!vm.eval(withId("{ 1 } ", id, " chan-send").c_str()));
+  PS_CHECK(vm.getError() == "Only numbers, strings and booleans can be sent");
+  PS_CHECK(env->size() == size + 2);
+  PS_CHECK(!vm.eval(withId("0 map-new 'a' 'b' map-put ", id, " chan-send").c_str()));
+  PS_CHECK(vm.getError() == "Only numbers, strings and booleans can be sent");
+  PS_CHECK(!vm.eval(withId("3 array-new ", id, " chan-send").c_str()));
+  PS_CHECK(vm.getError() == "Only numbers, strings and booleans can be sent");
+  PS_CHECK(env->size() == size + 6);
+  PS_CHECK(!vm.eval("1 12345 chan-send"));
+  PS_CHECK(env->size() == size + 8);
+  PS_CHECK(!vm.eval("1 0 1 - chan-send"));
+  PS_CHECK(vm.getError() == "Unknown channel");
+  PS_CHECK(!vm.eval("0 0 / chan-recv"));
+  PS_CHECK(vm.getError() == "Unknown channel");
+}
+
+static void testCapacity() {
+  VM vm;
+  Stdlib::install(vm);
+
+  // Capacities that would hang or exhaust the host are errors
+  const char *wrong[] = { "3000000000 chan-new", "0 0 / chan-new", "1 0 / chan-new-spsc", "0 chan-new", "0.5 chan-new-spsc" };
+  for (unsigned int i = 0; i < sizeof(wrong) / sizeof(wrong[0]); i++) {
+    PS_CHECK(!vm.eval(wrong[i]));
+    PS_CHECK(vm.getError() == "A channel needs a capacity between 1 and 1048576");
+  }
+
+  MPMCChannel largest(4000000000u);
+  PS_CHECK(largest.capacity() == Channel::MAX_CAPACITY);
+}
+
+static void testSuspend() {
+  VM vm;
+  Stdlib::install(vm);
+  long id = (long) Test::evalNumber(vm, "4 chan-new");
+  std::string receive = withId("", id, " chan-recv 1 +");
+
+  // An empty channel suspends the VM, resume doesn't wait for a value
+  PS_CHECK(!vm.eval(receive.c_str()));
+  PS_CHECK(vm.getStatus() == VM::Pending && vm.isSuspended());
+  PS_CHECK(!Channels::global().resume(vm));
+  PS_CHECK(vm.isSuspended());
+
+  // The value arrives from another thread
+  std::thread sender([id]() {
+    VM other;
+    Stdlib::install(other);
+    other.eval(withId("99 ", id, " chan-send").c_str());
+  });
+
+  Environment *env;
+  while (!(env = Channels::global().resume(vm)) && vm.isSuspended()) {
+    std::this_thread::yield();
+  }
+  sender.join();
+  PS_CHECK(env && env->pop<double>() == 100);
+
+  // A dropped wait doesn't take the value of a later evaluation
+  PS_CHECK(!vm.eval(receive.c_str()));
+  vm.cancel();
+  vm.eval(withId("7 ", id, " chan-send").c_str());
+  PS_CHECK(!Channels::global().resume(vm) && !vm.isSuspended());
+  PS_CHECK(Test::evalNumber(vm, receive.c_str()) == 8);
+}
+
+static void testClose() {
+  VM vm;
+  Stdlib::install(vm);
+  long id = (long) Test::evalNumber(vm, "4 chan-new");
+
+  // The values left in a closed channel are released with it
+  PS_CHECK(vm.eval(withId("'left' ", id, " chan-send ").append(withId("", id, " chan-close")).c_str()) != 0);
+  PS_CHECK(!vm.eval(withId("1 ", id, " chan-send").c_str()));
+  PS_CHECK(vm.getError() == "Unknown channel");
+  PS_CHECK(!vm.eval(withId("", id, " chan-close").c_str()));
+
+  // Slots are reused, with ids that are new
+  for (unsigned int i = 0; i < 3 * Channels::MAX_CHANNELS; i++) {
+    long other = (long) Test::evalNumber(vm, "1 chan-new dup chan-close");
+    PS_CHECK(other != id && other % Channels::MAX_CHANNELS == id % Channels::MAX_CHANNELS);
+  }
+
+  // A closed channel ends the wait of a suspended VM
+  id = (long) Test::evalNumber(vm, "1 chan-new-spsc");
+  PS_CHECK(!vm.eval(withId("", id, " chan-recv").c_str()));
+  PS_CHECK(vm.isSuspended());
+  PS_CHECK(Channels::global().close(id));
+  PS_CHECK(!Channels::global().resume(vm) && !vm.isSuspended());
+  PS_CHECK(vm.getError() == "The channel was closed");
+}
+
+static void testSingleProducer() {
+  VM vm;
+  Stdlib::install(vm);
+  long id = (long) Test::evalNumber(vm, "2 chan-new-spsc");
+  PS_CHECK(Test::evalNumber(vm, withId("5 ", id, " chan-send ").append(withId("", id, " chan-recv")).c_str()) == 5);
+
+  // This thread sends and receives, others can't
+  std::string error;
+  std::thread other([id, &error]() {
+    VM vm;
+    Stdlib::install(vm);
+    vm.eval(withId("6 ", id, " chan-send").c_str());
+    error = vm.getError();
+  });
+  other.join();
+  PS_CHECK(error == "Another thread sends to this channel");
+}
+
+int main() {
+  testQueues();
+  testThreads();
+  testWords();
+  testCapacity();
+  testSuspend();
+  testClose();
+  testSingleProducer();
+  return Test::finish("ChannelTest");
+}
@@ -0,0 +1,56 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <iostream>
+#include <limits>
+
+#include "PebbleScript.h"
+#include "Stdlib.h"
+
+namespace PS {
+  namespace Test {
+    /**
+     * @brief the number of failed checks of the test program
+     */
+    inline unsigned int &failures() {
+      static unsigned int count = 0;
+      return count;
+    }
+
+    inline void fail(const char *file, int line, const char *condition) {
+      std::cerr << file << ":" << line << ": check failed: " << condition << std::endl;
+      failures()++;
+    }
+
+    /**
+     * @brief the exit code of the test program, reports the failures
+     */
+    inline int finish(const char *name) {
+      if (failures()) {
+        std::cerr << name << ": " << failures() << " failed" << std::endl;
+        return 1;
+      }
+
+      std::cout << name << ": ok" << std::endl;
+      return 0;
+    }
+
+    /**
+     * @brief evaluate a script and pop the number it leaves on top,
+     * NaN if it failed or left something else.
+     */
+    inline double evalNumber(VM &vm, const char *source) {
+      Environment *env = vm.eval(source);
+      if (!env || !env->peekIs(Number_T)) {
+        return std::numeric_limits<double>::quiet_NaN();
+      }
+
+      return env->pop<double>();
+    }
+  }
+}
+
+#define PS_CHECK(condition) \
+  do { if (!(condition)) PS::Test::fail(__FILE__, __LINE__, #condition); } while (0)
+
+#endif // CHECK_H
@@ -0,0 +1,67 @@
+#include "Check.h"
+
+using namespace PS;
+
+/**
+ * Copy on write: a word changes a value in place only if the stack holds
+ * the only reference, otherwise it works on a copy.
+ */
+static void testStrings() {
+  VM vm;
+  Stdlib::install(vm);
+  Environment *env = vm.getEnvironment();
+
+  String *text = new String("peb");
+  env->push(text);
+  env = vm.eval("'ble' concat");
+  PS_CHECK(env && env->peekIs(String_T));
+  Type *result = env->popRaw();
+  PS_CHECK(result == text);
+  PS_CHECK(static_cast<String *>(result)->str() == "pebble");
+  result->release();
+
+  // Shared: the original stays as it was
+  text = new String("peb");
+  env = vm.getEnvironment();
+  env->push(text->retain());
+  env = vm.eval("'ble' concat");
+  result = env->popRaw();
+  PS_CHECK(result != text);
+  PS_CHECK(text->str() == "peb" && text->references == 1);
+  PS_CHECK(static_cast<String *>(result)->str() == "pebble");
+  result->release();
+  text->release();
+}
+
+static void testArrays() {
+  VM vm;
+  Stdlib::install(vm);
+
+  Array *array = new Array(3);
+  Environment *env = vm.getEnvironment();
+  env->push(array);
+  env = vm.eval("1 7 array-set");
+  Type *result = env->popRaw();
+  PS_CHECK(result == array && array->value[1] == 7);
+  result->release();
+
+  array = new Array(3);
+  env = vm.getEnvironment();
+  env->push(array->retain());
+  env = vm.eval("1 7 array-set");
+  result = env->popRaw();
+  PS_CHECK(result != array && array->value[1] == 0 && array->references == 1);
+  PS_CHECK(static_cast<Array *>(result)->value[1] == 7);
+  result->release();
+  array->release();
+
+  // dup shares, the change only shows in one of them
+  env = vm.eval("0 5 array-range dup 2 100 array-set 2 array-get swap 2 array-get");
+  PS_CHECK(env && env->pop<double>() == 2 && env->pop<double>() == 100);
+}
+
+int main() {
+  testStrings();
+  testArrays();
+  return Test::finish("CowTest");
+}
@@ -0,0 +1,99 @@
+#include "Check.h"
+
+#include <climits>
+#include <cmath>
+
+using namespace PS;
+
+/**
+ * The NaN-boxed Item and the integer overflow fallback
+ */
+static void testBoxing() {
+  Item number(2.5);
+  PS_CHECK(number.isNumber() && number.type() == Number_T && number.asNumber() == 2.5);
+
+  // A NaN with the tag bits set must not turn into a tagged item
+  Item nan(std::nan(""));
+  PS_CHECK(nan.isNumber() && std::isnan(nan.asNumber()));
+  Item negativeNan(-std::nan(""));
+  PS_CHECK(negativeNan.isNumber() && !negativeNan.isObject());
+
+  Item yes(true);
+  Item no(false);
+  PS_CHECK(yes.isBoolean() && yes.asBoolean() && yes.type() == Boolean_T);
+  PS_CHECK(no.isBoolean() && !no.asBoolean() && !no.isNumber());
+
+  Item small = Item::integer(-42);
+  PS_CHECK(small.isSmallInteger() && small.type() == Integer_T && small.asInteger() == -42);
+  PS_CHECK(small.asDouble() == -42.0);
+
+  // The largest integers don't fit in 48 bits and are boxed
+  Item largest = Item::integer((1LL << 47) - 1);
+  PS_CHECK(largest.isSmallInteger() && largest.asInteger() == (1LL << 47) - 1);
+  Item boxed = Item::integer(1LL << 47);
+  PS_CHECK(!boxed.isSmallInteger() && boxed.isInteger() && boxed.asInteger() == (1LL << 47));
+  PS_CHECK(boxed.isObject() && boxed.asObject()->type == Integer_T);
+  boxed.asObject()->release();
+
+  String *text = new String("pebble");
+  Item object(text);
+  PS_CHECK(object.isObject() && object.type() == String_T && object.asObject() == text);
+  text->release();
+}
+
+static void testIntegers() {
+  VM vm;
+  Stdlib::install(vm);
+
+  Environment *env = vm.eval("7 2 /");
+  PS_CHECK(env && env->pop<double>() == 3.5);
+
+  env = vm.eval("6 2 /");
+  PS_CHECK(env && env->peek().isInteger() && env->pop<long long>() == 3);
+
+  // Leaving the inline range boxes the result
+  env = vm.eval("140737488355327 1 +");
+  PS_CHECK(env && env->peek().isInteger() && env->pop<long long>() == 140737488355328LL);
+
+  // Overflowing 64 bits falls back to a number
+  env = vm.eval("9223372036854775807 1 +");
+  PS_CHECK(env && !env->peek().isInteger() && env->pop<double>() == 9223372036854775808.0);
+
+  env = vm.eval("3037000500 3037000500 *");
+  PS_CHECK(env && !env->peek().isInteger());
+  env->pop<double>();
+
+  env = vm.eval("3037000499 3037000499 *");
+  PS_CHECK(env && env->pop<long long>() == 9223372030926249001LL);
+
+  // Integer loop counts
+  PS_CHECK(Test::evalNumber(vm, "0 10 { + } times") == 45);
+  PS_CHECK(Test::evalNumber(vm, "0 3 { 2 + } repeat") == 6);
+}
+
+static void testOverflow() {
+  using Util::NumericUtils;
+  long long r;
+
+  PS_CHECK(!NumericUtils::addOverflows(LLONG_MAX - 1, 1, &r) && r == LLONG_MAX);
+  PS_CHECK(NumericUtils::addOverflows(LLONG_MAX, 1, &r));
+  PS_CHECK(NumericUtils::addOverflows(LLONG_MIN, -1, &r));
+  PS_CHECK(!NumericUtils::subOverflows(LLONG_MIN + 1, 1, &r) && r == LLONG_MIN);
+  PS_CHECK(NumericUtils::subOverflows(0, LLONG_MIN, &r));
+  PS_CHECK(!NumericUtils::mulOverflows(-1, LLONG_MAX, &r) && r == -LLONG_MAX);
+  PS_CHECK(NumericUtils::mulOverflows(-1, LLONG_MIN, &r));
+  PS_CHECK(NumericUtils::mulOverflows(3037000500LL, -3037000500LL, &r));
+
+  // Literals that don't fit in 64 bits are numbers
+  VM vm;
+  Stdlib::install(vm);
+  Environment *env = vm.eval("9223372036854775808");
+  PS_CHECK(env && !env->peek().isInteger() && env->pop<double>() == 9223372036854775808.0);
+}
+
+int main() {
+  testBoxing();
+  testIntegers();
+  testOverflow();
+  return Test::finish("ItemTest");
+}
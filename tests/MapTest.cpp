@@ -0,0 +1,149 @@
+#include "Check.h"
+
+#include <cmath>
+
+using namespace PS;
+
+static void testEntries() {
+  Map *map = new Map(0);
+  for (int i = 0; i < 1000; i++) {
+    map->put(Item((double) i), Item((double) i * 2));
+  }
+
+  PS_CHECK(map->size() == 1000);
+
+  Item value;
+  PS_CHECK(map->get(Item(999.0), value) && value.asDouble() == 1998);
+  PS_CHECK(!map->get(Item(1000.0), value));
+
+  // Integers and numbers with the same value are the same key
+  PS_CHECK(map->get(Item::integer(7), value) && value.asDouble() == 14);
+
+  for (int i = 0; i < 1000; i += 2) {
+    PS_CHECK(map->remove(Item((double) i)));
+  }
+
+  PS_CHECK(map->size() == 500);
+  PS_CHECK(!map->get(Item(4.0), value));
+  PS_CHECK(map->get(Item(5.0), value) && value.asDouble() == 10);
+  PS_CHECK(!map->remove(Item(4.0)));
+
+  // Replacing keeps the size
+  map->put(Item(5.0), Item(true));
+  PS_CHECK(map->size() == 500 && map->get(Item(5.0), value) && value.asBoolean());
+
+  size_t entries = 0;
+  for (size_t slot = 0; slot < map->getCapacity(); slot++) {
+    entries += map->isFull(slot);
+  }
+  PS_CHECK(entries == 500);
+
+  PS_CHECK(Map::isKey(Item(1.5)));
+  PS_CHECK(!Map::isKey(Item(std::nan(""))));
+  PS_CHECK(!Map::isKey(Item(true)));
+
+  map->release();
+}
+
+static void testStringKeys() {
+  Map *map = new Map(2);
+  map->put(Item(new String("a")), Item(1.0));
+
+  // Equal strings are the same key, whatever object holds them
+  String *key = new String("a");
+  Item value;
+  PS_CHECK(map->get(Item(key), value) && value.asDouble() == 1);
+  map->put(Item(key->retain()), Item(2.0));
+  PS_CHECK(map->size() == 1 && map->get(Item(key), value) && value.asDouble() == 2);
+
+  key->release();
+  map->release();
+}
+
+static void testMemory() {
+  size_t before = Map::totalMemory();
+
+  Map *map = new Map(100);
+  PS_CHECK(Map::totalMemory() == before + map->memoryUse());
+
+  // Growing is accounted for
+  for (int i = 0; i < 10000; i++) {
+    map->put(Item((double) i), Item((double) i));
+  }
+  PS_CHECK(Map::totalMemory() == before + map->memoryUse());
+
+  Map *copy = map->clone();
+  PS_CHECK(Map::totalMemory() == before + map->memoryUse() + copy->memoryUse());
+  copy->release();
+  map->release();
+  PS_CHECK(Map::totalMemory() == before);
+
+  // Maps inside other maps count as well
+  VM vm;
+  Stdlib::install(vm);
+  double outer = Test::evalNumber(vm, "0 map-new map-memory swap drop");
+  double nested = Test::evalNumber(vm, "0 map-new 'inner' 1000 map-new map-put map-memory swap drop");
+  PS_CHECK(nested > outer);
+  PS_CHECK(Map::totalMemory() == before);
+
+  // A table that can't exist is not allocated
+  bool thrown = false;
+  try {
+    new Map(~(size_t) 0);
+  } catch (std::bad_alloc &) {
+    thrown = true;
+  }
+  PS_CHECK(thrown && Map::totalMemory() == before);
+}
+
+static void testCopyOnWrite() {
+  VM vm;
+  Stdlib::install(vm);
+
+  // A shared map is copied shallowly, values are shared with the copy
+  Map *map = new Map(4);
+  String *value = new String("value");
+  map->put(Item(1.0), Item(value));
+
+  Environment *env = vm.getEnvironment();
+  env->push(map->retain());
+  env = vm.eval("2 'two' map-put");
+  Map *result = static_cast<Map *>(env->popRaw());
+  PS_CHECK(result != map && map->size() == 1 && result->size() == 2);
+
+  Item found;
+  PS_CHECK(result->get(Item(1.0), found) && found.asObject() == value);
+  PS_CHECK(value->references == 2);
+
+  result->release();
+  PS_CHECK(value->references == 1);
+
+  // Not shared: changed in place
+  env = vm.getEnvironment();
+  env->push(map);
+  env = vm.eval("2 'two' map-put");
+  result = static_cast<Map *>(env->popRaw());
+  PS_CHECK(result == map && map->size() == 2);
+  result->release();
+}
+
+static void testWords() {
+  VM vm;
+  Stdlib::install(vm);
+
+  PS_CHECK(Test::evalNumber(vm, "0 map-new 'a' 1 map-put 'b' 2 map-put 'b' map-get") == 2);
+  PS_CHECK(Test::evalNumber(vm, "100 map-new 2000 { dup 2 * map-put } times map-size") == 2000);
+  PS_CHECK(Test::evalNumber(vm, "0 map-new 'x' 1 map-put 'y' 2 map-put 0 swap { swap drop + } map-each") == 3);
+
+  // A missing key is an error
+  PS_CHECK(!vm.eval("0 map-new 'z' map-get"));
+}
+
+int main() {
+  testEntries();
+  testStringKeys();
+  testMemory();
+  testCopyOnWrite();
+  testWords();
+  return Test::finish("MapTest");
+}
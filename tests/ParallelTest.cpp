@@ -0,0 +1,45 @@
+#include "Check.h"
+
+using namespace PS;
+
+/**
+ * pmap-range and preduce
+ */
+static void testWords() {
+  VM vm;
+  Stdlib::install(vm);
+
+  Environment *env = vm.eval("0 100 { dup * } pmap-range");
+  PS_CHECK(env && env->size() == 100);
+  for (int i = 99; env && i >= 0; i--) {
+    PS_CHECK(env->pop<double>() == i * i);
+  }
+
+  PS_CHECK(Test::evalNumber(vm, "1 1001 0 { + } { } preduce") == 500500);
+  PS_CHECK(Test::evalNumber(vm, "0 0 7 { + } { } preduce") == 7);
+
+  // Worker VMs are reused, they see the words defined since
+  for (int i = 0; i < 20; i++) {
+    PS_CHECK(Test::evalNumber(vm, "0 64 0 { + } { 2 * } preduce") == 4032);
+  }
+
+  // A failing combine stops the reduction, the error is reported
+  PS_CHECK(!vm.eval("0 10 0 { 'x' concat } { } preduce"));
+  PS_CHECK(!vm.getError().empty());
+  PS_CHECK(Test::evalNumber(vm, "0 4 0 { + } { } preduce") == 6);
+
+  // A failing body fails the word
+  PS_CHECK(!vm.eval("0 10 { 'x' + } pmap-range"));
+
+  // Wrong operands are reported before anything is taken from the stack
+  Environment *stack = vm.getEnvironment();
+  unsigned int size = stack->size();
+  PS_CHECK(!vm.eval("0 'x' 0 { + } { } preduce"));
+  PS_CHECK(vm.getError() == "assertion failed: expected (block, block, any, number, number) but found: (block, block, integer, string, integer).");
+  PS_CHECK(stack->size() == size + 5);
+}
+
+int main() {
+  testWords();
+  return Test::finish("ParallelTest");
+}
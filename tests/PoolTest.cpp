@@ -0,0 +1,57 @@
+#include "Check.h"
+#include "VMPool.h"
+
+using namespace PS;
+
+/**
+ * Jobs on the VMPool
+ */
+static void setup(VM &vm) {
+  Stdlib::install(vm);
+  vm.setFuel(10000);
+}
+
+static void testPool() {
+  VMPool pool(2, setup);
+  std::string error;
+
+  // Words defined by a job are gone for the next one
+  Program *define = pool.compile("'secret' { 42 } def secret", &error);
+  Program *use = pool.compile("secret", &error);
+  PS_CHECK(define && use);
+
+  for (int i = 0; i < 8; i++) {
+    JobResult defined = pool.submit(define, std::vector<Type *>()).get();
+    PS_CHECK(defined.status == VM::Finished && defined.values.size() == 1);
+
+    JobResult used = pool.submit(use, std::vector<Type *>()).get();
+    PS_CHECK(used.status == VM::Failed);
+  }
+
+  // Inputs are pushed before the program runs
+  Program *concat = pool.compile("concat", &error);
+  std::vector<Type *> inputs;
+  inputs.push_back(new String("a"));
+  inputs.push_back(new String("b"));
+  JobResult added = pool.submit(concat, inputs).get();
+  PS_CHECK(added.status == VM::Finished);
+  PS_CHECK(added.values.size() == 1 && static_cast<String *>(added.values[0])->str() == "ab");
+
+  // A job that runs out of fuel can't be resumed, it fails
+  Program *forever = pool.compile("1 { 1 + dup 0 > } { } while", &error);
+  JobResult stopped = pool.submit(forever, std::vector<Type *>()).get();
+  PS_CHECK(stopped.status == VM::Failed && !stopped.error.empty());
+
+  JobResult after = pool.submit(define, std::vector<Type *>()).get();
+  PS_CHECK(after.status == VM::Finished);
+
+  delete define;
+  delete use;
+  delete concat;
+  delete forever;
+}
+
+int main() {
+  testPool();
+  return Test::finish("PoolTest");
+}
@@ -0,0 +1,113 @@
+#include "Check.h"
+
+#include <thread>
+
+using namespace PS;
+
+/**
+ * Programs: frozen blocks shared between VMs, deleted with all their values.
+ */
+static void testLifetime() {
+  for (int i = 0; i < 20; i++) {
+    Program *program;
+    {
+      VM vm;
+      Stdlib::install(vm);
+      program = vm.compile(
+          "'f' { { 1 2 + } { 'abc' 'def' concat } ifelse } def "
+          "'g' { 0 10 { { 1 + } { 2 + } 3 } times } def "
+          "1 1 = f drop 0 50 { 2 * } pmap-range");
+      PS_CHECK(program != 0);
+      PS_CHECK(vm.eval(program) != 0);
+    }
+
+    // The VM is gone, deleting the program frees every block and constant
+    delete program;
+  }
+}
+
+static void testShared() {
+  VM compiler;
+  Stdlib::install(compiler);
+  Program *program = compiler.compile("0 1000 { drop 3 + } times");
+
+  const int threads = 4;
+  double results[threads];
+  std::vector<std::thread> runners;
+  for (int t = 0; t < threads; t++) {
+    runners.push_back(std::thread([program, &results, t]() {
+      VM vm;
+      Stdlib::install(vm);
+      Environment *env = vm.eval(program);
+      results[t] = env ? env->pop<double>() : -1;
+    }));
+  }
+
+  for (int t = 0; t < threads; t++) {
+    runners[t].join();
+    PS_CHECK(results[t] == 3000);
+  }
+
+  delete program;
+}
+
+static void testCallSites() {
+  VM vm;
+  Stdlib::install(vm);
+  vm.eval("'sq' { dup * } def");
+
+  // The calls of frozen blocks are cached by each VM
+  Program *program = vm.compile("0 1000 { drop 3 sq + } times");
+  Environment *env = vm.eval(program);
+  PS_CHECK(env && env->pop<double>() == 9000);
+
+  // A new definition is picked up
+  vm.eval("'sq' { dup dup * * } def");
+  env = vm.eval(program);
+  PS_CHECK(env && env->pop<double>() == 27000);
+
+  // Programs freed and allocated again don't see the calls of the old ones
+  for (int i = 0; i < 50; i++) {
+    Program *other = vm.compile(i % 2 ? "2 sq" : "5 sq 1 +");
+    env = vm.eval(other);
+    PS_CHECK(env && env->pop<double>() == (i % 2 ? 8 : 126));
+    delete other;
+  }
+
+  delete program;
+}
+
+static void testLiterals() {
+  VM vm;
+  Stdlib::install(vm);
+  size_t interned = StringTable::global().size();
+
+  // Long literals belong to the program, not to the StringTable
+  std::string text(StringTable::MAX_LENGTH + 1, 'x');
+  for (int i = 0; i < 20; i++) {
+    Program *program = vm.compile(("'" + text + std::to_string(i) + "' length").c_str());
+    Environment *env = vm.eval(program);
+    PS_CHECK(env && env->pop<double>() == text.size() + std::to_string(i).size());
+    delete program;
+  }
+  PS_CHECK(StringTable::global().size() == interned);
+
+  // Short ones are interned once
+  Environment *env = vm.eval("'short' 'short' =");
+  PS_CHECK(env && env->pop<bool>());
+  PS_CHECK(StringTable::global().size() == interned + 1);
+
+  // Equal strings are equal, interned or not
+  env = vm.eval(("'" + text + "' '" + text + "' =").c_str());
+  PS_CHECK(env && env->pop<bool>());
+  env = vm.eval("'sh' 'ort' concat 'short' =");
+  PS_CHECK(env && env->pop<bool>());
+}
+
+int main() {
+  testLifetime();
+  testShared();
+  testCallSites();
+  testLiterals();
+  return Test::finish("ProgramTest");
+}
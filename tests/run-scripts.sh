@@ -0,0 +1,22 @@
+#!/bin/bash
+# Runs every script in scripts/ and compares the output with the .out file
+# next to it. usage: run-scripts.sh pebbles [record]
+BIN=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+cd "$(dirname "$0")/scripts" || exit 1
+
+failed=0
+for script in *.peb; do
+  output=$("$BIN" "$script" 2>&1)
+  expected=${script%.peb}.out
+
+  if [ "$2" = record ]; then
+    echo "$output" > "$expected"
+  elif [ "$output" != "$(cat "$expected")" ]; then
+    echo "$script: failed"
+    diff <(echo "$output") "$expected"
+    failed=1
+  fi
+done
+
+[ $failed = 0 ] && echo "scripts: ok"
+exit $failed